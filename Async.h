@@ -1,4 +1,10 @@
 #pragma once
 
+#include "details/Coroutine.h"
 #include "details/Observe.h"
-#include "details/Task.h"
\ No newline at end of file
+#include "details/Parallel.h"
+#include "details/PriorityExecutor.h"
+#include "details/Task.h"
+#include "details/Timer.h"
+#include "details/WhenAll.h"
+#include "details/WorkStealingExecutor.h"
\ No newline at end of file
@@ -0,0 +1,697 @@
+// Benchmarks of the library, built like the tests:
+//   g++ -std=c++11 -O2 -pthread -I. bench_asynctask.cpp -o bench_asynctask
+// Run all of them, or the ones named on the command line:
+//   ./bench_asynctask [name...]
+// The scaling benchmarks go up to the hardware threads, and at least to 4 threads (16 producers
+// for the queues), so on fewer cores than threads they only show the overhead, not the speedup.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Async.h"
+
+// keeps an emulated call from being inlined and its copies optimized out
+#if defined(__GNUC__)
+#define BENCH_NOINLINE __attribute__((noinline))
+#else
+#define BENCH_NOINLINE
+#endif
+
+namespace {
+
+    typedef std::chrono::steady_clock Clock;
+
+    double NanosecondsPer(Clock::time_point start, size_t count)
+    {
+        return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / count;
+    }
+
+    // 1, 2, 4... up to the hardware threads, and at least up to atLeast
+    std::vector<size_t> ThreadCounts(size_t atLeast = 4)
+    {
+        const size_t hardware = std::max<size_t>(std::thread::hardware_concurrency(), atLeast);
+
+        std::vector<size_t> counts;
+        for (size_t count = 1; count < hardware; count *= 2)
+            counts.push_back(count);
+        counts.push_back(hardware);
+        return counts;
+    }
+
+    /////////////////////////////////////////////////
+    /// executor: ThreadPoolExecutor vs WorkStealingExecutor
+    /////////////////////////////////////////////////
+    // tiny tasks spawned from inside a running task, flat from one task,
+    // or as a binary tree where every task spawns two, so idle workers have to steal
+    struct FanOut
+    {
+        std::atomic<size_t> Remaining;
+        std::promise<void> Done;
+
+        explicit FanOut(size_t count)
+            : Remaining(count)
+        {}
+
+        void Finish()
+        {
+            if (Remaining.fetch_sub(1) == 1)
+                Done.set_value();
+        }
+    };
+
+    void SpawnTree(std::shared_ptr<FanOut> fanOut, size_t depth)
+    {
+        if (depth > 0)
+        {
+            for (int child = 0; child < 2; child++)
+            {
+                Async::Spawn([fanOut, depth] {
+                    SpawnTree(fanOut, depth - 1);
+                }).Run();
+            }
+        }
+        fanOut->Finish();
+    }
+
+    double FlatFanOut(Async::iExecutor::ptr executor, size_t count)
+    {
+        auto fanOut = std::make_shared<FanOut>(count);
+        auto done = fanOut->Done.get_future();
+
+        auto start = Clock::now();
+        Async::Spawn([fanOut, count] {
+            for (size_t i = 0; i < count; i++)
+            {
+                Async::Spawn([fanOut] {
+                    fanOut->Finish();
+                }).Run();
+            }
+        }).Run(executor);
+        done.wait();
+        return NanosecondsPer(start, count);
+    }
+
+    double TreeFanOut(Async::iExecutor::ptr executor, size_t depth)
+    {
+        const size_t count = (size_t(1) << (depth + 1)) - 1;
+        auto fanOut = std::make_shared<FanOut>(count);
+        auto done = fanOut->Done.get_future();
+
+        auto start = Clock::now();
+        Async::Spawn([fanOut, depth] {
+            SpawnTree(fanOut, depth);
+        }).Run(executor);
+        done.wait();
+        return NanosecondsPer(start, count);
+    }
+
+    void BenchExecutor()
+    {
+        const size_t flatCount = 200000, treeDepth = 17;
+
+        std::printf("ns per task, %zu tasks spawned from one task, and a tree of %zu tasks\n",
+            flatCount, (size_t(1) << (treeDepth + 1)) - 1);
+        std::printf("%8s %14s %14s %14s %14s\n", "threads", "pool flat", "stealing flat", "pool tree", "stealing tree");
+        for (auto threads : ThreadCounts())
+        {
+            auto pool = Async::ThreadPoolExecutor::New(threads);
+            auto stealing = Async::WorkStealingExecutor::New(threads);
+            std::printf("%8zu %14.0f %14.0f %14.0f %14.0f\n", threads,
+                FlatFanOut(pool, flatCount), FlatFanOut(stealing, flatCount),
+                TreeFanOut(pool, treeDepth), TreeFanOut(stealing, treeDepth));
+        }
+    }
+
+    /////////////////////////////////////////////////
+    /// queue: locked deque vs MPMC ring
+    /////////////////////////////////////////////////
+    // PushOne/PopOne throughput, in millions of objects per second, through a queue of 4096
+    template<typename QueueType>
+    double QueueThroughput(size_t producers, size_t consumers, size_t count)
+    {
+        auto queue = QueueType::New(nullptr, 4096);
+        const size_t perProducer = count / producers;
+
+        auto start = Clock::now();
+        std::vector<std::thread> consumerThreads;
+        for (size_t i = 0; i < consumers; i++)
+        {
+            consumerThreads.emplace_back([queue] {
+                int object;
+                while (queue->PopOne(object).IsSuccess())
+                {}
+            });
+        }
+
+        std::vector<std::thread> producerThreads;
+        for (size_t i = 0; i < producers; i++)
+        {
+            producerThreads.emplace_back([queue, perProducer] {
+                for (size_t j = 0; j < perProducer; j++)
+                    queue->PushOne(int(j));
+            });
+        }
+
+        for (auto& thread : producerThreads)
+            thread.join();
+        queue->Close();
+        for (auto& thread : consumerThreads)
+            thread.join();
+
+        return 1e3 / NanosecondsPer(start, perProducer * producers);
+    }
+
+    void BenchQueue()
+    {
+        const size_t count = 1000000;
+
+        std::printf("M objects/s, %zu objects through a queue of 4096\n", count);
+        std::printf("%10s %10s %10s %10s\n", "producers", "consumers", "locked", "mpmc");
+        for (auto threads : ThreadCounts(16))
+        {
+            std::printf("%10zu %10d %10.2f %10.2f\n", threads, 1,
+                QueueThroughput<Async::ObservableQueue<int> >(threads, 1, count),
+                QueueThroughput<Async::ObservableQueue<int, Async::MpmcPolicy> >(threads, 1, count));
+        }
+        for (auto threads : ThreadCounts())
+        {
+            std::printf("%10zu %10zu %10.2f %10.2f\n", threads, threads,
+                QueueThroughput<Async::ObservableQueue<int> >(threads, threads, count),
+                QueueThroughput<Async::ObservableQueue<int, Async::MpmcPolicy> >(threads, threads, count));
+        }
+    }
+
+    /////////////////////////////////////////////////
+    /// observe: ObserveTask::Run(concurrency)
+    /////////////////////////////////////////////////
+    // objects per second through ReceiveOne by concurrency workers draining one queue,
+    // with a handler waiting on I/O, or burning the CPU
+    template<typename HandlerFunction>
+    double ObserveThroughput(size_t workers, size_t count, HandlerFunction handler)
+    {
+        auto queue = Async::ObservableQueue<int>::New();
+        for (size_t i = 0; i < count; i++)
+            queue->PushOne(int(i));
+        queue->Close();
+
+        auto start = Clock::now();
+        Async::Observe(
+            queue
+        ).ReceiveOne(handler).Run(workers)->Join();
+        return 1e9 / NanosecondsPer(start, count);
+    }
+
+    void BenchObserve()
+    {
+        const size_t count = 4000;
+        auto io = [](int) {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        };
+        auto cpu = [](int object) {
+            volatile unsigned value = unsigned(object);
+            for (int i = 0; i < 20000; i++)
+                value = value * 1664525u + 1013904223u;
+        };
+
+        std::printf("objects/s, %zu objects through ReceiveOne, a 200us sleep or 20k multiply-adds each\n", count);
+        std::printf("%8s %12s %12s\n", "workers", "io", "cpu");
+        for (size_t workers = 1; workers <= 32; workers *= 2)
+        {
+            std::printf("%8zu %12.0f %12.0f\n", workers,
+                ObserveThroughput(workers, count, io), ObserveThroughput(workers, count, cpu));
+        }
+    }
+
+    /////////////////////////////////////////////////
+    /// sync: RunMode_Sync inline vs on a new thread
+    /////////////////////////////////////////////////
+    // a two-step chain run synchronously, inline as RunMode_Sync does now, or on a thread
+    // created and joined per run as it did before
+    void BenchSync()
+    {
+        const size_t inlineRuns = 1000000, threadRuns = 20000;
+        int sum = 0;
+        auto task = Async::Spawn([] {
+            return 1;
+        }).Get([&sum](int value) {
+            sum += value;
+        });
+
+        auto start = Clock::now();
+        for (size_t i = 0; i < inlineRuns; i++)
+            task.Run(Async::RunMode::RunMode_Sync);
+        const double inlineCost = NanosecondsPer(start, inlineRuns);
+
+        start = Clock::now();
+        for (size_t i = 0; i < threadRuns; i++)
+        {
+            std::thread([&task] {
+                task.Run(Async::RunMode::RunMode_Sync);
+            }).join();
+        }
+        const double threadCost = NanosecondsPer(start, threadRuns);
+
+        std::printf("ns per run of a Spawn/Get chain, %zu runs inline, %zu on a new thread\n", inlineRuns, threadRuns);
+        std::printf("%12s %12s\n", "inline", "new thread");
+        std::printf("%12.0f %12.0f\n", inlineCost, threadCost);
+        if (sum != int(inlineRuns + threadRuns))
+            std::printf("unexpected sum %d\n", sum);
+    }
+
+    /////////////////////////////////////////////////
+    /// chain: runtime Then/Get chain vs fused chain
+    /////////////////////////////////////////////////
+    // ns per object through ReceiveOne, depth - 2 Get(+1) stages and a summing stage,
+    // built at runtime, or fused at compile time by ReceiveOneFused
+    struct PlusOne
+    {
+        int operator()(int value) const
+        {
+            return value + 1;
+        }
+    };
+
+    template<size_t Remaining>
+    struct FusedStages
+    {
+        template<typename Chain>
+        static auto Add(Chain&& chain) -> decltype(FusedStages<Remaining - 1>::Add(std::move(chain).Get(PlusOne())))
+        {
+            return FusedStages<Remaining - 1>::Add(std::move(chain).Get(PlusOne()));
+        }
+    };
+
+    template<>
+    struct FusedStages<0>
+    {
+        template<typename Chain>
+        static typename std::decay<Chain>::type Add(Chain&& chain)
+        {
+            return std::move(chain);
+        }
+    };
+
+    Async::ObserveTask<int> RuntimeStages(Async::ObserveTask<int> task, size_t remaining)
+    {
+        return remaining == 0 ? task : RuntimeStages(task.Get(PlusOne()), remaining - 1);
+    }
+
+    std::shared_ptr<Async::ObservableQueue<int> > FilledQueue(size_t count)
+    {
+        auto queue = Async::ObservableQueue<int>::New();
+        for (size_t i = 0; i < count; i++)
+            queue->PushOne(int(i));
+        queue->Close();
+        return queue;
+    }
+
+    double RunRuntimeChain(size_t depth, size_t count)
+    {
+        auto queue = FilledQueue(count);
+        long long sum = 0;
+        auto task = RuntimeStages(Async::Observe(
+            queue
+        ).ReceiveOne([](int object) {
+            return object;
+        }), depth - 2).Get([&sum](int value) {
+            sum += value;
+        });
+
+        auto start = Clock::now();
+        task.Run()->Join();
+        return NanosecondsPer(start, count);
+    }
+
+    template<size_t Depth>
+    double RunFusedChain(size_t count)
+    {
+        auto queue = FilledQueue(count);
+        long long sum = 0;
+        auto chain = FusedStages<Depth - 2>::Add(Async::Observe(
+            queue
+        ).ReceiveOneFused([](int object) {
+            return object;
+        })).Get([&sum](int value) {
+            sum += value;
+        });
+
+        auto start = Clock::now();
+        std::move(chain).Run()->Join();
+        return NanosecondsPer(start, count);
+    }
+
+    void BenchChain()
+    {
+        const size_t count = 1000000;
+
+        std::printf("ns per object, %zu objects through a chain of depth stages\n", count);
+        std::printf("%8s %10s %10s\n", "depth", "runtime", "fused");
+        std::printf("%8d %10.0f %10.0f\n", 2, RunRuntimeChain(2, count), RunFusedChain<2>(count));
+        std::printf("%8d %10.0f %10.0f\n", 4, RunRuntimeChain(4, count), RunFusedChain<4>(count));
+        std::printf("%8d %10.0f %10.0f\n", 8, RunRuntimeChain(8, count), RunFusedChain<8>(count));
+        std::printf("%8d %10.0f %10.0f\n", 16, RunRuntimeChain(16, count), RunFusedChain<16>(count));
+        std::printf("%8d %10.0f %10.0f\n", 32, RunRuntimeChain(32, count), RunFusedChain<32>(count));
+    }
+
+    /////////////////////////////////////////////////
+    /// notify: Notify with and without a subscriber
+    /////////////////////////////////////////////////
+    // ns per Notify of an int or a 40-byte string, outside of a task, or inside of a task with a
+    // Notified handler. It is compared to the Notify before, emulated: the payload taken by value
+    // and the std::function handler copied per call
+    template<typename NotifyData>
+    BENCH_NOINLINE void CopyingNotify(NotifyData data, const std::function<void(const NotifyData&)> *handler)
+    {
+        auto copy = *handler;
+        if (copy)
+            copy(data);
+    }
+
+    template<typename NotifyData>
+    std::pair<double, double> NotifyCost(const NotifyData& payload, bool subscribed, size_t count)
+    {
+        size_t handled = 0;
+        auto handler = [&handled](const NotifyData&) {
+            handled++;
+        };
+
+        auto task = Async::Spawn([&payload, count] {
+            for (size_t i = 0; i < count; i++)
+                Async::Notify(payload);
+        });
+        if (subscribed)
+            task.template Notified<NotifyData>(handler);
+
+        auto start = Clock::now();
+        if (subscribed)
+            task.Run(Async::RunMode::RunMode_Sync);
+        else
+        {
+            for (size_t i = 0; i < count; i++)
+                Async::Notify(payload);
+        }
+        const double now = NanosecondsPer(start, count);
+
+        std::function<void(const NotifyData&)> copied;
+        if (subscribed)
+            copied = handler;
+
+        start = Clock::now();
+        for (size_t i = 0; i < count; i++)
+            CopyingNotify(payload, &copied);
+        const double before = NanosecondsPer(start, count);
+
+        if (handled != (subscribed ? 2 * count : 0))
+            std::printf("unexpected handled %zu\n", handled);
+        return std::make_pair(before, now);
+    }
+
+    void BenchNotify()
+    {
+        const size_t count = 10000000;
+        const std::string text(40, 'x');
+
+        std::printf("ns per Notify, %zu calls, before emulated as a by-value payload and a handler copy\n", count);
+        std::printf("%-28s %8s %8s\n", "payload", "before", "now");
+
+        auto cost = NotifyCost(1, false, count);
+        std::printf("%-28s %8.1f %8.1f\n", "int, no subscriber", cost.first, cost.second);
+        cost = NotifyCost(text, false, count);
+        std::printf("%-28s %8.1f %8.1f\n", "40-byte string, no subscr.", cost.first, cost.second);
+        cost = NotifyCost(1, true, count);
+        std::printf("%-28s %8.1f %8.1f\n", "int, subscriber", cost.first, cost.second);
+        cost = NotifyCost(text, true, count);
+        std::printf("%-28s %8.1f %8.1f\n", "40-byte string, subscriber", cost.first, cost.second);
+    }
+
+    /////////////////////////////////////////////////
+    /// failure: a failing chain
+    /////////////////////////////////////////////////
+    // ns per synchronous run of a chain of depth Get stages whose root throws, the exception
+    // caught once and handed to the TaskResult. It is compared to the error path before,
+    // emulated: the exception caught and rethrown at every stage
+    Async::Task<int> FailingStages(Async::Task<int> task, size_t remaining)
+    {
+        return remaining == 0 ? task : FailingStages(task.Get(PlusOne()), remaining - 1);
+    }
+
+    BENCH_NOINLINE int RethrowingStages(size_t remaining)
+    {
+        if (remaining == 0)
+            throw std::runtime_error("failed");
+
+        try
+        {
+            return RethrowingStages(remaining - 1) + 1;
+        }
+        catch (...)
+        {
+            throw;
+        }
+    }
+
+    std::pair<double, double> FailureCost(size_t depth, size_t count)
+    {
+        size_t failed = 0;
+        auto start = Clock::now();
+        for (size_t i = 0; i < count; i++)
+        {
+            try
+            {
+                RethrowingStages(depth);
+            }
+            catch (const std::runtime_error&)
+            {
+                failed++;
+            }
+        }
+        const double before = NanosecondsPer(start, count);
+
+        auto task = FailingStages(Async::Spawn([]() -> int {
+            throw std::runtime_error("failed");
+        }), depth - 1);
+
+        start = Clock::now();
+        for (size_t i = 0; i < count; i++)
+        {
+            if (task.Run(Async::RunMode::RunMode_Sync)->GetException())
+                failed++;
+        }
+        const double now = NanosecondsPer(start, count);
+
+        if (failed != 2 * count)
+            std::printf("unexpected failed %zu\n", failed);
+        return std::make_pair(before, now);
+    }
+
+    void BenchFailure()
+    {
+        const size_t count = 5000;
+
+        std::printf("ns per run of a chain whose root throws, %zu runs, before emulated as a rethrow per stage\n", count);
+        std::printf("%8s %10s %10s\n", "depth", "before", "now");
+        for (size_t depth = 1; depth <= 100; depth *= 10)
+        {
+            auto cost = FailureCost(depth, count);
+            std::printf("%8zu %10.0f %10.0f\n", depth, cost.first, cost.second);
+        }
+    }
+
+    /////////////////////////////////////////////////
+    /// parallel: ParallelFor vs a serial loop
+    /////////////////////////////////////////////////
+    // ms per pass, the best of 5, of a memory-bound and a compute-bound kernel, run as a serial loop,
+    // by ParallelFor on a WorkStealingExecutor, or split by hand into one Spawn per thread
+    template<typename KernelFunction>
+    double BestOf5(KernelFunction kernel)
+    {
+        double best = 0;
+        for (int run = 0; run < 5; run++)
+        {
+            auto start = Clock::now();
+            kernel();
+            const double elapsed = NanosecondsPer(start, 1000000);
+            if (run == 0 || elapsed < best)
+                best = elapsed;
+        }
+        return best;
+    }
+
+    template<typename BodyFunction>
+    void HandSplit(Async::iExecutor::ptr executor, size_t chunks, size_t count, BodyFunction body)
+    {
+        std::vector<Async::TaskResult<void>::ptr> results;
+        for (size_t chunk = 0; chunk < chunks; chunk++)
+        {
+            const size_t first = count * chunk / chunks, last = count * (chunk + 1) / chunks;
+            results.push_back(Async::Spawn([first, last, &body] {
+                for (size_t i = first; i < last; i++)
+                    body(i);
+            }).Run(executor));
+        }
+        for (auto& result : results)
+            result->Wait();
+    }
+
+    template<typename BodyFunction>
+    void PrintKernel(const char *name, size_t count, BodyFunction body)
+    {
+        const size_t threads = std::max<size_t>(std::thread::hardware_concurrency(), 4);
+        auto executor = Async::WorkStealingExecutor::New(threads);
+
+        std::printf("%-22s %10.2f %12.2f %12.2f\n", name,
+            BestOf5([count, &body] {
+                for (size_t i = 0; i < count; i++)
+                    body(i);
+            }),
+            BestOf5([count, &body, executor] {
+                Async::ParallelFor(size_t(0), count, body, executor);
+            }),
+            BestOf5([count, &body, executor, threads] {
+                HandSplit(executor, threads, count, body);
+            }));
+    }
+
+    void BenchParallel()
+    {
+        const size_t memoryCount = 8 << 20, computeCount = 512 << 10;
+        std::vector<float> a(memoryCount, 1.0f), b(memoryCount, 2.0f), c(memoryCount);
+        std::vector<double> roots(computeCount);
+
+        std::printf("ms per pass, best of 5, on a WorkStealingExecutor of %zu threads\n",
+            std::max<size_t>(std::thread::hardware_concurrency(), 4));
+        std::printf("%-22s %10s %12s %12s\n", "kernel", "serial", "ParallelFor", "hand split");
+        PrintKernel("c = a * 2 + b, 8M", memoryCount, [&a, &b, &c](size_t i) {
+            c[i] = a[i] * 2 + b[i];
+        });
+        PrintKernel("50 sqrt each, 512K", computeCount, [&roots](size_t i) {
+            double value = double(i);
+            for (int j = 0; j < 50; j++)
+                value = std::sqrt(value + 1.0);
+            roots[i] = value;
+        });
+    }
+
+    /////////////////////////////////////////////////
+    /// priority: high priority latency under a low priority load
+    /////////////////////////////////////////////////
+    // a saturating background of 200us Low tasks keeps 64 queued, while a High task is posted every 4ms.
+    // The latency of a High task is from its post to its start, on a FIFO pool or a PriorityExecutor
+    struct LowLoad
+    {
+        LowLoad(Async::iExecutor::ptr executor)
+            : Executor(executor), Stopped(false), InFlight(0), Runs(0)
+        {}
+
+        void Post()
+        {
+            InFlight++;
+            auto self = this;
+            Async::Spawn([self] {
+                if (!self->Stopped.load())
+                {
+                    auto end = Clock::now() + std::chrono::microseconds(200);
+                    while (Clock::now() < end)
+                    {}
+                    self->Runs++;
+                    self->Post();
+                }
+                self->InFlight--;
+            }).Run(Executor, Async::TaskPriority_Low);
+        }
+
+        Async::iExecutor::ptr Executor;
+        std::atomic<bool> Stopped;
+        std::atomic<size_t> InFlight;
+        std::atomic<size_t> Runs;
+    };
+
+    void PrintLatency(const char *name, Async::iExecutor::ptr executor, size_t samples)
+    {
+        LowLoad load(executor);
+        for (int i = 0; i < 64; i++)
+            load.Post();
+
+        std::vector<double> latencies(samples);
+        std::vector<Async::TaskResult<void>::ptr> results;
+        for (size_t i = 0; i < samples; i++)
+        {
+            auto queued = Clock::now();
+            double *latency = &latencies[i];
+            results.push_back(Async::Spawn([queued, latency] {
+                *latency = std::chrono::duration<double, std::micro>(Clock::now() - queued).count();
+            }).Run(executor, Async::TaskPriority_High));
+            std::this_thread::sleep_for(std::chrono::milliseconds(4));
+        }
+        for (auto& result : results)
+            result->Wait();
+
+        const size_t lowRuns = load.Runs.load();
+        load.Stopped = true;
+        while (load.InFlight.load() > 0)
+            std::this_thread::yield();
+
+        std::sort(latencies.begin(), latencies.end());
+        std::printf("%-20s %10.0f %10.0f %10zu\n", name,
+            latencies[samples / 2], latencies[samples * 99 / 100], lowRuns);
+    }
+
+    void BenchPriority()
+    {
+        const size_t samples = 500;
+        const size_t threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+
+        std::printf("us from post to start of %zu High tasks, on %zu threads saturated by Low tasks\n", samples, threads);
+        std::printf("%-20s %10s %10s %10s\n", "executor", "p50", "p99", "low runs");
+        PrintLatency("ThreadPoolExecutor", Async::ThreadPoolExecutor::New(threads), samples);
+        PrintLatency("PriorityExecutor", Async::PriorityExecutor::New(threads), samples);
+    }
+
+    struct Benchmark
+    {
+        const char *Name;
+        void (*Run)();
+    };
+
+    const Benchmark Benchmarks[] = {
+        { "executor", BenchExecutor },
+        { "queue", BenchQueue },
+        { "observe", BenchObserve },
+        { "sync", BenchSync },
+        { "chain", BenchChain },
+        { "notify", BenchNotify },
+        { "failure", BenchFailure },
+        { "parallel", BenchParallel },
+        { "priority", BenchPriority },
+    };
+}
+
+int main(int argc, char **argv)
+{
+    std::printf("hardware threads: %u\n", std::thread::hardware_concurrency());
+
+    for (auto& benchmark : Benchmarks)
+    {
+        bool selected = argc == 1;
+        for (int i = 1; i < argc; i++)
+            selected = selected || std::strcmp(argv[i], benchmark.Name) == 0;
+        if (!selected)
+            continue;
+
+        std::printf("\n== %s\n", benchmark.Name);
+        benchmark.Run();
+    }
+    return 0;
+}
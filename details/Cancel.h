@@ -1,6 +1,6 @@
 #pragma once
 
-#include "CancelDetails.h"
+#include "ExecutionContext.h"
 
 namespace Async {
 
@@ -12,11 +12,9 @@ namespace Async {
         /////////////////////////////////////////////////
         static bool IsCancelled()
         {
-            if (*(CancelTrigger::GetCancelTrigger()))
-                return (*(CancelTrigger::GetCancelTrigger()))->Get();
-
-            // if no cancelTrigger, then always return not-cancelled
-            return false;
+            // if no task is running, then always return not-cancelled
+            auto context = ExecutionContext::Current();
+            return context && context->Cancellation().IsCancelled();
         }
 
         /////////////////////////////////////////////////
@@ -24,8 +22,8 @@ namespace Async {
         /////////////////////////////////////////////////
         static void CancelCurrentTask()
         {
-            if (*(CancelTrigger::GetCancelTrigger()))
-                (*(CancelTrigger::GetCancelTrigger()))->Set(true);
+            if (auto context = ExecutionContext::Current())
+                context->Cancellation().Cancel();
         }
     };
 }
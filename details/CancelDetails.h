@@ -1,42 +1,203 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
 
-#include "ThreadLocal.h"
+#include "UniqueFunction.h"
 
 namespace Async {
 
+    class CancellationToken;
+
     /////////////////////////////////////////////////
-    /// class CancelTrigger
+    /// class CancellationState
     /////////////////////////////////////////////////
-    class CancelTrigger
+    // the cancel flag shared by a CancellationSource, its tokens and the ExecutionContext of a task.
+    // Checking it is one atomic load, the mutex only guards the callbacks.
+    class CancellationState
     {
     public:
-        CancelTrigger() : m_cancel(false)
+        CancellationState()
+            : m_cancelled(false), m_lastCallbackId(0), m_parentCallbackId(0)
         {}
 
-        // cancel immediately, shouldn't be ignored
-        void Set(bool value)
+        ~CancellationState()
+        {
+            Unlink();
+        }
+
+        CancellationState(const CancellationState&) = delete;
+        CancellationState & operator=(const CancellationState&) = delete;
+
+        // cancel immediately, shouldn't be ignored. The callbacks run once, on the cancelling thread
+        void Cancel()
+        {
+            if (m_cancelled.exchange(true, std::memory_order_acq_rel))
+                return;
+
+            // a separate lock, so the callbacks can take the locks
+            // which are held while calling IsCancelled()
+            std::lock_guard<std::mutex> lock(m_callbackMutex);
+            for (auto& callback : m_callbacks)
+                callback.second();
+        }
+
+        bool IsCancelled() const
+        {
+            return m_cancelled.load(std::memory_order_relaxed);
+        }
+
+        // uncancel for the next run, still cancelled if the parent is
+        void Reset()
+        {
+            m_cancelled.store(false, std::memory_order_release);
+            if (m_parent && m_parent->IsCancelled())
+                Cancel();
+        }
+
+        // the callback is called when cancelled, e.g. to wake up a blocked wait.
+        // It is not called if already cancelled, so check IsCancelled() after adding it
+        size_t AddCallback(UniqueFunction<void()> callback)
+        {
+            std::lock_guard<std::mutex> lock(m_callbackMutex);
+
+            m_callbacks.push_back(std::make_pair(++m_lastCallbackId, std::move(callback)));
+            return m_lastCallbackId;
+        }
+
+        // once returned, the callback is guaranteed not running
+        void RemoveCallback(size_t callbackId)
         {
-            std::lock_guard<std::mutex> lock(m_mutex);
-            m_cancel = value;
+            std::lock_guard<std::mutex> lock(m_callbackMutex);
+
+            auto iter = std::find_if(m_callbacks.begin(), m_callbacks.end(),
+                [callbackId](const std::pair<size_t, UniqueFunction<void()> >& callback) {
+                return callback.first == callbackId;
+            });
+            if (iter != m_callbacks.end())
+                m_callbacks.erase(iter);
         }
 
-        bool Get() const
+        // be cancelled together with the parent, replacing the previous parent.
+        // Not thread safe against Reset(), link before running.
+        void Link(const CancellationToken& parent);
+
+    private:
+        void Unlink()
         {
-            std::lock_guard<std::mutex> lock(m_mutex);
-            return m_cancel;
+            if (m_parent)
+                m_parent->RemoveCallback(m_parentCallbackId);
+            m_parent = nullptr;
+            m_parentCallbackId = 0;
         }
 
-        static CancelTrigger ** GetCancelTrigger()
+    private:
+        std::atomic<bool> m_cancelled; // cancel immediately, shouldn't be ignored
+
+        size_t m_lastCallbackId;
+        std::vector<std::pair<size_t, UniqueFunction<void()> > > m_callbacks;
+        std::mutex m_callbackMutex;
+
+        std::shared_ptr<CancellationState> m_parent; // kept alive until unlinked
+        size_t m_parentCallbackId;
+    };
+
+    /////////////////////////////////////////////////
+    /// class CancellationToken
+    /////////////////////////////////////////////////
+    // observes the cancellation of a CancellationSource, a default token is never cancelled
+    class CancellationToken
+    {
+    public:
+        CancellationToken()
+        {}
+
+        bool IsCancelled() const
         {
-            THREAD_LOCAL static CancelTrigger *cancelTrigger = nullptr;
+            return m_state && m_state->IsCancelled();
+        }
 
-            return &cancelTrigger;
+        // see CancellationState::AddCallback, return 0 for a default token
+        size_t Register(UniqueFunction<void()> callback) const
+        {
+            if (!m_state)
+                return 0;
+            return m_state->AddCallback(std::move(callback));
+        }
+
+        void Unregister(size_t callbackId) const
+        {
+            if (m_state)
+                m_state->RemoveCallback(callbackId);
+        }
+
+    private:
+        friend class CancellationSource;
+        friend class CancellationState;
+
+        explicit CancellationToken(std::shared_ptr<CancellationState> state)
+            : m_state(std::move(state))
+        {}
+
+    private:
+        std::shared_ptr<CancellationState> m_state;
+    };
+
+    inline void CancellationState::Link(const CancellationToken& parent)
+    {
+        Unlink();
+        if (!parent.m_state)
+            return;
+
+        m_parent = parent.m_state;
+        m_parentCallbackId = m_parent->AddCallback([this] {
+            Cancel();
+        });
+
+        // cancelled before the callback was added
+        if (m_parent->IsCancelled())
+            Cancel();
+    }
+
+    /////////////////////////////////////////////////
+    /// class CancellationSource
+    /////////////////////////////////////////////////
+    // cancels its tokens, the sources and tasks linked to them are cancelled in the same call
+    class CancellationSource
+    {
+    public:
+        CancellationSource()
+            : m_state(std::make_shared<CancellationState>())
+        {}
+
+        // a child source, cancelled when the parent is
+        explicit CancellationSource(const CancellationToken& parent)
+            : CancellationSource()
+        {
+            m_state->Link(parent);
+        }
+
+        void Cancel()
+        {
+            m_state->Cancel();
+        }
+
+        bool IsCancelled() const
+        {
+            return m_state->IsCancelled();
+        }
+
+        CancellationToken Token() const
+        {
+            return CancellationToken(m_state);
         }
 
     private:
-        bool m_cancel; // cancel immediately, shouldn't be ignored
-        mutable std::mutex m_mutex;
+        std::shared_ptr<CancellationState> m_state;
     };
 }
@@ -0,0 +1,505 @@
+#pragma once
+
+// C++20 coroutine support, the rest of the library stays C++11
+#if defined(__has_include)
+#if __has_include(<coroutine>) && defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#define ASYNC_HAS_COROUTINES 1
+#endif
+#endif
+
+#ifndef ASYNC_HAS_COROUTINES
+#define ASYNC_HAS_COROUTINES 0
+#endif
+
+#if ASYNC_HAS_COROUTINES
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "CancelDetails.h"
+#include "Executor.h"
+#include "Task.h"
+#include "TaskHandle.h"
+
+namespace Async {
+
+    template<typename ReturnType>
+    class CoTask;
+
+    namespace CoroutineDetails {
+
+        // where a suspended coroutine is resumed: the executor it runs on, otherwise the default one
+        inline iExecutor::ptr ResumeExecutor()
+        {
+            auto executor = GetCurrentExecutor();
+            if (!executor)
+                executor = GetDefaultExecutor();
+            return executor;
+        }
+
+        /////////////////////////////////////////////////
+        /// class PromiseBase
+        /////////////////////////////////////////////////
+        // the state of a CoTask coroutine. State is nullptr while running, then the address of
+        // the awaiting coroutine, Done once finished, or Detached if the CoTask is gone first.
+        class PromiseBase
+        {
+        public:
+            PromiseBase()
+                : State(nullptr), Completion(TaskCompletion::New())
+            {}
+
+            // the coroutine starts running when called
+            std::suspend_never initial_suspend() noexcept
+            {
+                return {};
+            }
+
+            void unhandled_exception()
+            {
+                Exception = std::current_exception();
+            }
+
+            static void * Done()
+            {
+                return reinterpret_cast<void *>(1);
+            }
+
+            static void * Detached()
+            {
+                return reinterpret_cast<void *>(2);
+            }
+
+            std::atomic<void *> State;
+            std::exception_ptr Exception;
+            TaskCompletion::ptr Completion; // for the blocking CoTask::Get()
+            CancellationSource Cancellation; // see CoTask::Cancel()
+        };
+
+        // resume the awaiting coroutine, or destroy the frame if the CoTask is gone
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+
+            template<typename PromiseType>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<PromiseType> handle) noexcept
+            {
+                PromiseBase& promise = handle.promise();
+                promise.Completion->Set();
+
+                void *previous = promise.State.exchange(PromiseBase::Done(), std::memory_order_acq_rel);
+                if (previous == PromiseBase::Detached())
+                {
+                    handle.destroy();
+                    return std::noop_coroutine();
+                }
+                if (previous)
+                    return std::coroutine_handle<>::from_address(previous);
+                return std::noop_coroutine();
+            }
+
+            void await_resume() noexcept
+            {}
+        };
+
+        template<typename ReturnType>
+        class Promise : public PromiseBase
+        {
+        public:
+            CoTask<ReturnType> get_return_object();
+
+            FinalAwaiter final_suspend() noexcept
+            {
+                return {};
+            }
+
+            template<typename Value>
+            void return_value(Value&& value)
+            {
+                Result.emplace(std::forward<Value>(value));
+            }
+
+            ReturnType TakeResult()
+            {
+                if (Exception)
+                    std::rethrow_exception(Exception);
+                return std::move(*Result);
+            }
+
+            std::optional<ReturnType> Result;
+        };
+
+        template<>
+        class Promise<void> : public PromiseBase
+        {
+        public:
+            CoTask<void> get_return_object();
+
+            FinalAwaiter final_suspend() noexcept
+            {
+                return {};
+            }
+
+            void return_void()
+            {}
+
+            void TakeResult()
+            {
+                if (Exception)
+                    std::rethrow_exception(Exception);
+            }
+        };
+
+        /////////////////////////////////////////////////
+        /// class TaskAwaiter
+        /////////////////////////////////////////////////
+        // co_await a Task runs it on the executor of the awaiting coroutine,
+        // and resumes the coroutine on the thread finishing the chain
+        template<typename ReturnType>
+        class TaskAwaiter
+        {
+        public:
+            TaskAwaiter(Task<ReturnType> task)
+                : m_task(std::move(task))
+            {}
+
+            TaskAwaiter(typename TaskResult<ReturnType>::ptr result)
+                : m_task(nullptr), m_result(std::move(result))
+            {}
+
+            bool await_ready()
+            {
+                return m_result && m_result->IsReady();
+            }
+
+            bool await_suspend(std::coroutine_handle<> handle)
+            {
+                if (!m_result)
+                    m_result = m_task.Run(ResumeExecutor());
+
+                // resume at once if the task has completed already
+                return m_result->OnCompleted([handle] {
+                    handle.resume();
+                });
+            }
+
+            // the value is moved out, the awaiter being its only consumer
+            ReturnType await_resume()
+            {
+                return m_result->TakeResult();
+            }
+
+        private:
+            Task<ReturnType> m_task;
+            typename TaskResult<ReturnType>::ptr m_result;
+        };
+
+        // the cancellation of the awaiting coroutine: its CoTask's, or none for other coroutine types
+        template<typename PromiseType>
+        CancellationToken AwaitingCancellation(std::coroutine_handle<PromiseType> handle)
+        {
+            if constexpr (std::is_base_of<PromiseBase, PromiseType>::value)
+                return handle.promise().Cancellation.Token();
+            else
+                return CancellationToken();
+        }
+
+        /////////////////////////////////////////////////
+        /// class PopAwaiter
+        /////////////////////////////////////////////////
+        // suspends on an empty queue instead of blocking, the push resumes the coroutine on its executor.
+        // PopType tries a pop and returns true if it got something or the queue is closed.
+        // CoTask::Cancel() resumes it too, with an empty result, as a cancelled ReceiveOne returns,
+        // unless a push has woken it already, then it still takes the object.
+        template<typename QueueType, typename PopType>
+        class PopAwaiter
+        {
+        private:
+            // shared with the queue and cancel callbacks, which may outlive the coroutine frame.
+            // Only the first of a pop or the cancel resumes the coroutine.
+            struct Waiter
+            {
+                Waiter()
+                    : Resumed(false), Woken(false)
+                {}
+
+                std::mutex Mutex;
+                bool Resumed;
+                bool Woken; // a pop is posted by the push, which the cancel leaves to resume
+            };
+
+        public:
+            PopAwaiter(QueueType& queue, PopType pop)
+                : m_queue(queue), m_pop(std::move(pop)), m_callbackId(0)
+            {}
+
+            bool await_ready()
+            {
+                return m_pop(m_queue);
+            }
+
+            template<typename PromiseType>
+            bool await_suspend(std::coroutine_handle<PromiseType> handle)
+            {
+                m_executor = ResumeExecutor();
+                m_cancellation = AwaitingCancellation(handle);
+                m_waiter = std::make_shared<Waiter>();
+
+                // the callback only posts, so it is safe under the lock of the cancellation
+                m_callbackId = m_cancellation.Register([waiter = m_waiter, executor = m_executor, handle] {
+                    executor->Post([waiter, handle] {
+                        {
+                            std::lock_guard<std::mutex> lock(waiter->Mutex);
+                            if (waiter->Resumed || waiter->Woken)
+                                return;
+                            waiter->Resumed = true;
+                        }
+                        handle.resume();
+                    });
+                });
+
+                std::lock_guard<std::mutex> lock(m_waiter->Mutex);
+                if (Park(handle))
+                    return true;
+
+                m_waiter->Resumed = true;
+                return false;
+            }
+
+            typename PopType::ResultType await_resume()
+            {
+                // once returned, the cancel callback can't post anymore
+                m_cancellation.Unregister(m_callbackId);
+                return m_pop.TakeResult();
+            }
+
+        private:
+            // return false if the pop can complete without suspending, or is cancelled. Under the waiter lock
+            bool Park(std::coroutine_handle<> handle)
+            {
+                while (true)
+                {
+                    if (m_pop(m_queue))
+                        return false;
+
+                    if (m_cancellation.IsCancelled())
+                        return false;
+
+                    // called by the pushing thread, the awaiter lives in the coroutine frame until resumed
+                    if (m_queue.NotifyWhenReady([this, waiter = m_waiter, handle] {
+                        std::lock_guard<std::mutex> lock(waiter->Mutex);
+                        if (waiter->Resumed)
+                            return false; // the wake goes to another waiter
+
+                        waiter->Woken = true;
+                        m_executor->Post([this, waiter, handle] {
+                            {
+                                std::lock_guard<std::mutex> lock(waiter->Mutex);
+                                waiter->Woken = false;
+
+                                // another consumer may have taken the object, then park again
+                                if (Park(handle))
+                                    return;
+                                waiter->Resumed = true;
+                            }
+                            handle.resume();
+                        });
+                        return true;
+                    }))
+                        return true;
+                }
+            }
+
+        private:
+            QueueType& m_queue;
+            PopType m_pop;
+            iExecutor::ptr m_executor;
+            CancellationToken m_cancellation;
+            size_t m_callbackId;
+            std::shared_ptr<Waiter> m_waiter;
+        };
+
+        template<typename ObjectType>
+        struct PopOne
+        {
+            typedef std::optional<ObjectType> ResultType;
+
+            template<typename QueueType>
+            bool operator()(QueueType& queue)
+            {
+                auto ret = queue.TryConsumeOne([this](ObjectType&& object) {
+                    Result.emplace(std::move(object));
+                });
+                return ret.IsSuccess() || ret.IsClosed();
+            }
+
+            ResultType TakeResult()
+            {
+                return std::move(Result);
+            }
+
+            ResultType Result;
+        };
+
+        template<typename ObjectType>
+        struct PopSome
+        {
+            typedef std::vector<ObjectType> ResultType;
+
+            template<typename QueueType>
+            bool operator()(QueueType& queue)
+            {
+                auto ret = queue.TryPopSome(Result);
+                return ret.IsSuccess() || ret.IsClosed();
+            }
+
+            ResultType TakeResult()
+            {
+                return std::move(Result);
+            }
+
+            ResultType Result;
+        };
+
+        template<typename QueueType, typename ObjectType>
+        class PopOneAwaiter : public PopAwaiter<QueueType, PopOne<ObjectType> >
+        {
+        public:
+            explicit PopOneAwaiter(QueueType& queue)
+                : PopAwaiter<QueueType, PopOne<ObjectType> >(queue, PopOne<ObjectType>())
+            {}
+        };
+
+        template<typename QueueType, typename ObjectType>
+        class PopSomeAwaiter : public PopAwaiter<QueueType, PopSome<ObjectType> >
+        {
+        public:
+            explicit PopSomeAwaiter(QueueType& queue)
+                : PopAwaiter<QueueType, PopSome<ObjectType> >(queue, PopSome<ObjectType>())
+            {}
+        };
+    }
+
+    /////////////////////////////////////////////////
+    /// class CoTask
+    /////////////////////////////////////////////////
+    // the return type of a coroutine using co_await on Tasks and queues. It starts running when
+    // called, can be co_await-ed once by another coroutine, or waited by Get() from a plain thread.
+    // If the CoTask is released first, the coroutine keeps running and frees itself at the end.
+    template<typename ReturnType>
+    class CoTask
+    {
+    public:
+        typedef CoroutineDetails::Promise<ReturnType> promise_type;
+
+    public:
+        explicit CoTask(std::coroutine_handle<promise_type> handle)
+            : m_handle(handle)
+        {}
+
+        CoTask(CoTask&& other) noexcept
+            : m_handle(std::exchange(other.m_handle, nullptr))
+        {}
+
+        CoTask(const CoTask&) = delete;
+        CoTask & operator=(const CoTask&) = delete;
+
+        ~CoTask()
+        {
+            if (!m_handle)
+                return;
+
+            auto previous = m_handle.promise().State.exchange(CoroutineDetails::PromiseBase::Detached(), std::memory_order_acq_rel);
+            if (previous == CoroutineDetails::PromiseBase::Done())
+                m_handle.destroy();
+        }
+
+        // resume the coroutine if it is suspended on a queue pop, the pop returns an empty result,
+        // and the later pops of the coroutine return an empty result at once if the queue is empty
+        void Cancel()
+        {
+            m_handle.promise().Cancellation.Cancel();
+        }
+
+        bool IsCancelled() const
+        {
+            return m_handle.promise().Cancellation.IsCancelled();
+        }
+
+        bool IsReady() const
+        {
+            return m_handle.promise().State.load(std::memory_order_acquire) == CoroutineDetails::PromiseBase::Done();
+        }
+
+        // block the thread until the coroutine returns, then return its value or rethrow its exception
+        ReturnType Get()
+        {
+            m_handle.promise().Completion->Wait();
+            return m_handle.promise().TakeResult();
+        }
+
+        bool await_ready() const
+        {
+            return IsReady();
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            // resumed by the final suspend, unless it is done already
+            void *expected = nullptr;
+            return m_handle.promise().State.compare_exchange_strong(expected, handle.address(), std::memory_order_acq_rel);
+        }
+
+        ReturnType await_resume()
+        {
+            return m_handle.promise().TakeResult();
+        }
+
+    private:
+        std::coroutine_handle<promise_type> m_handle;
+    };
+
+    namespace CoroutineDetails {
+
+        template<typename ReturnType>
+        CoTask<ReturnType> Promise<ReturnType>::get_return_object()
+        {
+            return CoTask<ReturnType>(std::coroutine_handle<Promise>::from_promise(*this));
+        }
+
+        inline CoTask<void> Promise<void>::get_return_object()
+        {
+            return CoTask<void>(std::coroutine_handle<Promise>::from_promise(*this));
+        }
+    }
+
+    /////////////////////////////////////////////////
+    /// operator co_await
+    /////////////////////////////////////////////////
+    // co_await Task runs it on the executor of the coroutine, or the default one,
+    // and returns the return of the last stage, or rethrows the exception of the chain
+    template<typename ReturnType>
+    CoroutineDetails::TaskAwaiter<ReturnType> operator co_await(Task<ReturnType> task)
+    {
+        return CoroutineDetails::TaskAwaiter<ReturnType>(std::move(task));
+    }
+
+    // co_await the TaskResult of Task::Run, which takes the value out of it, see TaskResult::TakeResult
+    template<typename ReturnType>
+    CoroutineDetails::TaskAwaiter<ReturnType> operator co_await(std::shared_ptr<TaskResult<ReturnType> > result)
+    {
+        return CoroutineDetails::TaskAwaiter<ReturnType>(std::move(result));
+    }
+}
+
+#endif
@@ -1,5 +1,7 @@
 #pragma once
 
-#include <functional>
+#include <exception>
 
-#define EXCEPTION_HANDLE_FUNCTION std::function<void(std::exception_ptr)>
\ No newline at end of file
+#include "UniqueFunction.h"
+
+#define EXCEPTION_HANDLE_FUNCTION Async::UniqueFunction<void(std::exception_ptr)>
\ No newline at end of file
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "CancelDetails.h"
+#include "NotifyDetails.h"
+#include "ThreadLocal.h"
+#include "UniqueFunction.h"
+
+namespace Async {
+
+    /////////////////////////////////////////////////
+    /// class ExecutionContext
+    /////////////////////////////////////////////////
+    // what a running task shows to the code it runs: the cancellation state and the Notified handlers.
+    // Every task owns one, and a thread running the task points to it, so entering and leaving
+    // a task is a pointer swap, whichever thread it runs on.
+    class ExecutionContext
+    {
+    public:
+        ExecutionContext()
+        {}
+
+        ExecutionContext(const ExecutionContext&) = delete;
+        ExecutionContext & operator=(const ExecutionContext&) = delete;
+
+        CancellationState & Cancellation()
+        {
+            return m_cancellation;
+        }
+
+        NotifyHandlers & Handlers()
+        {
+            return m_handlers;
+        }
+
+        // nullptr if no task is running on current thread
+        static ExecutionContext * Current()
+        {
+            return *GetCurrent();
+        }
+
+        // install the context on current thread and return the previous one,
+        // so a nested task running on the same thread can restore it
+        static ExecutionContext * Exchange(ExecutionContext *context)
+        {
+            auto previous = *GetCurrent();
+            *GetCurrent() = context;
+            return previous;
+        }
+
+    private:
+        static ExecutionContext ** GetCurrent()
+        {
+            static THREAD_LOCAL ExecutionContext *context = nullptr;
+
+            return &context;
+        }
+
+    private:
+        CancellationState m_cancellation;
+        NotifyHandlers m_handlers;
+    };
+
+    /////////////////////////////////////////////////
+    /// class CancelCallbackGuard
+    /////////////////////////////////////////////////
+    // register a callback to the cancellation state of the task on current thread, and remove it when out of scope.
+    // Declare it before the lock the callback takes, so it is removed after the lock is released.
+    class CancelCallbackGuard
+    {
+    public:
+        CancelCallbackGuard()
+            : m_registered(false), m_cancellationState(nullptr), m_callbackId(0)
+        {}
+
+        ~CancelCallbackGuard()
+        {
+            if (m_cancellationState)
+                m_cancellationState->RemoveCallback(m_callbackId);
+        }
+
+        CancelCallbackGuard(const CancelCallbackGuard&) = delete;
+        CancelCallbackGuard & operator=(const CancelCallbackGuard&) = delete;
+
+        // only the first call takes effect
+        void Register(UniqueFunction<void()> callback)
+        {
+            if (m_registered)
+                return;
+
+            m_registered = true;
+            if (auto context = ExecutionContext::Current())
+            {
+                m_cancellationState = &context->Cancellation();
+                m_callbackId = m_cancellationState->AddCallback(std::move(callback));
+            }
+        }
+
+        bool IsRegistered() const
+        {
+            return m_registered;
+        }
+
+    private:
+        bool m_registered;
+        CancellationState *m_cancellationState;
+        size_t m_callbackId;
+    };
+}
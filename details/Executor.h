@@ -0,0 +1,294 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ThreadLocal.h"
+#include "UniqueFunction.h"
+
+namespace Async {
+
+    typedef enum
+    {
+        TaskPriority_High,
+        TaskPriority_Normal,
+        TaskPriority_Low,
+        TaskPriority_Inherit // the priority of the work posting it, TaskPriority_Normal outside of any
+    } TaskPriority;
+
+    namespace ExecutorDetails {
+
+        // of the work running on current thread
+        inline TaskPriority * CurrentPriority()
+        {
+            static THREAD_LOCAL TaskPriority priority = TaskPriority_Normal;
+
+            return &priority;
+        }
+
+        inline TaskPriority ResolvePriority(TaskPriority priority)
+        {
+            return priority == TaskPriority_Inherit ? *CurrentPriority() : priority;
+        }
+
+        // the priority of the work running in the scope, passed on to the works it posts
+        class PriorityScope
+        {
+        public:
+            explicit PriorityScope(TaskPriority priority)
+                : m_previous(*CurrentPriority())
+            {
+                *CurrentPriority() = priority;
+            }
+
+            ~PriorityScope()
+            {
+                *CurrentPriority() = m_previous;
+            }
+
+            PriorityScope(const PriorityScope&) = delete;
+            PriorityScope & operator=(const PriorityScope&) = delete;
+
+        private:
+            TaskPriority m_previous;
+        };
+    }
+
+    /////////////////////////////////////////////////
+    /// interface iExecutor
+    /////////////////////////////////////////////////
+    class iExecutor
+    {
+    public:
+        typedef std::shared_ptr<iExecutor> ptr;
+
+    public:
+        virtual ~iExecutor()
+        {}
+
+        // queue the work, it will be run on one of the executor's threads later
+        virtual void Post(UniqueFunction<void()> work) = 0;
+
+        // an executor without priority queues runs the work in its order,
+        // the priority only passes on to the works it posts
+        virtual void PostWithPriority(UniqueFunction<void()> work, TaskPriority priority)
+        {
+            priority = ExecutorDetails::ResolvePriority(priority);
+            if (priority == TaskPriority_Normal)
+            {
+                Post(std::move(work));
+                return;
+            }
+
+            auto prioritized = std::make_shared<UniqueFunction<void()> >(std::move(work));
+            Post([prioritized, priority]() {
+                ExecutorDetails::PriorityScope scope(priority);
+                (*prioritized)();
+            });
+        }
+    };
+
+    namespace ExecutorDetails {
+
+        // the executor owning the current worker thread, if any
+        inline const std::weak_ptr<iExecutor> ** CurrentExecutor()
+        {
+            static THREAD_LOCAL const std::weak_ptr<iExecutor> *executor = nullptr;
+
+            return &executor;
+        }
+    }
+
+    /////////////////////////////////////////////////
+    /// function GetCurrentExecutor
+    /////////////////////////////////////////////////
+    // return nullptr if not called from a worker thread of an executor
+    inline iExecutor::ptr GetCurrentExecutor()
+    {
+        auto executor = *ExecutorDetails::CurrentExecutor();
+        if (executor)
+            return executor->lock();
+        return nullptr;
+    }
+
+    /////////////////////////////////////////////////
+    /// class ThreadPoolExecutor
+    /////////////////////////////////////////////////
+    class ThreadPoolExecutor : public iExecutor
+    {
+    private:
+        // shared with worker threads, so the pool can still be
+        // released from inside one of its own workers
+        struct State
+        {
+            State() : Stopped(false)
+            {}
+
+            std::weak_ptr<iExecutor> Executor;
+
+            bool Stopped;
+            std::deque<UniqueFunction<void()> > Works;
+            std::mutex Mutex;
+            std::condition_variable CV;
+        };
+
+    public:
+        virtual ~ThreadPoolExecutor()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_state->Mutex);
+                m_state->Stopped = true;
+            }
+            m_state->CV.notify_all();
+
+            // the rest of queued works are still run before the workers exit
+            for (auto& thread : m_threads)
+            {
+                if (thread.get_id() == std::this_thread::get_id())
+                    thread.detach();
+                else if (thread.joinable())
+                    thread.join();
+            }
+        }
+
+        /**
+        New a fixed-size thread pool.
+
+        @param threadCount, 0 means std::thread::hardware_concurrency().
+        @return iExecutor::ptr.
+        */
+        static iExecutor::ptr New(size_t threadCount = 0)
+        {
+            if (threadCount == 0)
+                threadCount = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+
+            auto executor = new ThreadPoolExecutor();
+            auto executorPtr = iExecutor::ptr(executor);
+            executor->Start(threadCount, executorPtr);
+
+            return executorPtr;
+        }
+
+        virtual void Post(UniqueFunction<void()> work)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_state->Mutex);
+                m_state->Works.push_back(std::move(work));
+            }
+            m_state->CV.notify_one();
+        }
+
+    private:
+        // force to always init using New()
+        ThreadPoolExecutor()
+            : m_state(std::make_shared<State>())
+        {}
+
+        void Start(size_t threadCount, iExecutor::ptr self)
+        {
+            m_state->Executor = self;
+
+            m_threads.reserve(threadCount);
+            for (size_t i = 0; i < threadCount; i++)
+                m_threads.emplace_back(&ThreadPoolExecutor::WorkerLoop, m_state);
+        }
+
+        static void WorkerLoop(std::shared_ptr<State> state)
+        {
+            *ExecutorDetails::CurrentExecutor() = &state->Executor;
+
+            while (true)
+            {
+                UniqueFunction<void()> work;
+                {
+                    std::unique_lock<std::mutex> lock(state->Mutex);
+                    state->CV.wait(lock, [&state] {
+                        return state->Stopped || !state->Works.empty();
+                    });
+
+                    if (state->Works.empty()) // stopped, and nothing left to run
+                        break;
+
+                    work = std::move(state->Works.front());
+                    state->Works.pop_front();
+                }
+                work();
+            }
+
+            *ExecutorDetails::CurrentExecutor() = nullptr;
+        }
+
+    private:
+        std::shared_ptr<State> m_state;
+        std::vector<std::thread> m_threads;
+    };
+
+    /////////////////////////////////////////////////
+    /// class DedicatedThreadExecutor
+    /////////////////////////////////////////////////
+    // every posted work gets its own thread, for long-running loops
+    // which shouldn't occupy a pool worker, e.g. ObserveTask
+    class DedicatedThreadExecutor : public iExecutor
+    {
+    public:
+        static iExecutor::ptr New()
+        {
+            return iExecutor::ptr(new DedicatedThreadExecutor());
+        }
+
+        virtual void Post(UniqueFunction<void()> work)
+        {
+            std::thread(std::move(work)).detach();
+        }
+
+    private:
+        // force to always init using New()
+        DedicatedThreadExecutor()
+        {}
+    };
+
+    /////////////////////////////////////////////////
+    /// function GetDefaultExecutor / SetDefaultExecutor
+    /////////////////////////////////////////////////
+    namespace ExecutorDetails {
+
+        inline std::mutex & DefaultExecutorMutex()
+        {
+            static std::mutex *mutex = new std::mutex();
+            return *mutex;
+        }
+
+        // never released, so detached tasks can still run during static destruction
+        inline iExecutor::ptr & DefaultExecutor()
+        {
+            static iExecutor::ptr *executor = new iExecutor::ptr();
+            return *executor;
+        }
+    }
+
+    inline iExecutor::ptr GetDefaultExecutor()
+    {
+        std::lock_guard<std::mutex> lock(ExecutorDetails::DefaultExecutorMutex());
+
+        auto& executor = ExecutorDetails::DefaultExecutor();
+        if (!executor)
+            executor = ThreadPoolExecutor::New();
+        return executor;
+    }
+
+    // set nullptr to go back to the built-in thread pool
+    inline void SetDefaultExecutor(iExecutor::ptr executor)
+    {
+        iExecutor::ptr previous; // released out of the lock, its workers may still call GetDefaultExecutor()
+        std::lock_guard<std::mutex> lock(ExecutorDetails::DefaultExecutorMutex());
+
+        previous.swap(ExecutorDetails::DefaultExecutor());
+        ExecutorDetails::DefaultExecutor() = executor;
+    }
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include "TaskDetails.h"
+#include "TaskHandle.h"
+
+namespace Async {
+
+    namespace FusedDetails {
+
+        // the first stage, runs the function of Spawn
+        template<typename Function>
+        struct SourceStage
+        {
+            typedef FUNCTION_RETURN_TYPE(Function) ReturnType;
+
+            Function Func;
+
+            ReturnType operator()()
+            {
+                return Func();
+            }
+        };
+
+        // runs the parent stage, then the function
+        template<typename ParentStage, typename Function>
+        struct ThenStage
+        {
+            typedef FUNCTION_RETURN_TYPE(Function) ReturnType;
+
+            ParentStage Parent;
+            Function Func;
+            const TaskBypassFlag *BypassFlag; // owned by the FusedChain
+
+            ReturnType operator()()
+            {
+                Parent();
+
+                if (BypassFlag && BypassFlag->IsSet())
+                    return ReturnType();
+
+                return Func();
+            }
+        };
+
+        // runs the parent stage, then the function on its return
+        template<typename ParentStage, typename Function>
+        struct GetStage
+        {
+            typedef FUNCTION_WITH_ARGUMENT_RETURN_TYPE(Function, typename ParentStage::ReturnType) ReturnType;
+
+            ParentStage Parent;
+            Function Func;
+            const TaskBypassFlag *BypassFlag; // owned by the FusedChain
+
+            ReturnType operator()()
+            {
+                auto parentReturn = Parent();
+
+                if (BypassFlag && BypassFlag->IsSet())
+                    return ReturnType();
+
+                return Func(std::move(parentReturn));
+            }
+        };
+    }
+
+    /////////////////////////////////////////////////
+    /// class FusedChain
+    /////////////////////////////////////////////////
+    // a Then/Get chain typed stage by stage, so the compiler can inline the whole chain into
+    // one function. It is type-erased only once, into the TaskType<ReturnType> made by ToTask().
+    template<typename StageType, template<typename> class TaskType>
+    class FusedChain
+    {
+    public:
+        typedef typename StageType::ReturnType ReturnType;
+
+        FusedChain(StageType stage, std::shared_ptr<TaskBypassFlag> bypassFlag = nullptr)
+            : m_stage(std::move(stage)), m_bypassFlag(bypassFlag)
+        {}
+
+        // an rvalue chain, as the return of SpawnFused or of the previous link, moves its stages
+        // into the next link, so a link costs no copy of the chain and move-only functions can be fused
+        template<typename NextTaskFunction>
+        FusedChain<FusedDetails::ThenStage<StageType, typename std::decay<NextTaskFunction>::type>, TaskType>
+        Then(NextTaskFunction&& func) &&
+        {
+            return Chain<FusedDetails::ThenStage>(std::move(m_stage), std::forward<NextTaskFunction>(func));
+        }
+
+        // a named chain is copied, to be reused
+        template<typename NextTaskFunction>
+        FusedChain<FusedDetails::ThenStage<StageType, typename std::decay<NextTaskFunction>::type>, TaskType>
+        Then(NextTaskFunction&& func) const &
+        {
+            return Chain<FusedDetails::ThenStage>(StageType(m_stage), std::forward<NextTaskFunction>(func));
+        }
+
+        template<typename NextTaskFunction>
+        FusedChain<FusedDetails::GetStage<StageType, typename std::decay<NextTaskFunction>::type>, TaskType>
+        Get(NextTaskFunction&& func) &&
+        {
+            return Chain<FusedDetails::GetStage>(std::move(m_stage), std::forward<NextTaskFunction>(func));
+        }
+
+        template<typename NextTaskFunction>
+        FusedChain<FusedDetails::GetStage<StageType, typename std::decay<NextTaskFunction>::type>, TaskType>
+        Get(NextTaskFunction&& func) const &
+        {
+            return Chain<FusedDetails::GetStage>(StageType(m_stage), std::forward<NextTaskFunction>(func));
+        }
+
+        // erase the chain into a task, to set OnException/OnBegin/OnEnd/Notified before Run
+        TaskType<ReturnType> ToTask() &&
+        {
+            return TaskType<ReturnType>(std::make_shared<TaskDetails<ReturnType> >(
+                UniqueFunction<ReturnType()>(std::move(m_stage)),
+                m_bypassFlag
+            ));
+        }
+
+        TaskType<ReturnType> ToTask() const &
+        {
+            return FusedChain(*this).ToTask();
+        }
+
+        // same as ToTask().Run(...)
+        template<typename... Args>
+        auto Run(Args&&... args) && -> decltype(std::declval<TaskType<ReturnType> >().Run(std::forward<Args>(args)...))
+        {
+            return std::move(*this).ToTask().Run(std::forward<Args>(args)...);
+        }
+
+        template<typename... Args>
+        auto Run(Args&&... args) const & -> decltype(std::declval<TaskType<ReturnType> >().Run(std::forward<Args>(args)...))
+        {
+            return ToTask().Run(std::forward<Args>(args)...);
+        }
+
+    private:
+        template<template<typename, typename> class NextStageTemplate, typename NextTaskFunction>
+        FusedChain<NextStageTemplate<StageType, typename std::decay<NextTaskFunction>::type>, TaskType>
+        Chain(StageType&& stage, NextTaskFunction&& func) const
+        {
+            typedef NextStageTemplate<StageType, typename std::decay<NextTaskFunction>::type> NextStage;
+
+            return FusedChain<NextStage, TaskType>(
+                NextStage{ std::move(stage), std::forward<NextTaskFunction>(func), m_bypassFlag.get() }, m_bypassFlag);
+        }
+
+    private:
+        StageType m_stage;
+        std::shared_ptr<TaskBypassFlag> m_bypassFlag;
+    };
+}
@@ -1,17 +1,26 @@
 #pragma once
 
-#include "NotifyDetails.h"
+#include <type_traits>
+#include <utility>
+
+#include "ExecutionContext.h"
 
 namespace Async {
 
     /////////////////////////////////////////////////
     /// function Notify
     /////////////////////////////////////////////////
+    // the data is neither copied nor moved, the handler of the running task gets a const reference of it.
+    // Outside of a task, it only checks a thread local pointer.
     template<typename NotifyData>
-    void Notify(NotifyData data)
+    void Notify(NotifyData&& data)
     {
-        auto func = GetNotifyFunction<typename std::remove_const<NotifyData>::type>();
-        if (func)
-            func(data);
+        auto context = ExecutionContext::Current();
+        if (!context)
+            return;
+
+        auto func = context->Handlers().template Get<typename std::decay<NotifyData>::type>();
+        if (func && *func)
+            (*func)(data);
     }
-}
\ No newline at end of file
+}
@@ -1,79 +1,67 @@
 #pragma once
 
-#include "ThreadLocal.h"
+#include <memory>
+#include <vector>
 
-#define NOTIFY_FUNCTION(NotifyData) std::function<void(const NotifyData&)>
+#include "UniqueFunction.h"
 
-namespace Async {
-
-    /////////////////////////////////////////////////
-    /// function GetNotifier
-    /////////////////////////////////////////////////
-    template<typename NotifyData>
-    class Notifier;
-
-    template<typename NotifyData>
-    Notifier<NotifyData> ** GetNotifier(bool createIfNoExist = true)
-    {
-        THREAD_LOCAL static Notifier<NotifyData> *notifier = nullptr;
-
-        if (createIfNoExist && notifier == nullptr)
-            notifier = new Notifier<NotifyData>();
+#define NOTIFY_FUNCTION(NotifyData) Async::UniqueFunction<void(const NotifyData&)>
 
-        return &notifier;
-    }
+namespace Async {
 
     /////////////////////////////////////////////////
-    /// class Notifier
+    /// class NotifyHandlers
     /////////////////////////////////////////////////
-    template<typename NotifyData>
-    class Notifier
+    // the Notified handlers of a task, one per NotifyData type.
+    // A task has few of them, so a linear search beats a hash map.
+    class NotifyHandlers
     {
     public:
-        Notifier()
-            : m_notifyFunction(nullptr)
-        {}
-
-        void SetFunction(NOTIFY_FUNCTION(NotifyData) function)
+        // replace the handler of the same type
+        template<typename NotifyData>
+        void Set(NOTIFY_FUNCTION(NotifyData) function)
         {
-            m_notifyFunction = function;
-        }
+            auto handler = std::make_shared<NOTIFY_FUNCTION(NotifyData)>(std::move(function));
 
-        NOTIFY_FUNCTION(NotifyData) & GetFunction()
-        {
-            return m_notifyFunction;
+            for (auto& entry : m_handlers)
+            {
+                if (entry.Type == TypeKey<NotifyData>())
+                {
+                    entry.Function = handler;
+                    return;
+                }
+            }
+            m_handlers.push_back(Entry{ TypeKey<NotifyData>(), handler });
         }
 
-    private:
-        NOTIFY_FUNCTION(NotifyData) m_notifyFunction;
-    };
-
-    template<typename NotifyData>
-    void SetNotifyFunction(NOTIFY_FUNCTION(NotifyData) notifyFunction)
-    {
-        if (notifyFunction == nullptr) // you have to release notifier in this way
+        // nullptr if there is no handler of the type
+        template<typename NotifyData>
+        NOTIFY_FUNCTION(NotifyData) * Get() const
         {
-            auto notifierPtr = GetNotifier<NotifyData>(false); // return nullptr if not exist
-            if (*notifierPtr)
+            for (auto& entry : m_handlers)
             {
-                delete *notifierPtr;
-                *notifierPtr = nullptr;
+                if (entry.Type == TypeKey<NotifyData>())
+                    return static_cast<NOTIFY_FUNCTION(NotifyData) *>(entry.Function.get());
             }
+            return nullptr;
         }
-        else
+
+    private:
+        struct Entry
         {
-            auto notifierPtr = GetNotifier<NotifyData>();
-            (*notifierPtr)->SetFunction(notifyFunction);
-        }
-    }
+            const void *Type;
+            std::shared_ptr<void> Function; // NOTIFY_FUNCTION(NotifyData) of the Type
+        };
 
-    template<typename NotifyData>
-    NOTIFY_FUNCTION(NotifyData) GetNotifyFunction()
-    {
-        auto notifierPtr = GetNotifier<NotifyData>(false);
+        // an address unique to the type, without RTTI
+        template<typename NotifyData>
+        static const void * TypeKey()
+        {
+            static const char key = 0;
+            return &key;
+        }
 
-        if (*notifierPtr)
-            return (*notifierPtr)->GetFunction();
-        return nullptr;
-    }
-}
\ No newline at end of file
+    private:
+        std::vector<Entry> m_handlers;
+    };
+}
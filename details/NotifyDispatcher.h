@@ -0,0 +1,194 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Executor.h"
+#include "NotifyDetails.h"
+#include "Optional.h"
+#include "Timer.h"
+#include "UniqueFunction.h"
+
+namespace Async {
+
+    typedef enum
+    {
+        NotifyMode_All,    // every notification, in order
+        NotifyMode_Latest  // only the latest one not delivered yet
+    } NotifyMode;
+
+    /////////////////////////////////////////////////
+    /// class NotifyPolicy
+    /////////////////////////////////////////////////
+    // how NotifiedOn delivers the notifications to its executor
+    struct NotifyPolicy
+    {
+        NotifyMode Mode;
+        std::chrono::steady_clock::duration MinInterval; // between two deliveries, zero for no limit
+
+        static NotifyPolicy All()
+        {
+            return NotifyPolicy{ NotifyMode_All, std::chrono::steady_clock::duration::zero() };
+        }
+
+        static NotifyPolicy Latest()
+        {
+            return NotifyPolicy{ NotifyMode_Latest, std::chrono::steady_clock::duration::zero() };
+        }
+
+        // the latest value, at most count deliveries per second
+        static NotifyPolicy AtMostPerSecond(size_t count)
+        {
+            return NotifyPolicy{ NotifyMode_Latest,
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::seconds(1)) /
+                static_cast<std::chrono::steady_clock::duration::rep>(std::max<size_t>(count, 1)) };
+        }
+    };
+
+    namespace NotifyDetails {
+
+        /////////////////////////////////////////////////
+        /// class Dispatcher
+        /////////////////////////////////////////////////
+        // the Notified handler of NotifiedOn: the notifying thread only queues the data under a short lock,
+        // the handler runs on the executor, one notification at a time and in order.
+        template<typename NotifyData>
+        class Dispatcher
+        {
+        private:
+            struct State : std::enable_shared_from_this<State>
+            {
+                State(iExecutor::ptr executor, NOTIFY_FUNCTION(NotifyData)&& handler, NotifyPolicy policy)
+                    : Executor(executor), Handler(std::move(handler)), Policy(policy), Draining(false)
+                {}
+
+                void Push(const NotifyData& data)
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(Mutex);
+
+                        if (Policy.Mode == NotifyMode_All)
+                            Pending.push_back(data);
+                        else
+                            Latest.Emplace(data);
+
+                        if (Draining)
+                            return;
+                        Draining = true;
+                    }
+
+                    auto self = this->shared_from_this();
+                    Executor->Post([self] {
+                        self->Drain();
+                    });
+                }
+
+                // the only one running until nothing is pending, so the handler is never called concurrently
+                void Drain()
+                {
+                    while (true)
+                    {
+                        {
+                            std::lock_guard<std::mutex> lock(Mutex);
+
+                            if (Pending.empty() && !Latest.HasValue())
+                            {
+                                Draining = false;
+                                return;
+                            }
+                        }
+
+                        if (Policy.Mode == NotifyMode_All)
+                            DeliverPending();
+                        else if (!DeliverLatest())
+                            return; // still draining, posted again by the timer
+                    }
+                }
+
+                void DeliverPending()
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(Mutex);
+                        std::swap(Pending, Delivering);
+                    }
+
+                    for (auto& data : Delivering)
+                        Deliver(data);
+                    Delivering.clear(); // keep the capacity for the next swap
+                }
+
+                // return false if the interval since the last delivery hasn't passed, then the timer posts
+                // Drain() again once it has, so no executor thread is held while waiting. The values
+                // pushed meanwhile are conflated into that delivery.
+                bool DeliverLatest()
+                {
+                    if (Policy.MinInterval > std::chrono::steady_clock::duration::zero())
+                    {
+                        const auto next = LastDelivery + Policy.MinInterval;
+                        if (std::chrono::steady_clock::now() < next)
+                        {
+                            auto self = this->shared_from_this();
+                            TimerService::Default().Schedule(next, TimerService::Clock::duration::zero(), [self] {
+                                self->Executor->Post([self] {
+                                    self->Drain();
+                                });
+                            });
+                            return false;
+                        }
+                    }
+
+                    Optional<NotifyData> data;
+                    {
+                        std::lock_guard<std::mutex> lock(Mutex);
+                        data.Emplace(std::move(Latest.Get()));
+                        Latest.Reset();
+                    }
+
+                    LastDelivery = std::chrono::steady_clock::now();
+                    Deliver(data.Get());
+                    return true;
+                }
+
+                void Deliver(const NotifyData& data)
+                {
+                    try
+                    {
+                        Handler(data);
+                    }
+                    catch (...)
+                    {
+                    }
+                }
+
+                iExecutor::ptr Executor;
+                NOTIFY_FUNCTION(NotifyData) Handler;
+                const NotifyPolicy Policy;
+
+                std::mutex Mutex;
+                bool Draining; // a Drain() is posted or running
+                std::vector<NotifyData> Pending; // NotifyMode_All
+                Optional<NotifyData> Latest; // NotifyMode_Latest
+
+                // only touched by Drain()
+                std::vector<NotifyData> Delivering;
+                std::chrono::steady_clock::time_point LastDelivery;
+            };
+
+        public:
+            Dispatcher(iExecutor::ptr executor, NOTIFY_FUNCTION(NotifyData)&& handler, NotifyPolicy policy)
+                : m_state(std::make_shared<State>(executor, std::move(handler), policy))
+            {}
+
+            void operator()(const NotifyData& data) const
+            {
+                m_state->Push(data);
+            }
+
+        private:
+            std::shared_ptr<State> m_state;
+        };
+    }
+}
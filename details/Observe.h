@@ -1,171 +1,543 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
-#include <memory>
 #include <deque>
+#include <functional>
+#include <memory>
+#include <iterator>
 #include <thread>
-
+#include <type_traits>
+#include <vector>
+
+#include "Coroutine.h"
+#include "Executor.h"
+#include "FusedChain.h"
+#include "NotifyDispatcher.h"
+#include "Optional.h"
+#include "QueuePolicy.h"
+#include "QueueStorage.h"
+#include "RingObservableQueue.h"
 #include "TaskDetails.h"
 #include "TaskHandle.h"
+#include "ThreadLocal.h"
+#include "WaitDetails.h"
 
 namespace Async {
 
-    typedef struct _ObservableQueuePopResult_
-    {
-        _ObservableQueuePopResult_(bool success = false, bool closed = false)
-            : m_success(success), m_closed(closed)
-        {}
-
-        bool IsSuccess() const
-        {
-            return m_success;
-        }
-
-        bool IsClosed() const
-        {
-            return m_closed;
-        }
-
-    private:
-        bool m_success; // indicate this pop returns one or some objects
-        bool m_closed; // indicate the queue has been closed
-
-    } ObservableQueuePopResult;
-
     /////////////////////////////////////////////////
-    /// class ObservableQueue
+    /// class LockedObservableQueue
     /////////////////////////////////////////////////
-    template<typename ObjectType>
-    class ObservableQueue
+    // the ObservableQueue on a StorageType guarded by a std::mutex
+    template<typename ObjectType, typename StorageType>
+    class LockedObservableQueue
     {
     public:
-        ~ObservableQueue()
+        ~LockedObservableQueue()
         {
             if (m_onCompleted)
                 m_onCompleted();
         }
 
-        static std::shared_ptr<ObservableQueue<ObjectType> >
-        New(std::function<void()> onCompleted = nullptr,
-            size_t limitation = SIZE_MAX)
-        {
-            return std::shared_ptr<ObservableQueue<ObjectType> >
-                (new ObservableQueue<ObjectType>(onCompleted, limitation));
-        }
-
         void Close()
         {
-            std::lock_guard<std::mutex> lock(m_mutex);
+            std::unique_lock<std::mutex> lock(m_mutex);
 
             m_closed = true;
+            m_cv.notify_all();
+            m_cvNotFull.notify_all();
+
+            WakeReadyCallbacks(lock, SIZE_MAX);
         }
 
         void PushOne(const ObjectType& object)
         {
-            while (true)
-            {
-                std::lock_guard<std::mutex> lock(m_mutex);
+            Emplace(object);
+        }
 
-                if (m_closed) // if closed, do nothing
-                    return;
+        void PushOne(ObjectType&& object)
+        {
+            Emplace(std::move(object));
+        }
 
-                if (Async::Cancel::IsCancelled())
-                    return;
+        // construct the object in the queue
+        template<typename... Args>
+        void Emplace(Args&&... args)
+        {
+            CancelCallbackGuard cancelWakeup; // removed after the lock is released
+            std::unique_lock<std::mutex> lock(m_mutex);
 
-                if (m_queue.size() >= m_limitation)
-                {
-                    std::this_thread::sleep_for(std::chrono::microseconds(100));
-                    continue;
-                }
+            if (!WaitNotFull(lock, cancelWakeup))
+                return;
 
-                m_queue.push_back(object);
-                m_cv.notify_all();
+            m_storage.Emplace(std::forward<Args>(args)...);
+            m_size.store(m_storage.Size(), std::memory_order_release);
+            m_cv.notify_one();
 
-                break;
-            }
+            WakeReadyCallbacks(lock, 1);
         }
 
+        // the objects of a temporary container are moved, otherwise copied
         template<typename ObjectTypeContainer>
-        void PushSome(const ObjectTypeContainer& objects)
+        void PushSome(ObjectTypeContainer&& objects)
         {
-            while (true)
-            {
-                std::lock_guard<std::mutex> lock(m_mutex);
+            typedef std::integral_constant<bool, !std::is_lvalue_reference<ObjectTypeContainer>::value> IsTemporary;
 
-                if (m_closed) // if closed, do nothing
-                    return;
+            PushSome(QueueDetails::MoveIteratorIf(objects.begin(), IsTemporary()),
+                     QueueDetails::MoveIteratorIf(objects.end(), IsTemporary()));
+        }
 
-                if (Async::Cancel::IsCancelled())
-                    return;
+        // if the queue is bounded, the objects are pushed piece by piece as the capacity frees up.
+        // Pass std::move_iterator to move the objects into the queue.
+        template<typename Iterator>
+        void PushSome(Iterator first, Iterator last)
+        {
+            CancelCallbackGuard cancelWakeup; // removed after the lock is released
+            std::unique_lock<std::mutex> lock(m_mutex);
 
-                if (m_queue.size() >= m_limitation)
-                {
-                    std::this_thread::sleep_for(std::chrono::microseconds(100));
-                    continue;
-                }
+            while (first != last)
+            {
+                if (!WaitNotFull(lock, cancelWakeup))
+                    return;
 
-                m_queue.insert(m_queue.end(), objects.begin(), objects.end());
+                for (; first != last && m_storage.Size() < m_limitation; ++first)
+                    m_storage.Emplace(*first);
+                m_size.store(m_storage.Size(), std::memory_order_release);
                 m_cv.notify_all();
 
-                break;
+                WakeReadyCallbacks(lock, m_storage.Size());
             }
         }
 
+        // wait until there is an object, or the queue is closed, or the task is cancelled
         ObservableQueuePopResult PopOne(ObjectType& obj)
         {
-            std::unique_lock<std::mutex> lock(m_mutex);
+            return ConsumeOne([&obj](ObjectType&& object) {
+                obj = std::move(object);
+            });
+        }
 
-            if (m_queue.empty())
-                m_cv.wait_for(lock, std::chrono::milliseconds(300));
+        // like PopOne, but the object is moved to consume(ObjectType&&) under the lock,
+        // so ObjectType needn't be default-constructible or assignable
+        template<typename ConsumeFunction>
+        ObservableQueuePopResult ConsumeOne(ConsumeFunction&& consume)
+        {
+            SpinWait();
+
+            CancelCallbackGuard cancelWakeup; // removed after the lock is released
+            std::unique_lock<std::mutex> lock(m_mutex);
 
-            if (m_queue.empty())
+            if (!WaitNotEmpty(lock, cancelWakeup))
                 return ObservableQueuePopResult(false, m_closed);
 
-            obj = m_queue.front();
-            m_queue.pop_front();
+            m_storage.ConsumeFront(consume);
+            m_size.store(m_storage.Size(), std::memory_order_release);
+
+            if (m_waitingProducers > 0)
+                m_cvNotFull.notify_one();
 
             return ObservableQueuePopResult(true, false);
         }
 
+        // wait until there are objects, or the queue is closed, or the task is cancelled.
+        // An empty vector without capacity takes a recycled buffer first.
         ObservableQueuePopResult PopSome(std::vector<ObjectType>& vector)
         {
+            SpinWait();
+
+            CancelCallbackGuard cancelWakeup; // removed after the lock is released
             std::unique_lock<std::mutex> lock(m_mutex);
 
-            if (m_queue.empty())
-                m_cv.wait_for(lock, std::chrono::milliseconds(300));
+            if (!WaitNotEmpty(lock, cancelWakeup))
+                return ObservableQueuePopResult(false, m_closed);
+
+            m_storage.MoveAllTo(vector);
+            m_size.store(0, std::memory_order_release);
+
+            if (m_waitingProducers > 0)
+                m_cvNotFull.notify_all();
 
-            if (m_queue.empty())
+            return ObservableQueuePopResult(true, false);
+        }
+
+        /**
+        Size- and time-bounded PopSome. Once there is an object, wait until maxBatch objects are queued
+        or maxLinger has passed, then pop at most maxBatch objects.
+
+        @param vector, the popped objects are appended.
+        @param maxBatch, the most objects popped at once.
+        @param maxLinger, the longest wait for a full batch after the first object is seen.
+        @return ObservableQueuePopResult.
+        */
+        template<typename Rep, typename Period>
+        ObservableQueuePopResult PopSome(std::vector<ObjectType>& vector,
+                                         size_t maxBatch,
+                                         const std::chrono::duration<Rep, Period>& maxLinger)
+        {
+            // a batch bigger than the queue can hold never fills up
+            maxBatch = std::max<size_t>(std::min(maxBatch, m_limitation), 1);
+
+            SpinWait();
+
+            CancelCallbackGuard cancelWakeup; // removed after the lock is released
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            if (!WaitNotEmpty(lock, cancelWakeup))
                 return ObservableQueuePopResult(false, m_closed);
 
-            std::deque<ObjectType> emptyQueue;
-            m_queue.swap(emptyQueue);
+            if (maxLinger > std::chrono::duration<Rep, Period>::zero())
+                WaitBatch(lock, cancelWakeup, maxBatch,
+                    std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(maxLinger));
+
+            m_storage.MoveSomeTo(vector, maxBatch);
+            m_size.store(m_storage.Size(), std::memory_order_release);
 
-            vector.insert(vector.end(), emptyQueue.begin(), emptyQueue.end());
+            if (m_waitingProducers > 0)
+                m_cvNotFull.notify_all();
+
+            // the lingering may have taken the wakeups of other consumers
+            if (!m_storage.IsEmpty())
+                m_cv.notify_one();
 
             return ObservableQueuePopResult(true, false);
         }
 
-    private:
-        // force to always init using New()
-        ObservableQueue(std::function<void()> onCompleted,
-                        size_t limitation)
+        // like ConsumeOne, but return at once if the queue is empty
+        template<typename ConsumeFunction>
+        ObservableQueuePopResult TryConsumeOne(ConsumeFunction&& consume)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            if (m_storage.IsEmpty())
+                return ObservableQueuePopResult(false, m_closed);
+
+            m_storage.ConsumeFront(consume);
+            m_size.store(m_storage.Size(), std::memory_order_release);
+
+            if (m_waitingProducers > 0)
+                m_cvNotFull.notify_one();
+
+            return ObservableQueuePopResult(true, false);
+        }
+
+        // like PopSome, but return at once if the queue is empty
+        ObservableQueuePopResult TryPopSome(std::vector<ObjectType>& vector)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            if (m_storage.IsEmpty())
+                return ObservableQueuePopResult(false, m_closed);
+
+            m_storage.MoveAllTo(vector);
+            m_size.store(0, std::memory_order_release);
+
+            if (m_waitingProducers > 0)
+                m_cvNotFull.notify_all();
+
+            return ObservableQueuePopResult(true, false);
+        }
+
+        // the callback is called once, out of the lock, by the next push or Close(), then a Try* pop may
+        // succeed. Return false without keeping the callback if the queue isn't empty or is closed already.
+        // It lets a waiter suspend instead of blocking a thread, e.g. co_await Pop(). The callback returns
+        // false if its waiter is gone, e.g. cancelled, then the wake passes on to the next callback.
+        bool NotifyWhenReady(UniqueFunction<bool()> callback)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            if (!m_storage.IsEmpty() || m_closed)
+                return false;
+
+            m_readyCallbacks.push_back(std::move(callback));
+            return true;
+        }
+
+#if ASYNC_HAS_COROUTINES
+        // co_await Pop() suspends the coroutine instead of blocking a thread,
+        // and returns std::nullopt if the queue is empty and closed, or the CoTask is cancelled
+        CoroutineDetails::PopOneAwaiter<LockedObservableQueue, ObjectType> Pop()
+        {
+            return CoroutineDetails::PopOneAwaiter<LockedObservableQueue, ObjectType>(*this);
+        }
+
+        // co_await PopSome() suspends the coroutine instead of blocking a thread,
+        // and returns an empty vector if the queue is empty and closed, or the CoTask is cancelled
+        CoroutineDetails::PopSomeAwaiter<LockedObservableQueue, ObjectType> PopSome()
+        {
+            return CoroutineDetails::PopSomeAwaiter<LockedObservableQueue, ObjectType>(*this);
+        }
+#endif
+
+        // producers wait once the queue holds this many objects, SIZE_MAX if unbounded
+        size_t Limitation() const
+        {
+            return m_limitation;
+        }
+
+        // hand a drained PopSome buffer back, so its capacity is reused by the next PopSome
+        void Recycle(std::vector<ObjectType>&& buffer)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            m_storage.Recycle(std::move(buffer));
+        }
+
+    protected:
+        LockedObservableQueue(UniqueFunction<void()> onCompleted,
+                              size_t limitation,
+                              size_t maxSpins)
         : m_limitation(limitation),
           m_closed(false),
-          m_onCompleted(onCompleted)
+          m_waitingProducers(0),
+          m_onCompleted(std::move(onCompleted)),
+          m_size(0),
+          m_spin(maxSpins)
         {}
 
+    private:
+        // call the ready callbacks out of the lock, until count of them have taken the wake
+        void WakeReadyCallbacks(std::unique_lock<std::mutex>& lock, size_t count)
+        {
+            while (count > 0 && !m_readyCallbacks.empty())
+            {
+                std::vector<UniqueFunction<bool()> > callbacks;
+                while (!m_readyCallbacks.empty() && callbacks.size() < count)
+                {
+                    callbacks.push_back(std::move(m_readyCallbacks.front()));
+                    m_readyCallbacks.pop_front();
+                }
+
+                lock.unlock();
+                for (auto& callback : callbacks)
+                {
+                    if (callback())
+                        count--;
+                }
+                lock.lock();
+            }
+        }
+
+        // return false if the queue is empty and closed, or the task is cancelled
+        bool WaitNotEmpty(std::unique_lock<std::mutex>& lock, CancelCallbackGuard& cancelWakeup)
+        {
+            while (true)
+            {
+                if (!m_storage.IsEmpty())
+                    return true;
+
+                if (m_closed)
+                    return false;
+
+                if (Async::Cancel::IsCancelled())
+                    return false;
+
+                if (!cancelWakeup.IsRegistered())
+                {
+                    // register out of the lock, the callback takes the lock to wake this thread up
+                    lock.unlock();
+                    cancelWakeup.Register([this] {
+                        std::lock_guard<std::mutex> lock(m_mutex);
+                        m_cv.notify_all();
+                    });
+                    lock.lock();
+                    continue;
+                }
+
+                m_cv.wait(lock);
+            }
+        }
+
+        // wait until maxBatch objects are queued, or the deadline, or the queue is closed, or the task is cancelled
+        void WaitBatch(std::unique_lock<std::mutex>& lock,
+                       CancelCallbackGuard& cancelWakeup,
+                       size_t maxBatch,
+                       std::chrono::steady_clock::time_point deadline)
+        {
+            while (m_storage.Size() < maxBatch && !m_closed && !Async::Cancel::IsCancelled())
+            {
+                if (!cancelWakeup.IsRegistered())
+                {
+                    // register out of the lock, the callback takes the lock to wake this thread up
+                    lock.unlock();
+                    cancelWakeup.Register([this] {
+                        std::lock_guard<std::mutex> lock(m_mutex);
+                        m_cv.notify_all();
+                    });
+                    lock.lock();
+                    continue;
+                }
+
+                if (m_cv.wait_until(lock, deadline) == std::cv_status::timeout)
+                    return;
+            }
+        }
+
+        // spin a while on an empty queue before parking
+        void SpinWait()
+        {
+            m_spin.Spin([this] {
+                return m_size.load(std::memory_order_acquire) > 0;
+            });
+        }
+
+        // return false if the queue is closed or the task is cancelled
+        bool WaitNotFull(std::unique_lock<std::mutex>& lock, CancelCallbackGuard& cancelWakeup)
+        {
+            while (true)
+            {
+                if (m_closed) // if closed, do nothing
+                    return false;
+
+                if (Async::Cancel::IsCancelled())
+                    return false;
+
+                if (m_storage.Size() < m_limitation)
+                    return true;
+
+                if (!cancelWakeup.IsRegistered())
+                {
+                    // register out of the lock, the callback takes the lock to wake this thread up
+                    lock.unlock();
+                    cancelWakeup.Register([this] {
+                        std::lock_guard<std::mutex> lock(m_mutex);
+                        m_cvNotFull.notify_all();
+                    });
+                    lock.lock();
+                    continue;
+                }
+
+                m_waitingProducers++;
+                m_cvNotFull.wait(lock);
+                m_waitingProducers--;
+            }
+        }
+
     private:
         const size_t m_limitation;
         bool m_closed;
-        std::function<void()> m_onCompleted;
+        size_t m_waitingProducers;
+        UniqueFunction<void()> m_onCompleted;
 
-        std::deque<ObjectType> m_queue;
+        StorageType m_storage;
+        std::atomic<size_t> m_size; // for spinning consumers without the lock
+        AdaptiveSpin m_spin;
         std::mutex m_mutex;
         std::condition_variable m_cv;
+        std::condition_variable m_cvNotFull; // producers wait here when the queue is full
+        std::deque<UniqueFunction<bool()> > m_readyCallbacks; // see NotifyWhenReady
     };
 
+    /////////////////////////////////////////////////
+    /// class ObservableQueue<ObjectType, LockedQueuePolicy>
+    /////////////////////////////////////////////////
+    template<typename ObjectType>
+    class ObservableQueue<ObjectType, LockedQueuePolicy>
+        : public LockedObservableQueue<ObjectType, DequeStorage<ObjectType> >
+    {
+    public:
+        /**
+        New an ObservableQueue.
+
+        @param onCompleted, called when the queue is released.
+        @param limitation, producers wait when the queue is full.
+        @param maxSpins, consumers spin adaptively up to maxSpins times on an empty queue
+        before parking, for latency-critical queues. 0 means park immediately.
+        @return std::shared_ptr<ObservableQueue>.
+        */
+        static std::shared_ptr<ObservableQueue>
+        New(UniqueFunction<void()> onCompleted = nullptr,
+            size_t limitation = SIZE_MAX,
+            size_t maxSpins = 0)
+        {
+            return std::shared_ptr<ObservableQueue>
+                (new ObservableQueue(std::move(onCompleted), limitation, maxSpins));
+        }
+
+    private:
+        // force to always init using New()
+        ObservableQueue(UniqueFunction<void()> onCompleted,
+                        size_t limitation,
+                        size_t maxSpins)
+        : LockedObservableQueue<ObjectType, DequeStorage<ObjectType> >(std::move(onCompleted), limitation, maxSpins)
+        {}
+    };
+
+    /////////////////////////////////////////////////
+    /// class ObservableQueue<ObjectType, DoubleBufferPolicy>
+    /////////////////////////////////////////////////
+    template<typename ObjectType>
+    class ObservableQueue<ObjectType, DoubleBufferPolicy>
+        : public LockedObservableQueue<ObjectType, DoubleBufferStorage<ObjectType> >
+    {
+    public:
+        /**
+        New a double-buffered ObservableQueue for batch consumers (ReceiveSome).
+
+        @param onCompleted, called when the queue is released.
+        @param limitation, producers wait when the queue is full.
+        @param maxSpins, consumers spin adaptively up to maxSpins times on an empty queue
+        before parking. 0 means park immediately.
+        @return std::shared_ptr<ObservableQueue>.
+        */
+        static std::shared_ptr<ObservableQueue>
+        New(UniqueFunction<void()> onCompleted = nullptr,
+            size_t limitation = SIZE_MAX,
+            size_t maxSpins = 0)
+        {
+            return std::shared_ptr<ObservableQueue>
+                (new ObservableQueue(std::move(onCompleted), limitation, maxSpins));
+        }
+
+    private:
+        // force to always init using New()
+        ObservableQueue(UniqueFunction<void()> onCompleted,
+                        size_t limitation,
+                        size_t maxSpins)
+        : LockedObservableQueue<ObjectType, DoubleBufferStorage<ObjectType> >(std::move(onCompleted), limitation, maxSpins)
+        {}
+    };
+
+    namespace ObserveDetails {
+
+        // the index of the ObserveTask worker running on the current thread
+        inline size_t * CurrentWorkerIndex()
+        {
+            static THREAD_LOCAL size_t workerIndex = 0;
+
+            return &workerIndex;
+        }
+
+        // pops one object and runs the ReceiveOne function on it
+        template<typename ObjectType, typename QueuePolicy, typename TaskFunction>
+        struct ReceiveOneStage
+        {
+            typedef FUNCTION_WITH_ARGUMENT_RETURN_TYPE(TaskFunction, ObjectType) ReturnType;
+
+            std::shared_ptr<ObservableQueue<ObjectType, QueuePolicy> > Queue;
+            TaskFunction Func;
+            std::shared_ptr<TaskBypassFlag> BypassFlag;
+
+            ReturnType operator()()
+            {
+                Optional<ObjectType> obj;
+                auto ret = Queue->ConsumeOne([&obj](ObjectType&& object) {
+                    obj.Emplace(std::move(object));
+                });
+
+                // if the queue is empty and closed, or the task is cancelled,
+                // set the Bypass flag, and the thread function will run to exit
+                if (!ret.IsSuccess())
+                {
+                    BypassFlag->Set(true);
+                    return ReturnType();
+                }
+                return Func(std::move(obj.Get()));
+            }
+        };
+    }
+
     /////////////////////////////////////////////////
     /// class ObserveTask
     /////////////////////////////////////////////////
@@ -173,13 +545,17 @@ namespace Async {
     class ObserveTask
     {
     public:
-        ObserveTask(std::shared_ptr<TaskDetails<ReturnType> > taskDetails)
-            : m_details(taskDetails)
+        // fixedWorkers, if not 0, is the number of workers Run() always starts,
+        // and beforeRun, if any, is called by Run() before the workers are posted.
+        // It is shared by the tasks Then/Get chain from this one
+        ObserveTask(std::shared_ptr<TaskDetails<ReturnType> > taskDetails, size_t fixedWorkers = 0,
+                    std::shared_ptr<UniqueFunction<void()> > beforeRun = nullptr)
+            : m_details(taskDetails), m_fixedWorkers(fixedWorkers), m_beforeRun(std::move(beforeRun))
         {
         }
 
         ObserveTask(const ObserveTask& other)
-            : m_details(other.m_details)
+            : m_details(other.m_details), m_fixedWorkers(other.m_fixedWorkers), m_beforeRun(other.m_beforeRun)
         {
         }
 
@@ -190,61 +566,150 @@ namespace Async {
         template<typename NextTaskFunction>
         ObserveTask<FUNCTION_RETURN_TYPE(NextTaskFunction)> Then(NextTaskFunction&& func)
         {
-            auto newDetails = m_details->Then(func);
-            return ObserveTask<FUNCTION_RETURN_TYPE(NextTaskFunction)>(newDetails);
+            auto newDetails = m_details->Then(std::forward<NextTaskFunction>(func));
+            return ObserveTask<FUNCTION_RETURN_TYPE(NextTaskFunction)>(newDetails, m_fixedWorkers, m_beforeRun);
         }
 
         template<typename NextTaskFunction, typename U = ReturnType>
         ObserveTask<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(NextTaskFunction, U)> Get(NextTaskFunction&& func)
         {
-            auto newDetails = m_details->Get(func);
-            return ObserveTask<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(NextTaskFunction, U)>(newDetails);
+            auto newDetails = m_details->Get(std::forward<NextTaskFunction>(func));
+            return ObserveTask<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(NextTaskFunction, U)>(newDetails, m_fixedWorkers, m_beforeRun);
         }
 
         template<typename NotifyData>
         ObserveTask & Notified(NOTIFY_FUNCTION(NotifyData) && notifyFunction)
         {
-            m_details->template Notified<NotifyData>(notifyFunction);
+            m_details->template Notified<NotifyData>(std::move(notifyFunction));
+            return *this;
+        }
+
+        /**
+        Like Notified, but the handler runs on the executor, so a slow handler doesn't stall the task.
+        Notify only queues the data, the handler is called one notification at a time, in order.
+
+        @param executor, where the handler runs.
+        @param notifyFunction, the handler.
+        @param policy, NotifyPolicy::All() delivers every notification, NotifyPolicy::Latest() only
+        the latest one not delivered yet, and NotifyPolicy::AtMostPerSecond(n) the latest one at most
+        n times per second, the next delivery waiting on the timer thread instead of the executor.
+        */
+        template<typename NotifyData>
+        ObserveTask & NotifiedOn(iExecutor::ptr executor,
+                                 NOTIFY_FUNCTION(NotifyData) && notifyFunction,
+                                 NotifyPolicy policy = NotifyPolicy::All())
+        {
+            m_details->template Notified<NotifyData>(
+                NotifyDetails::Dispatcher<NotifyData>(executor, std::move(notifyFunction), policy));
             return *this;
         }
 
         ObserveTask & OnException(EXCEPTION_HANDLE_FUNCTION exceptionHandle)
         {
-            m_details->OnException(exceptionHandle);
+            m_details->OnException(std::move(exceptionHandle));
             return *this;
         }
 
-        ObserveTask & OnBegin(std::function<void()> beginHandle)
+        // cancelled together with the token, e.g. a whole request tree by one CancellationSource
+        ObserveTask & CancelledBy(const CancellationToken& token)
         {
-            m_details->OnBegin(beginHandle);
+            m_details->CancelledBy(token);
             return *this;
         }
 
-        ObserveTask & OnEnd(std::function<void()> endHandle)
+        // cancel each run once the timeout has passed since Run(), by the shared timer thread
+        template<typename Rep, typename Period>
+        ObserveTask & WithTimeout(const std::chrono::duration<Rep, Period>& timeout)
         {
-            m_details->OnEnd(endHandle);
+            m_details->WithTimeout(std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout));
             return *this;
         }
 
+        ObserveTask & OnBegin(UniqueFunction<void()> beginHandle)
+        {
+            m_details->OnBegin(std::move(beginHandle));
+            return *this;
+        }
+
+        ObserveTask & OnEnd(UniqueFunction<void()> endHandle)
+        {
+            m_details->OnEnd(std::move(endHandle));
+            return *this;
+        }
+
+        // the observing loop keeps running until the queue is closed or the task is cancelled,
+        // so by default it gets its own thread instead of occupying a pool worker
         iTaskHandle::ptr Run()
         {
+            return Run(DedicatedThreadExecutor::New(), 1);
+        }
+
+        iTaskHandle::ptr Run(iExecutor::ptr executor)
+        {
+            return Run(executor, 1);
+        }
+
+        // concurrency workers on their own threads drain the same queue
+        iTaskHandle::ptr Run(size_t concurrency)
+        {
+            return Run(DedicatedThreadExecutor::New(), concurrency);
+        }
+
+        iTaskHandle::ptr Run(iExecutor::ptr executor, TaskPriority priority)
+        {
+            return Run(executor, 1, priority);
+        }
+
+        iTaskHandle::ptr Run(iExecutor::ptr executor, size_t concurrency)
+        {
+            return Run(executor, concurrency, TaskPriority_Inherit);
+        }
+
+        /**
+        Run concurrency workers draining the same queue, each running the whole chain.
+        OnBegin is called by the first worker before it posts the others, and OnEnd by the last
+        worker to exit. It returns without waiting for the workers to start.
+
+        @param executor, every worker occupies one of its threads until the loop ends.
+        @param concurrency, the number of workers, at least 1. Ignored by a partitioned task,
+        which always runs the dispatcher first, then one worker per partition. With fewer threads
+        than partitions + 1, the partitions left waiting for a thread start once the source queue
+        is closed and the dispatcher has returned, so the source must be unbounded: a partition
+        queue is bounded like the source, and a full one stalls the dispatcher.
+        @param priority, of the workers on a PriorityExecutor, and of the tasks they run with TaskPriority_Inherit.
+        @return iTaskHandle::ptr, Join() waits for all workers.
+        */
+        iTaskHandle::ptr Run(iExecutor::ptr executor, size_t concurrency, TaskPriority priority)
+        {
+            concurrency = m_fixedWorkers > 0 ? m_fixedWorkers : std::max<size_t>(concurrency, 1);
+            if (m_beforeRun)
+                (*m_beforeRun)();
+
             std::shared_ptr<TaskDetails<ReturnType> > taskDetails = m_details;
-            auto runFunction = [taskDetails](std::shared_ptr<std::promise<void> > promise) {
-                taskDetails->BeforeRun();
+            auto completion = TaskCompletion::New();
+            auto runningWorkers = std::make_shared<std::atomic<size_t> >(concurrency);
+
+            auto workerFunction = [taskDetails, completion, runningWorkers](size_t workerIndex, UniqueFunction<void()> startOthers) {
+                const size_t previousWorkerIndex = *ObserveDetails::CurrentWorkerIndex();
+                *ObserveDetails::CurrentWorkerIndex() = workerIndex;
+
+                typename TaskDetails<ReturnType>::ThreadScope scope;
+                taskDetails->Enter(scope);
+
+                // only the first worker has startOthers, the others are posted after OnBegin
+                if (startOthers)
+                {
+                    taskDetails->RunOnBegin();
+                    startOthers();
+                    startOthers = nullptr; // holds the executor
+                }
 
-                bool setPromise = false;
                 // 1. if IsCancelled, break the loop immediately, no matter if the queue is empty or not.
                 // 2. if Join() is called without Cancel(), then I will let the loop
                 // consume all rest objects in queue before exit. The way is to check Bypass flag,
                 // which actually is a "reference" of IsTryingCancel().
                 while (!Cancel::IsCancelled() && !taskDetails->IsBypass())
                 {
-                    if (!setPromise)
-                    {
-                        setPromise = true;
-                        promise->set_value();
-                    }
-
                     try
                     {
                         taskDetails->Run();
@@ -253,84 +718,221 @@ namespace Async {
                     {
                     }
                 }
-                taskDetails->AfterRun();
-            };
-
-            auto promiseRunning = std::make_shared<std::promise<void> >();
-            auto future = promiseRunning->get_future();
 
-            auto thread = std::make_shared<std::thread>(runFunction, promiseRunning);
+                if (runningWorkers->fetch_sub(1) == 1)
+                {
+                    taskDetails->RunOnEnd();
+                    taskDetails->Leave(scope);
+                    taskDetails->End();
+                    completion->Set();
+                }
+                else
+                {
+                    taskDetails->Leave(scope);
+                }
 
-            future.wait(); // to make sure the taskDetails has already been running
+                *ObserveDetails::CurrentWorkerIndex() = previousWorkerIndex;
+            };
 
             auto cancelFunc = [taskDetails]() {
                 taskDetails->Cancel();
             };
-            auto joinFunc = [thread, taskDetails]() {
-                if (thread && thread->joinable())
-                    thread->join();
-            };
-            auto detachFunc = [thread] {
-                if (thread && thread->joinable())
-                    thread->detach();
+            auto joinFunc = [completion]() {
+                completion->Wait();
             };
 
-            auto handle = TaskHandle::New(cancelFunc, joinFunc, detachFunc);
-            taskDetails->Handle = handle; // hold the handle in details, until the thread end
+            auto handle = TaskHandle::New(cancelFunc, joinFunc, nullptr);
+            taskDetails->Handle = handle; // hold the handle in details, until the loop end
+            taskDetails->Begin();
+
+            // the caller doesn't wait for the workers to start, so it may run on a busy executor,
+            // or from one of its own threads. startOthers refers to the workerFunction of the first
+            // worker, which outlives it, so it fits in the UniqueFunction buffer
+            executor->PostWithPriority([workerFunction, executor, concurrency, priority]() mutable {
+                UniqueFunction<void()> startOthers = [&workerFunction, executor, concurrency, priority]() {
+                    for (size_t i = 1; i < concurrency; i++)
+                    {
+                        executor->PostWithPriority([workerFunction, i]() {
+                            workerFunction(i, nullptr);
+                        }, priority);
+                    }
+                };
+                executor = nullptr; // only startOthers holds it, until the others are posted
+
+                workerFunction(0, std::move(startOthers));
+            }, priority);
 
             return handle;
         }
 
     private:
         std::shared_ptr<TaskDetails<ReturnType> > m_details;
+        size_t m_fixedWorkers;
+        std::shared_ptr<UniqueFunction<void()> > m_beforeRun;
     };
 
     /////////////////////////////////////////////////
-    /// class Observable
+    /// class PartitionedObservable
     /////////////////////////////////////////////////
-    template<typename ObjectType>
-    class Observable
+    // one worker per partition, the objects of a key always go to the same partition in FIFO order.
+    // The first worker dispatches the objects from the source queue into partition queues bounded
+    // like the source, so a full partition stalls the dispatcher and the producers wait on the source,
+    // while a hot key of an unbounded source only grows its own partition instead of stalling the others.
+    template<typename ObjectType, typename QueuePolicy, typename KeyFunction>
+    class PartitionedObservable
     {
+    private:
+        typedef typename std::decay<typename std::result_of<KeyFunction&(const ObjectType&)>::type>::type KeyType;
+
+        struct Partitions
+        {
+            std::shared_ptr<ObservableQueue<ObjectType, QueuePolicy> > Source;
+            std::vector<std::shared_ptr<ObservableQueue<ObjectType> > > Queues;
+            KeyFunction KeyOf;
+
+            // the queues of a run are closed at its end
+            void Reset()
+            {
+                for (auto& queue : Queues)
+                    queue = ObservableQueue<ObjectType>::New(nullptr, Source->Limitation());
+            }
+
+            // until the source is closed and empty, or the task is cancelled
+            void Dispatch()
+            {
+                while (true)
+                {
+                    Optional<ObjectType> obj;
+                    auto ret = Source->ConsumeOne([&obj](ObjectType&& object) {
+                        obj.Emplace(std::move(object));
+                    });
+                    if (!ret.IsSuccess())
+                        break;
+
+                    const size_t partition = std::hash<KeyType>()(KeyOf(obj.Get())) % Queues.size();
+                    Queues[partition]->PushOne(std::move(obj.Get()));
+                }
+
+                for (auto& queue : Queues)
+                    queue->Close();
+            }
+        };
+
     public:
-        Observable(std::shared_ptr<ObservableQueue<ObjectType> > observableQueue)
-            : m_observableQueue(observableQueue)
-        {}
+        PartitionedObservable(std::shared_ptr<ObservableQueue<ObjectType, QueuePolicy> > observableQueue,
+                              KeyFunction keyFunction,
+                              size_t partitions)
+            : m_partitions(std::make_shared<Partitions>(Partitions{ observableQueue, {}, keyFunction }))
+        {
+            m_partitions->Queues.resize(std::max<size_t>(partitions, 1));
+        }
 
         /**
-        ReceiveOne callback to handle Object one by one.
+        ReceiveOne callback to handle Object one by one, in order within a key.
 
         @param TaskFunction.
-        @return ObserveTask.
+        @return ObserveTask, running the dispatcher plus one worker per partition.
         */
         template<typename TaskFunction>
         ObserveTask<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(TaskFunction, ObjectType)> ReceiveOne(TaskFunction&& taskFunction)
         {
-            auto bypassFlag = std::shared_ptr<TaskBypassFlag>(new TaskBypassFlag({ false }));
-            auto observableQueue = m_observableQueue;
+            auto bypassFlag = std::make_shared<TaskBypassFlag>();
+            auto partitions = m_partitions;
 
-            auto func = [observableQueue, taskFunction, bypassFlag]() {
-                ObjectType obj {};
-                while (true)
+            auto func = [partitions, taskFunction, bypassFlag]() {
+                const size_t workerIndex = *ObserveDetails::CurrentWorkerIndex();
+
+                // the dispatcher, posted first, skips the chain and exits when the source is done
+                if (workerIndex == 0)
                 {
-                    auto ret = observableQueue->PopOne(obj);
-                    if (ret.IsSuccess())
-                        break;
+                    partitions->Dispatch();
+                    bypassFlag->Set(true);
+                    return FUNCTION_WITH_ARGUMENT_RETURN_TYPE(TaskFunction, ObjectType)();
+                }
 
-                    // if the queue is empty, and closed,
-                    // set the Bypass flag, and the thread function will run to exit
-                    if (ret.IsClosed())
-                    {
-                        bypassFlag->Bypass = true;
-                        return FUNCTION_WITH_ARGUMENT_RETURN_TYPE(TaskFunction, ObjectType)();
-                    }
+                Optional<ObjectType> obj;
+                auto ret = partitions->Queues[workerIndex - 1]->ConsumeOne([&obj](ObjectType&& object) {
+                    obj.Emplace(std::move(object));
+                });
+
+                // if the partition is empty and closed, or the task is cancelled,
+                // set the Bypass flag, and the thread function will run to exit
+                if (!ret.IsSuccess())
+                {
+                    bypassFlag->Set(true);
+                    return FUNCTION_WITH_ARGUMENT_RETURN_TYPE(TaskFunction, ObjectType)();
                 }
-                return taskFunction(obj);
+                return taskFunction(std::move(obj.Get()));
             };
             auto taskDetails = std::make_shared<TaskDetails<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(TaskFunction, ObjectType)> >(
-                std::forward<std::function<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(TaskFunction, ObjectType)()> >(func),
+                UniqueFunction<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(TaskFunction, ObjectType)()>(std::move(func)),
                 bypassFlag
             );
-            return ObserveTask<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(TaskFunction, ObjectType)>(taskDetails);
+            return ObserveTask<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(TaskFunction, ObjectType)>(taskDetails, partitions->Queues.size() + 1,
+                std::make_shared<UniqueFunction<void()> >([partitions]() {
+                    partitions->Reset();
+                }));
+        }
+
+    private:
+        std::shared_ptr<Partitions> m_partitions;
+    };
+
+    /////////////////////////////////////////////////
+    /// class Observable
+    /////////////////////////////////////////////////
+    template<typename ObjectType, typename QueuePolicy = LockedQueuePolicy>
+    class Observable
+    {
+    public:
+        Observable(std::shared_ptr<ObservableQueue<ObjectType, QueuePolicy> > observableQueue)
+            : m_observableQueue(observableQueue)
+        {}
+
+        /**
+        ReceiveOne callback to handle Object one by one.
+
+        @param TaskFunction.
+        @return ObserveTask.
+        */
+        template<typename TaskFunction>
+        ObserveTask<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(TaskFunction, ObjectType)> ReceiveOne(TaskFunction&& taskFunction)
+        {
+            return ReceiveOneFused(std::forward<TaskFunction>(taskFunction)).ToTask();
+        }
+
+        /**
+        Like ReceiveOne, but the Then/Get chain is fused at compile time and erased once
+        by ToTask() or Run().
+
+        @param TaskFunction.
+        @return FusedChain.
+        */
+        template<typename TaskFunction>
+        FusedChain<ObserveDetails::ReceiveOneStage<ObjectType, QueuePolicy, typename std::decay<TaskFunction>::type>, ObserveTask>
+        ReceiveOneFused(TaskFunction&& taskFunction)
+        {
+            typedef ObserveDetails::ReceiveOneStage<ObjectType, QueuePolicy, typename std::decay<TaskFunction>::type> SourceStage;
+
+            auto bypassFlag = std::make_shared<TaskBypassFlag>();
+            return FusedChain<SourceStage, ObserveTask>(
+                SourceStage{ m_observableQueue, std::forward<TaskFunction>(taskFunction), bypassFlag }, bypassFlag);
+        }
+
+        /**
+        Partition the Objects by key: the Objects of a key are handled in order by one worker,
+        and different keys are handled in parallel.
+
+        @param keyFunction, KeyType(const ObjectType&), KeyType is hashed by std::hash.
+        @param partitions, the number of workers.
+        @return PartitionedObservable.
+        */
+        template<typename KeyFunction>
+        PartitionedObservable<ObjectType, QueuePolicy, typename std::decay<KeyFunction>::type>
+        PartitionBy(KeyFunction&& keyFunction, size_t partitions)
+        {
+            return PartitionedObservable<ObjectType, QueuePolicy, typename std::decay<KeyFunction>::type>(
+                m_observableQueue, std::forward<KeyFunction>(keyFunction), partitions);
         }
 
         /**
@@ -342,44 +944,60 @@ namespace Async {
         template<typename TaskFunction>
         ObserveTask<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(TaskFunction, std::vector<ObjectType>)> ReceiveSome(TaskFunction&& taskFunction)
         {
-            auto bypassFlag = std::shared_ptr<TaskBypassFlag>(new TaskBypassFlag({ false }));
+            return ReceiveSome(std::forward<TaskFunction>(taskFunction), SIZE_MAX, std::chrono::steady_clock::duration::zero());
+        }
+
+        /**
+        ReceiveSome callback to handle a bunch of Objects, batched by size and time.
+        A batch is handled once maxBatch Objects are queued, or maxLinger has passed since
+        its first Object is seen.
+
+        @param TaskFunction.
+        @param maxBatch, the most Objects in a batch.
+        @param maxLinger, the longest wait for a full batch, zero to handle whatever is queued.
+        @return ObserveTask.
+        */
+        template<typename TaskFunction, typename Rep, typename Period>
+        ObserveTask<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(TaskFunction, std::vector<ObjectType>)> ReceiveSome(TaskFunction&& taskFunction,
+                                                                                                         size_t maxBatch,
+                                                                                                         const std::chrono::duration<Rep, Period>& maxLinger)
+        {
+            auto bypassFlag = std::make_shared<TaskBypassFlag>();
             auto observableQueue = m_observableQueue;
 
-            auto func = [observableQueue, taskFunction, bypassFlag]() {
+            auto func = [observableQueue, taskFunction, bypassFlag, maxBatch, maxLinger]() {
                 std::vector<ObjectType> objQueue;
-                while (true)
-                {
-                    auto ret = observableQueue->PopSome(objQueue);
-                    if (ret.IsSuccess())
-                        break;
+                auto ret = observableQueue->PopSome(objQueue, maxBatch, maxLinger);
 
-                    // if the queue is empty, and closed,
-                    // set the Bypass flag, and the thread function will run to exit
-                    if (ret.IsClosed())
-                    {
-                        bypassFlag->Bypass = true;
-                        return FUNCTION_WITH_ARGUMENT_RETURN_TYPE(TaskFunction, std::vector<ObjectType>)();
-                    }
+                // if the queue is empty and closed, or the task is cancelled,
+                // set the Bypass flag, and the thread function will run to exit
+                if (!ret.IsSuccess())
+                {
+                    bypassFlag->Set(true);
+                    return FUNCTION_WITH_ARGUMENT_RETURN_TYPE(TaskFunction, std::vector<ObjectType>)();
                 }
-                return taskFunction(objQueue);
+
+                // a handler taking the batch by reference leaves the buffer to be reused
+                QueueDetails::BufferRecycler<ObservableQueue<ObjectType, QueuePolicy>, ObjectType> recycler(*observableQueue, objQueue);
+                return taskFunction(std::move(objQueue));
             };
             auto taskDetails = std::make_shared<TaskDetails<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(TaskFunction, std::vector<ObjectType>)> >(
-                std::forward<std::function<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(TaskFunction, std::vector<ObjectType>)()> >(func),
+                UniqueFunction<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(TaskFunction, std::vector<ObjectType>)()>(std::move(func)),
                 bypassFlag
             );
             return ObserveTask<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(TaskFunction, std::vector<ObjectType>)>(taskDetails);
         }
 
     private:
-        std::shared_ptr<ObservableQueue<ObjectType> > m_observableQueue;
+        std::shared_ptr<ObservableQueue<ObjectType, QueuePolicy> > m_observableQueue;
     };
 
     /////////////////////////////////////////////////
     /// function Observe
     /////////////////////////////////////////////////
-    template<typename ObjectType>
-    Observable<ObjectType> Observe(std::shared_ptr<ObservableQueue<ObjectType> > observableQueue)
+    template<typename ObjectType, typename QueuePolicy>
+    Observable<ObjectType, QueuePolicy> Observe(std::shared_ptr<ObservableQueue<ObjectType, QueuePolicy> > observableQueue)
     {
-        return Observable<ObjectType>(observableQueue);
+        return Observable<ObjectType, QueuePolicy>(observableQueue);
     }
 }
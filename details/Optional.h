@@ -0,0 +1,67 @@
+#pragma once
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace Async {
+
+    /////////////////////////////////////////////////
+    /// class Optional
+    /////////////////////////////////////////////////
+    // holds a value or nothing, so ObjectType needn't be default-constructible
+    template<typename ObjectType>
+    class Optional
+    {
+    public:
+        // the storage is zeroed, so the compiler can see it is set on every path
+        // and doesn't report a use of it as maybe-uninitialized
+        Optional()
+            : m_storage(), m_hasValue(false)
+        {}
+
+        ~Optional()
+        {
+            Reset();
+        }
+
+        Optional(const Optional&) = delete;
+        Optional & operator=(const Optional&) = delete;
+
+        template<typename... Args>
+        void Emplace(Args&&... args)
+        {
+            Reset();
+            new (&m_storage) ObjectType(std::forward<Args>(args)...);
+            m_hasValue = true;
+        }
+
+        void Reset()
+        {
+            if (m_hasValue)
+            {
+                Get().~ObjectType();
+                m_hasValue = false;
+            }
+        }
+
+        bool HasValue() const
+        {
+            return m_hasValue;
+        }
+
+        ObjectType & Get()
+        {
+            return *reinterpret_cast<ObjectType *>(&m_storage);
+        }
+
+        const ObjectType & Get() const
+        {
+            return *reinterpret_cast<const ObjectType *>(&m_storage);
+        }
+
+    private:
+        typename std::aligned_storage<sizeof(ObjectType), std::alignment_of<ObjectType>::value>::type m_storage;
+        bool m_hasValue;
+    };
+}
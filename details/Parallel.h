@@ -0,0 +1,290 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "ExecutionContext.h"
+#include "Executor.h"
+#include "UniqueFunction.h"
+
+namespace Async {
+
+    namespace ParallelDetails {
+
+        /////////////////////////////////////////////////
+        /// class RangeState
+        /////////////////////////////////////////////////
+        // runs Body over the offsets [0, count) by recursive halving. A piece keeps its lower half and
+        // posts the upper one, which an idle worker steals, and a stolen piece may split deeper, so
+        // the chunks adapt to the load. The caller runs the first piece and helps with the posted ones
+        // until all are done, so it can wait from a worker of the same executor.
+        class RangeState : public std::enable_shared_from_this<RangeState>
+        {
+        private:
+            struct Piece
+            {
+                Piece(size_t begin, size_t end, int depth)
+                    : Begin(begin), End(end), Depth(depth), Poster(std::this_thread::get_id()), Claimed(false)
+                {}
+
+                size_t Begin;
+                size_t End;
+                int Depth; // how many more times it may split
+                std::thread::id Poster;
+                std::atomic<bool> Claimed; // by a worker or the caller, whoever comes first
+            };
+
+            // a stolen piece shows idle workers, it may split more
+            static const int StolenDepth = 2;
+
+        public:
+            RangeState(size_t count, size_t grain, iExecutor::ptr executor, UniqueFunction<void(size_t, size_t)> body)
+                : m_count(count), m_grain(std::max<size_t>(grain, 1)), m_executor(executor), m_body(std::move(body)),
+                m_context(ExecutionContext::Current()), m_remaining(count), m_stopped(false), m_done(false)
+            {}
+
+            // by the caller, rethrow the first exception of Body
+            void Run()
+            {
+                if (m_count == 0)
+                    return;
+
+                Piece root(0, m_count, InitialDepth());
+                root.Claimed = true;
+                RunPiece(root);
+
+                while (true)
+                {
+                    std::shared_ptr<Piece> piece;
+                    {
+                        std::unique_lock<std::mutex> lock(m_mutex);
+                        m_cv.wait(lock, [this] { return m_done || !m_pending.empty(); });
+                        if (m_done)
+                            break;
+
+                        piece = m_pending.back();
+                        m_pending.pop_back();
+                    }
+
+                    if (!piece->Claimed.exchange(true))
+                        RunPiece(*piece);
+                }
+
+                if (m_exception)
+                    std::rethrow_exception(m_exception);
+            }
+
+        private:
+            // about 4 pieces per hardware thread to begin with
+            static int InitialDepth()
+            {
+                const size_t pieces = std::max<size_t>(std::thread::hardware_concurrency(), 1) * 4;
+                int depth = 0;
+                while ((size_t(1) << depth) < pieces)
+                    depth++;
+                return depth;
+            }
+
+            void RunPiece(Piece& piece)
+            {
+                size_t begin = piece.Begin;
+                size_t end = piece.End;
+                int depth = piece.Depth;
+                if (piece.Poster != std::this_thread::get_id())
+                    depth += StolenDepth;
+
+                while (depth > 0 && end - begin > m_grain && !IsStopped())
+                {
+                    const size_t middle = begin + (end - begin) / 2;
+                    depth--;
+                    Post(std::make_shared<Piece>(middle, end, depth));
+                    end = middle;
+                }
+
+                RunChunk(begin, end);
+            }
+
+            void Post(std::shared_ptr<Piece> piece)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_pending.push_back(piece);
+                }
+                m_cv.notify_one();
+
+                auto self = shared_from_this();
+                m_executor->Post([self, piece] {
+                    if (!piece->Claimed.exchange(true))
+                        self->RunPiece(*piece);
+                });
+            }
+
+            // the chunk runs in the context of the caller, so Body sees its cancellation and Notified handlers
+            void RunChunk(size_t begin, size_t end)
+            {
+                if (!IsStopped())
+                {
+                    auto previous = ExecutionContext::Exchange(m_context);
+                    try
+                    {
+                        m_body(begin, end);
+                    }
+                    catch (...)
+                    {
+                        if (!m_stopped.exchange(true))
+                            m_exception = std::current_exception();
+                    }
+                    ExecutionContext::Exchange(previous);
+                }
+
+                // the last chunk wakes the caller up
+                if (m_remaining.fetch_sub(end - begin, std::memory_order_acq_rel) == end - begin)
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(m_mutex);
+                        m_done = true;
+                    }
+                    m_cv.notify_all();
+                }
+            }
+
+            // by an exception of Body, or a cancellation of the caller, the rest of chunks are skipped
+            bool IsStopped() const
+            {
+                return m_stopped.load(std::memory_order_relaxed) ||
+                    (m_context && m_context->Cancellation().IsCancelled());
+            }
+
+        private:
+            const size_t m_count;
+            const size_t m_grain;
+            iExecutor::ptr m_executor;
+            UniqueFunction<void(size_t, size_t)> m_body;
+            ExecutionContext *m_context; // of the caller, alive while it waits
+
+            std::atomic<size_t> m_remaining;
+            std::atomic<bool> m_stopped;
+            std::exception_ptr m_exception; // the first one, read by the caller after m_done
+
+            std::mutex m_mutex;
+            std::condition_variable m_cv;
+            bool m_done;
+            std::vector<std::shared_ptr<Piece> > m_pending; // posted, maybe claimed by a worker already
+        };
+
+        inline void ForRange(size_t count, size_t grain, iExecutor::ptr executor, UniqueFunction<void(size_t, size_t)> body)
+        {
+            if (!executor)
+                executor = GetCurrentExecutor();
+            if (!executor)
+                executor = GetDefaultExecutor();
+
+            std::make_shared<RangeState>(count, grain, executor, std::move(body))->Run();
+        }
+    }
+
+    /////////////////////////////////////////////////
+    /// function ParallelFor
+    /////////////////////////////////////////////////
+    /**
+    Call func for every index of [begin, end) on the executor, and return once all calls have returned.
+    The range is split recursively into chunks that idle workers steal, the calling thread runs chunks too.
+    Called from a task, the chunks run in its context: Cancel::IsCancelled() is checked between chunks,
+    the rest are skipped once the task is cancelled, and Notify reaches the Notified handlers of the task,
+    from several threads at a time.
+
+    @param begin, end, integers or random access iterators.
+    @param func, void(IndexType), called concurrently.
+    @param executor, nullptr for the current executor, otherwise the default one.
+    @param grain, the minimum size of a chunk.
+    The first exception thrown by func skips the rest of chunks, and is rethrown.
+    */
+    template<typename IndexType, typename Function>
+    void ParallelFor(IndexType begin, IndexType end, Function&& func, iExecutor::ptr executor = nullptr, size_t grain = 1)
+    {
+        typedef decltype(end - begin) DifferenceType;
+
+        const DifferenceType count = end - begin;
+        if (count <= 0)
+            return;
+
+        ParallelDetails::ForRange(static_cast<size_t>(count), grain, executor, [begin, &func](size_t first, size_t last) {
+            for (size_t i = first; i < last; i++)
+                func(begin + static_cast<DifferenceType>(i));
+        });
+    }
+
+    /////////////////////////////////////////////////
+    /// function ParallelTransform
+    /////////////////////////////////////////////////
+    // like std::transform with random access iterators, out[i] = func(first[i]) in parallel, see ParallelFor
+    template<typename InputIterator, typename OutputIterator, typename Function>
+    OutputIterator ParallelTransform(InputIterator first, InputIterator last, OutputIterator out, Function&& func,
+        iExecutor::ptr executor = nullptr, size_t grain = 1)
+    {
+        typedef typename std::iterator_traits<InputIterator>::difference_type DifferenceType;
+
+        const DifferenceType count = last - first;
+        if (count <= 0)
+            return out;
+
+        ParallelDetails::ForRange(static_cast<size_t>(count), grain, executor, [first, out, &func](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                out[static_cast<DifferenceType>(i)] = func(first[static_cast<DifferenceType>(i)]);
+        });
+        return out + count;
+    }
+
+    /////////////////////////////////////////////////
+    /// function ParallelReduce
+    /////////////////////////////////////////////////
+    /**
+    Reduce [first, last) with an associative op in parallel, see ParallelFor. Each chunk is reduced
+    on its own, then the chunks are combined in order after init, so op needn't be commutative.
+    If the calling task is cancelled, the skipped chunks are missing from the result.
+
+    @param first, last, random access iterators.
+    @param init, the value before the first element.
+    @param op, ValueType(const ValueType&, const ValueType&), the elements converted to ValueType.
+    @return ValueType.
+    */
+    template<typename Iterator, typename ValueType, typename Operation>
+    ValueType ParallelReduce(Iterator first, Iterator last, ValueType init, Operation&& op,
+        iExecutor::ptr executor = nullptr, size_t grain = 1)
+    {
+        typedef typename std::iterator_traits<Iterator>::difference_type DifferenceType;
+
+        const DifferenceType count = last - first;
+        if (count <= 0)
+            return init;
+
+        std::mutex mutex;
+        std::vector<std::pair<size_t, ValueType> > partials; // by the offset of the chunk
+
+        ParallelDetails::ForRange(static_cast<size_t>(count), grain, executor, [first, &op, &mutex, &partials](size_t begin, size_t end) {
+            ValueType partial = first[static_cast<DifferenceType>(begin)];
+            for (size_t i = begin + 1; i < end; i++)
+                partial = op(partial, first[static_cast<DifferenceType>(i)]);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            partials.push_back(std::make_pair(begin, std::move(partial)));
+        });
+
+        std::sort(partials.begin(), partials.end(), [](const std::pair<size_t, ValueType>& a, const std::pair<size_t, ValueType>& b) {
+            return a.first < b.first;
+        });
+
+        ValueType result = std::move(init);
+        for (auto& partial : partials)
+            result = op(result, partial.second);
+        return result;
+    }
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Executor.h"
+#include "UniqueFunction.h"
+
+namespace Async {
+
+    /////////////////////////////////////////////////
+    /// class PriorityExecutor
+    /////////////////////////////////////////////////
+    // a fixed-size thread pool with a ready queue per priority: a worker takes the oldest work
+    // of the highest priority. Against starvation, a work waiting longer than the aging interval
+    // runs first whatever its priority, but only one such work per interval, so a saturating
+    // low priority load keeps making progress without taking over the higher priorities.
+    class PriorityExecutor : public iExecutor
+    {
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Item
+        {
+            UniqueFunction<void()> Work;
+            Clock::time_point Queued;
+        };
+
+        static const size_t PriorityCount = 3; // TaskPriority_High, TaskPriority_Normal, TaskPriority_Low
+
+        // shared with worker threads, so the pool can still be
+        // released from inside one of its own workers
+        struct State
+        {
+            State(Clock::duration agingInterval)
+                : Stopped(false), Count(0), AgingInterval(agingInterval), LastAged(Clock::now())
+            {}
+
+            std::weak_ptr<iExecutor> Executor;
+
+            bool Stopped;
+            std::deque<Item> Ready[PriorityCount];
+            size_t Count; // in all the ready queues
+            const Clock::duration AgingInterval;
+            Clock::time_point LastAged; // when a work last ran first by aging
+            std::mutex Mutex;
+            std::condition_variable CV;
+        };
+
+    public:
+        virtual ~PriorityExecutor()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_state->Mutex);
+                m_state->Stopped = true;
+            }
+            m_state->CV.notify_all();
+
+            // the rest of queued works are still run before the workers exit
+            for (auto& thread : m_threads)
+            {
+                if (thread.get_id() == std::this_thread::get_id())
+                    thread.detach();
+                else if (thread.joinable())
+                    thread.join();
+            }
+        }
+
+        /**
+        New a fixed-size thread pool running the works by priority.
+
+        @param threadCount, 0 means std::thread::hardware_concurrency().
+        @param agingInterval, how long a work waits before it may run ahead of higher priorities.
+        @return iExecutor::ptr.
+        */
+        static iExecutor::ptr New(size_t threadCount = 0,
+            std::chrono::milliseconds agingInterval = std::chrono::milliseconds(100))
+        {
+            if (threadCount == 0)
+                threadCount = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+
+            auto executor = new PriorityExecutor(agingInterval);
+            auto executorPtr = iExecutor::ptr(executor);
+            executor->Start(threadCount, executorPtr);
+
+            return executorPtr;
+        }
+
+        // at the priority of the work posting it
+        virtual void Post(UniqueFunction<void()> work)
+        {
+            PostWithPriority(std::move(work), TaskPriority_Inherit);
+        }
+
+        virtual void PostWithPriority(UniqueFunction<void()> work, TaskPriority priority)
+        {
+            priority = ExecutorDetails::ResolvePriority(priority);
+            {
+                std::lock_guard<std::mutex> lock(m_state->Mutex);
+                m_state->Ready[priority].push_back(Item{ std::move(work), Clock::now() });
+                m_state->Count++;
+            }
+            m_state->CV.notify_one();
+        }
+
+    private:
+        // force to always init using New()
+        PriorityExecutor(std::chrono::milliseconds agingInterval)
+            : m_state(std::make_shared<State>(agingInterval))
+        {}
+
+        void Start(size_t threadCount, iExecutor::ptr self)
+        {
+            m_state->Executor = self;
+
+            m_threads.reserve(threadCount);
+            for (size_t i = 0; i < threadCount; i++)
+                m_threads.emplace_back(&PriorityExecutor::WorkerLoop, m_state);
+        }
+
+        // the priority of the work to run next, under the lock
+        static size_t Pick(State& state)
+        {
+            size_t highest = 0;
+            while (state.Ready[highest].empty())
+                highest++;
+
+            auto now = Clock::now();
+            if (now - state.LastAged < state.AgingInterval)
+                return highest;
+
+            // the longest waiting lower priority work, if it has waited long enough
+            size_t aged = highest;
+            for (size_t i = highest + 1; i < PriorityCount; i++)
+            {
+                if (!state.Ready[i].empty() && now - state.Ready[i].front().Queued >= state.AgingInterval &&
+                    (aged == highest || state.Ready[i].front().Queued < state.Ready[aged].front().Queued))
+                    aged = i;
+            }
+
+            if (aged != highest)
+                state.LastAged = now;
+            return aged;
+        }
+
+        static void WorkerLoop(std::shared_ptr<State> state)
+        {
+            *ExecutorDetails::CurrentExecutor() = &state->Executor;
+
+            while (true)
+            {
+                UniqueFunction<void()> work;
+                size_t priority;
+                {
+                    std::unique_lock<std::mutex> lock(state->Mutex);
+                    state->CV.wait(lock, [&state] { return state->Stopped || state->Count > 0; });
+
+                    if (state->Count == 0)
+                        break;
+
+                    priority = Pick(*state);
+                    work = std::move(state->Ready[priority].front().Work);
+                    state->Ready[priority].pop_front();
+                    state->Count--;
+                }
+
+                ExecutorDetails::PriorityScope scope(static_cast<TaskPriority>(priority));
+                work();
+            }
+
+            *ExecutorDetails::CurrentExecutor() = nullptr;
+        }
+
+    private:
+        std::shared_ptr<State> m_state;
+        std::vector<std::thread> m_threads;
+    };
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace Async {
+
+    typedef struct _ObservableQueuePopResult_
+    {
+        _ObservableQueuePopResult_(bool success = false, bool closed = false)
+            : m_success(success), m_closed(closed)
+        {}
+
+        bool IsSuccess() const
+        {
+            return m_success;
+        }
+
+        bool IsClosed() const
+        {
+            return m_closed;
+        }
+
+    private:
+        bool m_success; // indicate this pop returns one or some objects
+        bool m_closed; // indicate the queue has been closed
+
+    } ObservableQueuePopResult;
+
+    /////////////////////////////////////////////////
+    /// ObservableQueue policies
+    /////////////////////////////////////////////////
+    // std::deque guarded by a std::mutex, any number of producers and consumers
+    struct LockedQueuePolicy
+    {};
+
+    // one contiguous buffer guarded by a std::mutex, swapped out whole by PopSome
+    struct DoubleBufferPolicy
+    {};
+
+    // lock-free fixed-capacity ring, exactly one producer thread and one consumer thread
+    struct SpscPolicy
+    {};
+
+    // lock-free bounded ring, any number of producers and consumers
+    struct MpmcPolicy
+    {};
+
+    template<typename ObjectType, typename QueuePolicy = LockedQueuePolicy>
+    class ObservableQueue;
+
+    namespace QueueDetails {
+
+        template<typename Iterator>
+        std::move_iterator<Iterator> MoveIteratorIf(Iterator iter, std::true_type)
+        {
+            return std::make_move_iterator(iter);
+        }
+
+        template<typename Iterator>
+        Iterator MoveIteratorIf(Iterator iter, std::false_type)
+        {
+            return iter;
+        }
+
+        // hands a PopSome buffer back to its queue when the batch handler returns or throws
+        template<typename QueueType, typename ObjectType>
+        class BufferRecycler
+        {
+        public:
+            BufferRecycler(QueueType& queue, std::vector<ObjectType>& buffer)
+                : m_queue(queue), m_buffer(buffer)
+            {}
+
+            ~BufferRecycler()
+            {
+                m_queue.Recycle(std::move(m_buffer));
+            }
+
+            BufferRecycler(const BufferRecycler&) = delete;
+            BufferRecycler & operator=(const BufferRecycler&) = delete;
+
+        private:
+            QueueType& m_queue;
+            std::vector<ObjectType>& m_buffer;
+        };
+    }
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <deque>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+namespace Async {
+
+    // the storages of LockedObservableQueue, always called under the queue's lock
+
+    /////////////////////////////////////////////////
+    /// class DequeStorage
+    /////////////////////////////////////////////////
+    template<typename ObjectType>
+    class DequeStorage
+    {
+    public:
+        size_t Size() const
+        {
+            return m_queue.size();
+        }
+
+        bool IsEmpty() const
+        {
+            return m_queue.empty();
+        }
+
+        template<typename... Args>
+        void Emplace(Args&&... args)
+        {
+            m_queue.emplace_back(std::forward<Args>(args)...);
+        }
+
+        template<typename ConsumeFunction>
+        void ConsumeFront(ConsumeFunction&& consume)
+        {
+            consume(std::move(m_queue.front()));
+            m_queue.pop_front();
+        }
+
+        void MoveAllTo(std::vector<ObjectType>& vector)
+        {
+            if (vector.empty() && vector.capacity() == 0)
+                vector.swap(m_spare);
+
+            vector.insert(vector.end(),
+                std::make_move_iterator(m_queue.begin()), std::make_move_iterator(m_queue.end()));
+            m_queue.clear();
+        }
+
+        // a partial batch is moved out, the rest stays for the next pop
+        void MoveSomeTo(std::vector<ObjectType>& vector, size_t maxCount)
+        {
+            if (m_queue.size() <= maxCount)
+                return MoveAllTo(vector);
+
+            if (vector.empty() && vector.capacity() == 0)
+                vector.swap(m_spare);
+
+            vector.insert(vector.end(),
+                std::make_move_iterator(m_queue.begin()), std::make_move_iterator(m_queue.begin() + maxCount));
+            m_queue.erase(m_queue.begin(), m_queue.begin() + maxCount);
+        }
+
+        // keep the drained buffer with the biggest capacity for the next MoveAllTo
+        void Recycle(std::vector<ObjectType>&& buffer)
+        {
+            buffer.clear();
+            if (buffer.capacity() > m_spare.capacity())
+                m_spare.swap(buffer);
+        }
+
+    private:
+        std::deque<ObjectType> m_queue;
+        std::vector<ObjectType> m_spare;
+    };
+
+    /////////////////////////////////////////////////
+    /// class DoubleBufferStorage
+    /////////////////////////////////////////////////
+    // producers append to one contiguous buffer, a batch consumer swaps it out in O(1),
+    // and the drained buffer comes back through Recycle() to be appended next
+    template<typename ObjectType>
+    class DoubleBufferStorage
+    {
+    public:
+        DoubleBufferStorage()
+            : m_readIndex(0)
+        {}
+
+        size_t Size() const
+        {
+            return m_buffer.size() - m_readIndex;
+        }
+
+        bool IsEmpty() const
+        {
+            return Size() == 0;
+        }
+
+        template<typename... Args>
+        void Emplace(Args&&... args)
+        {
+            m_buffer.emplace_back(std::forward<Args>(args)...);
+        }
+
+        template<typename ConsumeFunction>
+        void ConsumeFront(ConsumeFunction&& consume)
+        {
+            consume(std::move(m_buffer[m_readIndex++]));
+            Compact();
+        }
+
+        void MoveAllTo(std::vector<ObjectType>& vector)
+        {
+            if (vector.empty() && m_readIndex == 0)
+            {
+                // the whole buffer is handed over, the spare one takes its place
+                vector.swap(m_buffer);
+                m_buffer.swap(m_spare);
+                m_buffer.clear();
+                return;
+            }
+
+            vector.insert(vector.end(),
+                std::make_move_iterator(m_buffer.begin() + m_readIndex), std::make_move_iterator(m_buffer.end()));
+            m_buffer.clear();
+            m_readIndex = 0;
+        }
+
+        // a partial batch is moved out, the rest stays for the next pop
+        void MoveSomeTo(std::vector<ObjectType>& vector, size_t maxCount)
+        {
+            if (Size() <= maxCount)
+                return MoveAllTo(vector);
+
+            if (vector.empty() && vector.capacity() == 0)
+                vector.swap(m_spare);
+
+            vector.insert(vector.end(),
+                std::make_move_iterator(m_buffer.begin() + m_readIndex),
+                std::make_move_iterator(m_buffer.begin() + m_readIndex + maxCount));
+            m_readIndex += maxCount;
+            Compact();
+        }
+
+        // keep the drained buffer with the biggest capacity for the next swap
+        void Recycle(std::vector<ObjectType>&& buffer)
+        {
+            buffer.clear();
+            if (buffer.capacity() > m_spare.capacity())
+                m_spare.swap(buffer);
+        }
+
+        // of the buffer appended to, it stays bounded by the peak size as long as the queue is consumed
+        size_t Capacity() const
+        {
+            return m_buffer.capacity();
+        }
+
+    private:
+        // drop the consumed objects once they are as many as the rest, so a queue which is
+        // never drained doesn't grow forever, and each object is moved at most once more on average
+        void Compact()
+        {
+            if (m_readIndex == 0 || m_readIndex < Size())
+                return;
+
+            m_buffer.erase(m_buffer.begin(), m_buffer.begin() + m_readIndex);
+            m_readIndex = 0;
+        }
+
+    private:
+        std::vector<ObjectType> m_buffer;
+        std::vector<ObjectType> m_spare;
+        size_t m_readIndex; // objects before it are consumed by PopOne
+    };
+}
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace Async {
+
+    namespace RingBufferDetails {
+
+        static const size_t CacheLineSize = 64;
+
+        inline size_t RoundUpToPowerOf2(size_t value)
+        {
+            size_t power = 1;
+            while (power < value)
+                power <<= 1;
+            return power;
+        }
+    }
+
+    /////////////////////////////////////////////////
+    /// class SpscRingBuffer
+    /////////////////////////////////////////////////
+    // fixed-capacity ring for exactly one producer thread and one consumer thread.
+    // The indices are on their own cache lines, and each side caches the other side's index,
+    // so the shared lines are only touched when the cached one says full or empty.
+    template<typename ObjectType>
+    class SpscRingBuffer
+    {
+    private:
+        typedef typename std::aligned_storage<sizeof(ObjectType), std::alignment_of<ObjectType>::value>::type Slot;
+
+    public:
+        SpscRingBuffer(size_t capacity)
+            : m_capacity(RingBufferDetails::RoundUpToPowerOf2(capacity < 1 ? 1 : capacity)),
+              m_mask(m_capacity - 1),
+              m_slots(new Slot[m_capacity]),
+              m_head(0), m_cachedTail(0),
+              m_tail(0), m_cachedHead(0)
+        {}
+
+        ~SpscRingBuffer()
+        {
+            const size_t tail = m_tail.load(std::memory_order_relaxed);
+            for (size_t head = m_head.load(std::memory_order_relaxed); head != tail; head++)
+                At(head)->~ObjectType();
+            delete[] m_slots;
+        }
+
+        SpscRingBuffer(const SpscRingBuffer&) = delete;
+        SpscRingBuffer & operator=(const SpscRingBuffer&) = delete;
+
+        // producer only, return false if full
+        template<typename... Args>
+        bool TryEmplace(Args&&... args)
+        {
+            const size_t tail = m_tail.load(std::memory_order_relaxed);
+            if (tail - m_cachedHead >= m_capacity)
+            {
+                m_cachedHead = m_head.load(std::memory_order_acquire);
+                if (tail - m_cachedHead >= m_capacity)
+                    return false;
+            }
+
+            new (At(tail)) ObjectType(std::forward<Args>(args)...);
+            m_tail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        // consumer only, the object is moved to consume(ObjectType&&), return false if empty
+        template<typename ConsumeFunction>
+        bool TryConsume(ConsumeFunction&& consume)
+        {
+            const size_t head = m_head.load(std::memory_order_relaxed);
+            if (head == m_cachedTail)
+            {
+                m_cachedTail = m_tail.load(std::memory_order_acquire);
+                if (head == m_cachedTail)
+                    return false;
+            }
+
+            // the object is gone even if consume throws, so it isn't consumed twice
+            ObjectType *object = At(head);
+            try
+            {
+                consume(std::move(*object));
+            }
+            catch (...)
+            {
+                object->~ObjectType();
+                m_head.store(head + 1, std::memory_order_release);
+                throw;
+            }
+            object->~ObjectType();
+            m_head.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool IsEmpty() const
+        {
+            return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+        }
+
+        bool IsFull() const
+        {
+            return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire) >= m_capacity;
+        }
+
+        size_t Capacity() const
+        {
+            return m_capacity;
+        }
+
+    private:
+        ObjectType * At(size_t index)
+        {
+            return reinterpret_cast<ObjectType *>(&m_slots[index & m_mask]);
+        }
+
+    private:
+        const size_t m_capacity; // always power of 2
+        const size_t m_mask;
+        Slot *m_slots;
+
+        char m_padding0[RingBufferDetails::CacheLineSize];
+
+        // consumer side
+        std::atomic<size_t> m_head;
+        size_t m_cachedTail;
+
+        char m_padding1[RingBufferDetails::CacheLineSize];
+
+        // producer side
+        std::atomic<size_t> m_tail;
+        size_t m_cachedHead;
+
+        char m_padding2[RingBufferDetails::CacheLineSize];
+    };
+
+    /////////////////////////////////////////////////
+    /// class MpmcRingBuffer
+    /////////////////////////////////////////////////
+    // bounded ring for any number of producers and consumers (Dmitry Vyukov's design).
+    // Every cell has a sequence number telling whether it is ready to be written or read
+    // at the current lap, so producers and consumers only contend on their own index.
+    // A cell claimed by a producer whose constructor throws is still published, as a hole the
+    // consumers skip, and a consume throwing still frees its cell, so the ring never wedges.
+    template<typename ObjectType>
+    class MpmcRingBuffer
+    {
+    private:
+        typedef typename std::aligned_storage<sizeof(ObjectType), std::alignment_of<ObjectType>::value>::type Slot;
+
+        struct Cell
+        {
+            std::atomic<size_t> Sequence;
+            bool Hole; // published without an object, written before Sequence
+            Slot Storage;
+        };
+
+    public:
+        MpmcRingBuffer(size_t capacity)
+            : m_capacity(RingBufferDetails::RoundUpToPowerOf2(capacity < 2 ? 2 : capacity)),
+              m_mask(m_capacity - 1),
+              m_cells(new Cell[m_capacity]),
+              m_enqueuePos(0),
+              m_dequeuePos(0)
+        {
+            for (size_t i = 0; i < m_capacity; i++)
+            {
+                m_cells[i].Sequence.store(i, std::memory_order_relaxed);
+                m_cells[i].Hole = false;
+            }
+        }
+
+        ~MpmcRingBuffer()
+        {
+            const size_t enqueuePos = m_enqueuePos.load(std::memory_order_relaxed);
+            for (size_t pos = m_dequeuePos.load(std::memory_order_relaxed); pos != enqueuePos; pos++)
+            {
+                if (!m_cells[pos & m_mask].Hole)
+                    At(m_cells[pos & m_mask])->~ObjectType();
+            }
+            delete[] m_cells;
+        }
+
+        MpmcRingBuffer(const MpmcRingBuffer&) = delete;
+        MpmcRingBuffer & operator=(const MpmcRingBuffer&) = delete;
+
+        // return false if full
+        template<typename... Args>
+        bool TryEmplace(Args&&... args)
+        {
+            Cell *cell = nullptr;
+            size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+            while (true)
+            {
+                cell = &m_cells[pos & m_mask];
+                const size_t sequence = cell->Sequence.load(std::memory_order_acquire);
+                const ptrdiff_t diff = ptrdiff_t(sequence) - ptrdiff_t(pos);
+
+                if (diff == 0)
+                {
+                    if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else if (diff < 0) // the cell is not consumed yet since the last lap
+                    return false;
+                else
+                    pos = m_enqueuePos.load(std::memory_order_relaxed);
+            }
+
+            try
+            {
+                new (At(*cell)) ObjectType(std::forward<Args>(args)...);
+            }
+            catch (...)
+            {
+                cell->Hole = true;
+                cell->Sequence.store(pos + 1, std::memory_order_release);
+                throw;
+            }
+            cell->Sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        // the object is moved to consume(ObjectType&&), return false if empty
+        template<typename ConsumeFunction>
+        bool TryConsume(ConsumeFunction&& consume)
+        {
+            Cell *cell = nullptr;
+            size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+            while (true)
+            {
+                cell = &m_cells[pos & m_mask];
+                const size_t sequence = cell->Sequence.load(std::memory_order_acquire);
+                const ptrdiff_t diff = ptrdiff_t(sequence) - ptrdiff_t(pos + 1);
+
+                if (diff == 0)
+                {
+                    if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        if (!cell->Hole)
+                            break;
+
+                        // skip the hole left by a throwing producer
+                        cell->Hole = false;
+                        cell->Sequence.store(pos + m_capacity, std::memory_order_release);
+                        pos++;
+                    }
+                }
+                else if (diff < 0) // the cell is not produced yet at this lap
+                    return false;
+                else
+                    pos = m_dequeuePos.load(std::memory_order_relaxed);
+            }
+
+            // the cell is freed even if consume throws, the object is gone then
+            ObjectType *object = At(*cell);
+            try
+            {
+                consume(std::move(*object));
+            }
+            catch (...)
+            {
+                object->~ObjectType();
+                cell->Sequence.store(pos + m_capacity, std::memory_order_release);
+                throw;
+            }
+            object->~ObjectType();
+            cell->Sequence.store(pos + m_capacity, std::memory_order_release);
+            return true;
+        }
+
+        // the head cell is ready to be consumed
+        bool IsEmpty() const
+        {
+            const size_t pos = m_dequeuePos.load(std::memory_order_acquire);
+            return m_cells[pos & m_mask].Sequence.load(std::memory_order_acquire) != pos + 1;
+        }
+
+        // the tail cell is not ready to be produced
+        bool IsFull() const
+        {
+            const size_t pos = m_enqueuePos.load(std::memory_order_acquire);
+            return m_cells[pos & m_mask].Sequence.load(std::memory_order_acquire) != pos;
+        }
+
+        size_t Capacity() const
+        {
+            return m_capacity;
+        }
+
+    private:
+        static ObjectType * At(Cell& cell)
+        {
+            return reinterpret_cast<ObjectType *>(&cell.Storage);
+        }
+
+    private:
+        const size_t m_capacity; // always power of 2
+        const size_t m_mask;
+        Cell *m_cells;
+
+        char m_padding0[RingBufferDetails::CacheLineSize];
+
+        std::atomic<size_t> m_enqueuePos;
+
+        char m_padding1[RingBufferDetails::CacheLineSize];
+
+        std::atomic<size_t> m_dequeuePos;
+
+        char m_padding2[RingBufferDetails::CacheLineSize];
+    };
+}
@@ -0,0 +1,374 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "Cancel.h"
+#include "QueuePolicy.h"
+#include "RingBuffer.h"
+#include "UniqueFunction.h"
+#include "WaitDetails.h"
+
+namespace Async {
+
+    /////////////////////////////////////////////////
+    /// class RingObservableQueue
+    /////////////////////////////////////////////////
+    // the ObservableQueue on a lock-free ring, a lock is only taken
+    // to park when the ring is empty or full
+    template<typename ObjectType, typename RingType>
+    class RingObservableQueue
+    {
+    public:
+        ~RingObservableQueue()
+        {
+            if (m_onCompleted)
+                m_onCompleted();
+        }
+
+        void Close()
+        {
+            m_closed.store(true);
+
+            m_notEmpty.Notify();
+            m_notFull.Notify();
+        }
+
+        void PushOne(const ObjectType& object)
+        {
+            Emplace(object);
+        }
+
+        void PushOne(ObjectType&& object)
+        {
+            Emplace(std::move(object));
+        }
+
+        // construct the object in the ring
+        template<typename... Args>
+        void Emplace(Args&&... args)
+        {
+            CancelCallbackGuard cancelWakeup;
+
+            if (!WaitNotFull(cancelWakeup))
+                return;
+
+            // a failed TryEmplace leaves the arguments untouched, so they can be forwarded again
+            while (!m_ring.TryEmplace(std::forward<Args>(args)...))
+            {
+                if (!WaitNotFull(cancelWakeup))
+                    return;
+            }
+            m_notEmpty.Notify();
+        }
+
+        // the objects of a temporary container are moved, otherwise copied
+        template<typename ObjectTypeContainer>
+        void PushSome(ObjectTypeContainer&& objects)
+        {
+            typedef std::integral_constant<bool, !std::is_lvalue_reference<ObjectTypeContainer>::value> IsTemporary;
+
+            PushSome(QueueDetails::MoveIteratorIf(objects.begin(), IsTemporary()),
+                     QueueDetails::MoveIteratorIf(objects.end(), IsTemporary()));
+        }
+
+        // if the ring is full, the objects are pushed piece by piece as the capacity frees up.
+        // Pass std::move_iterator to move the objects into the queue.
+        template<typename Iterator>
+        void PushSome(Iterator first, Iterator last)
+        {
+            CancelCallbackGuard cancelWakeup;
+
+            if (!WaitNotFull(cancelWakeup))
+                return;
+
+            for (; first != last; ++first)
+            {
+                while (!m_ring.TryEmplace(*first))
+                {
+                    m_notEmpty.Notify(); // let consumers take the pushed ones
+                    if (!WaitNotFull(cancelWakeup))
+                        return;
+                }
+            }
+            m_notEmpty.Notify();
+        }
+
+        // wait until there is an object, or the queue is closed, or the task is cancelled
+        ObservableQueuePopResult PopOne(ObjectType& obj)
+        {
+            return ConsumeOne([&obj](ObjectType&& object) {
+                obj = std::move(object);
+            });
+        }
+
+        // like PopOne, but the object is moved to consume(ObjectType&&),
+        // so ObjectType needn't be default-constructible or assignable
+        template<typename ConsumeFunction>
+        ObservableQueuePopResult ConsumeOne(ConsumeFunction&& consume)
+        {
+            CancelCallbackGuard cancelWakeup;
+
+            try
+            {
+                while (!m_ring.TryConsume(consume))
+                {
+                    if (!WaitNotEmpty(cancelWakeup))
+                        return ObservableQueuePopResult(false, m_closed.load());
+                }
+            }
+            catch (...)
+            {
+                // the ring freed the cell of the object consume has thrown on
+                m_notFull.Notify();
+                throw;
+            }
+            m_notFull.Notify();
+
+            return ObservableQueuePopResult(true, false);
+        }
+
+        // wait until there are objects, or the queue is closed, or the task is cancelled.
+        // An empty vector without capacity takes a recycled buffer first.
+        ObservableQueuePopResult PopSome(std::vector<ObjectType>& vector)
+        {
+            CancelCallbackGuard cancelWakeup;
+
+            if (vector.empty() && vector.capacity() == 0)
+            {
+                std::lock_guard<std::mutex> lock(m_spareMutex);
+                vector.swap(m_spare);
+            }
+
+            auto consume = [&vector](ObjectType&& object) {
+                vector.push_back(std::move(object));
+            };
+            while (!m_ring.TryConsume(consume))
+            {
+                if (!WaitNotEmpty(cancelWakeup))
+                    return ObservableQueuePopResult(false, m_closed.load());
+            }
+            while (m_ring.TryConsume(consume))
+                ;
+            m_notFull.Notify();
+
+            return ObservableQueuePopResult(true, false);
+        }
+
+        /**
+        Size- and time-bounded PopSome. Once there is an object, wait until maxBatch objects are queued
+        or maxLinger has passed, then pop at most maxBatch objects.
+
+        @param vector, the popped objects are appended.
+        @param maxBatch, the most objects popped at once.
+        @param maxLinger, the longest wait for a full batch after the first object is seen.
+        @return ObservableQueuePopResult.
+        */
+        template<typename Rep, typename Period>
+        ObservableQueuePopResult PopSome(std::vector<ObjectType>& vector,
+                                         size_t maxBatch,
+                                         const std::chrono::duration<Rep, Period>& maxLinger)
+        {
+            // a batch bigger than the ring never fills up
+            maxBatch = std::max<size_t>(std::min(maxBatch, m_ring.Capacity()), 1);
+
+            CancelCallbackGuard cancelWakeup;
+
+            if (vector.empty() && vector.capacity() == 0)
+            {
+                std::lock_guard<std::mutex> lock(m_spareMutex);
+                vector.swap(m_spare);
+            }
+
+            size_t count = 0;
+            auto consume = [&vector, &count](ObjectType&& object) {
+                vector.push_back(std::move(object));
+                count++;
+            };
+            while (!m_ring.TryConsume(consume))
+            {
+                if (!WaitNotEmpty(cancelWakeup))
+                    return ObservableQueuePopResult(false, m_closed.load());
+            }
+
+            const bool isLingering = maxLinger > std::chrono::duration<Rep, Period>::zero();
+            const auto deadline = isLingering
+                ? std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(maxLinger)
+                : std::chrono::steady_clock::time_point();
+
+            // the objects are taken as they come, so producers are not blocked by the lingering
+            while (count < maxBatch)
+            {
+                if (m_ring.TryConsume(consume))
+                    continue;
+
+                if (!isLingering || m_closed.load() || Async::Cancel::IsCancelled())
+                    break;
+
+                m_notFull.Notify();
+                cancelWakeup.Register([this] {
+                    m_notEmpty.Notify();
+                });
+                if (!m_notEmpty.WaitUntil([this] {
+                        return !m_ring.IsEmpty() || m_closed.load() || Async::Cancel::IsCancelled();
+                    }, deadline))
+                    break;
+            }
+            m_notFull.Notify();
+
+            return ObservableQueuePopResult(true, false);
+        }
+
+        // producers wait once the ring is full
+        size_t Limitation() const
+        {
+            return m_ring.Capacity();
+        }
+
+        // hand a drained PopSome buffer back, so its capacity is reused by the next PopSome
+        void Recycle(std::vector<ObjectType>&& buffer)
+        {
+            buffer.clear();
+
+            std::lock_guard<std::mutex> lock(m_spareMutex);
+            if (buffer.capacity() > m_spare.capacity())
+                m_spare.swap(buffer);
+        }
+
+    protected:
+        RingObservableQueue(UniqueFunction<void()> onCompleted,
+                            size_t capacity,
+                            size_t maxSpins)
+        : m_ring(capacity),
+          m_closed(false),
+          m_onCompleted(std::move(onCompleted)),
+          m_spin(maxSpins)
+        {}
+
+    private:
+        // return false if the queue is empty and closed, or the task is cancelled
+        bool WaitNotEmpty(CancelCallbackGuard& cancelWakeup)
+        {
+            if (!m_spin.Spin([this] { return !m_ring.IsEmpty() || m_closed.load(); }))
+            {
+                cancelWakeup.Register([this] {
+                    m_notEmpty.Notify();
+                });
+                m_notEmpty.Wait([this] {
+                    return !m_ring.IsEmpty() || m_closed.load() || Async::Cancel::IsCancelled();
+                });
+            }
+            return !m_ring.IsEmpty();
+        }
+
+        // return false if the queue is closed or the task is cancelled
+        bool WaitNotFull(CancelCallbackGuard& cancelWakeup)
+        {
+            if (m_closed.load()) // if closed, do nothing
+                return false;
+
+            if (Async::Cancel::IsCancelled())
+                return false;
+
+            if (!m_ring.IsFull())
+                return true;
+
+            cancelWakeup.Register([this] {
+                m_notFull.Notify();
+            });
+            m_notFull.Wait([this] {
+                return !m_ring.IsFull() || m_closed.load() || Async::Cancel::IsCancelled();
+            });
+            return !m_closed.load() && !Async::Cancel::IsCancelled();
+        }
+
+    private:
+        RingType m_ring;
+        std::atomic<bool> m_closed;
+        UniqueFunction<void()> m_onCompleted;
+
+        AdaptiveSpin m_spin;
+        ParkingLot m_notEmpty; // consumers park here
+        ParkingLot m_notFull; // producers park here
+
+        std::mutex m_spareMutex; // taken once per batch, never per object
+        std::vector<ObjectType> m_spare;
+    };
+
+    /////////////////////////////////////////////////
+    /// class ObservableQueue<ObjectType, SpscPolicy>
+    /////////////////////////////////////////////////
+    template<typename ObjectType>
+    class ObservableQueue<ObjectType, SpscPolicy>
+        : public RingObservableQueue<ObjectType, SpscRingBuffer<ObjectType> >
+    {
+    public:
+        /**
+        New a single-producer/single-consumer ObservableQueue.
+
+        @param onCompleted, called when the queue is released.
+        @param capacity, rounded up to power of 2, the producer waits when the queue is full.
+        @param maxSpins, the consumer spins adaptively up to maxSpins times on an empty queue
+        before parking. 0 means park immediately.
+        @return std::shared_ptr<ObservableQueue>.
+        */
+        static std::shared_ptr<ObservableQueue>
+        New(UniqueFunction<void()> onCompleted = nullptr,
+            size_t capacity = 1024,
+            size_t maxSpins = 0)
+        {
+            return std::shared_ptr<ObservableQueue>
+                (new ObservableQueue(std::move(onCompleted), capacity, maxSpins));
+        }
+
+    private:
+        // force to always init using New()
+        ObservableQueue(UniqueFunction<void()> onCompleted,
+                        size_t capacity,
+                        size_t maxSpins)
+        : RingObservableQueue<ObjectType, SpscRingBuffer<ObjectType> >(std::move(onCompleted), capacity, maxSpins)
+        {}
+    };
+
+    /////////////////////////////////////////////////
+    /// class ObservableQueue<ObjectType, MpmcPolicy>
+    /////////////////////////////////////////////////
+    template<typename ObjectType>
+    class ObservableQueue<ObjectType, MpmcPolicy>
+        : public RingObservableQueue<ObjectType, MpmcRingBuffer<ObjectType> >
+    {
+    public:
+        /**
+        New a multi-producer/multi-consumer ObservableQueue.
+
+        @param onCompleted, called when the queue is released.
+        @param capacity, rounded up to power of 2, producers wait when the queue is full.
+        @param maxSpins, consumers spin adaptively up to maxSpins times on an empty queue
+        before parking. 0 means park immediately.
+        @return std::shared_ptr<ObservableQueue>.
+        */
+        static std::shared_ptr<ObservableQueue>
+        New(UniqueFunction<void()> onCompleted = nullptr,
+            size_t capacity = 1024,
+            size_t maxSpins = 0)
+        {
+            return std::shared_ptr<ObservableQueue>
+                (new ObservableQueue(std::move(onCompleted), capacity, maxSpins));
+        }
+
+    private:
+        // force to always init using New()
+        ObservableQueue(UniqueFunction<void()> onCompleted,
+                        size_t capacity,
+                        size_t maxSpins)
+        : RingObservableQueue<ObjectType, MpmcRingBuffer<ObjectType> >(std::move(onCompleted), capacity, maxSpins)
+        {}
+    };
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace Async {
+
+    /////////////////////////////////////////////////
+    /// class StageValue
+    /////////////////////////////////////////////////
+    // the type-erased return of a chain stage, handed to the next stage.
+    // Small objects are kept inline, bigger ones on the heap.
+    class StageValue
+    {
+    private:
+        static const size_t InlineSize = 4 * sizeof(void *);
+
+    public:
+        StageValue()
+            : m_object(nullptr), m_destroy(nullptr)
+        {}
+
+        ~StageValue()
+        {
+            Reset();
+        }
+
+        StageValue(const StageValue&) = delete;
+        StageValue & operator=(const StageValue&) = delete;
+
+        template<typename ObjectType, typename... Args>
+        void Emplace(Args&&... args)
+        {
+            Reset();
+            EmplaceDetails<ObjectType>(IsInline<ObjectType>(), std::forward<Args>(args)...);
+        }
+
+        // store what function() returns, nothing if it returns void
+        template<typename ObjectType, typename Function>
+        void Store(Function&& function)
+        {
+            Reset();
+            StoreDetails<ObjectType>(std::forward<Function>(function), std::is_void<ObjectType>());
+        }
+
+        template<typename ObjectType>
+        ObjectType & Get()
+        {
+            return *static_cast<ObjectType *>(m_object);
+        }
+
+        void Reset()
+        {
+            if (m_destroy)
+                m_destroy(m_object);
+            m_object = nullptr;
+            m_destroy = nullptr;
+        }
+
+    private:
+        template<typename ObjectType>
+        struct IsInline : std::integral_constant<bool,
+            sizeof(ObjectType) <= InlineSize &&
+            std::alignment_of<ObjectType>::value <= std::alignment_of<std::aligned_storage<InlineSize>::type>::value>
+        {};
+
+        template<typename ObjectType, typename... Args>
+        void EmplaceDetails(std::true_type, Args&&... args)
+        {
+            m_object = new (&m_buffer) ObjectType(std::forward<Args>(args)...);
+            m_destroy = &DestroyInline<ObjectType>;
+        }
+
+        template<typename ObjectType, typename... Args>
+        void EmplaceDetails(std::false_type, Args&&... args)
+        {
+            m_object = new ObjectType(std::forward<Args>(args)...);
+            m_destroy = &DestroyHeap<ObjectType>;
+        }
+
+        template<typename ObjectType, typename Function>
+        void StoreDetails(Function&& function, std::true_type)
+        {
+            function();
+        }
+
+        template<typename ObjectType, typename Function>
+        void StoreDetails(Function&& function, std::false_type)
+        {
+            EmplaceDetails<ObjectType>(IsInline<ObjectType>(), function());
+        }
+
+        template<typename ObjectType>
+        static void DestroyInline(void *object)
+        {
+            static_cast<ObjectType *>(object)->~ObjectType();
+        }
+
+        template<typename ObjectType>
+        static void DestroyHeap(void *object)
+        {
+            delete static_cast<ObjectType *>(object);
+        }
+
+    private:
+        std::aligned_storage<InlineSize>::type m_buffer;
+        void *m_object;
+        void (*m_destroy)(void *);
+    };
+}
@@ -1,7 +1,8 @@
 #pragma once
 
-#include <thread>
-
+#include "Executor.h"
+#include "FusedChain.h"
+#include "NotifyDispatcher.h"
 #include "TaskDetails.h"
 #include "TaskHandle.h"
 
@@ -30,77 +31,165 @@ namespace Async {
         template<typename NextTaskFunction>
         Task<FUNCTION_RETURN_TYPE(NextTaskFunction)> Then(NextTaskFunction&& func)
         {
-            auto newDetails = m_details->Then(func);
+            auto newDetails = m_details->Then(std::forward<NextTaskFunction>(func));
             return Task<FUNCTION_RETURN_TYPE(NextTaskFunction)>(newDetails);
         }
 
         template<typename NextTaskFunction, typename U = ReturnType>
         Task<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(NextTaskFunction, U)> Get(NextTaskFunction&& func)
         {
-            auto newDetails = m_details->Get(func);
+            auto newDetails = m_details->Get(std::forward<NextTaskFunction>(func));
             return Task<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(NextTaskFunction, U)>(newDetails);
         }
 
         template<typename NotifyData>
         Task & Notified(NOTIFY_FUNCTION(NotifyData) && notifyFunction)
         {
-            m_details->template Notified<NotifyData>(notifyFunction);
+            m_details->template Notified<NotifyData>(std::move(notifyFunction));
+            return *this;
+        }
+
+        /**
+        Like Notified, but the handler runs on the executor, so a slow handler doesn't stall the task.
+        Notify only queues the data, the handler is called one notification at a time, in order.
+
+        @param executor, where the handler runs.
+        @param notifyFunction, the handler.
+        @param policy, NotifyPolicy::All() delivers every notification, NotifyPolicy::Latest() only
+        the latest one not delivered yet, and NotifyPolicy::AtMostPerSecond(n) the latest one at most
+        n times per second, the next delivery waiting on the timer thread instead of the executor.
+        */
+        template<typename NotifyData>
+        Task & NotifiedOn(iExecutor::ptr executor,
+                        NOTIFY_FUNCTION(NotifyData) && notifyFunction,
+                        NotifyPolicy policy = NotifyPolicy::All())
+        {
+            m_details->template Notified<NotifyData>(
+                NotifyDetails::Dispatcher<NotifyData>(executor, std::move(notifyFunction), policy));
             return *this;
         }
 
         Task & OnException(EXCEPTION_HANDLE_FUNCTION exceptionHandle)
         {
-            m_details->OnException(exceptionHandle);
+            m_details->OnException(std::move(exceptionHandle));
             return *this;
         }
 
-        Task & OnBegin(std::function<void()> beginHandle)
+        // cancelled together with the token, e.g. a whole request tree by one CancellationSource
+        Task & CancelledBy(const CancellationToken& token)
         {
-            m_details->OnBegin(beginHandle);
+            m_details->CancelledBy(token);
             return *this;
         }
 
-        Task & OnEnd(std::function<void()> endHandle)
+        // cancel each run once the timeout has passed since Run(), by the shared timer thread
+        template<typename Rep, typename Period>
+        Task & WithTimeout(const std::chrono::duration<Rep, Period>& timeout)
         {
-            m_details->OnEnd(endHandle);
+            m_details->WithTimeout(std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout));
             return *this;
         }
 
-        iTaskHandle::ptr Run(RunMode mode = RunMode::RunMode_Async)
+        Task & OnBegin(UniqueFunction<void()> beginHandle)
+        {
+            m_details->OnBegin(std::move(beginHandle));
+            return *this;
+        }
+
+        Task & OnEnd(UniqueFunction<void()> endHandle)
+        {
+            m_details->OnEnd(std::move(endHandle));
+            return *this;
+        }
+
+        // RunMode_Sync runs the task inline on the calling thread,
+        // RunMode_Async runs it on the current executor if called from inside of a running task,
+        // otherwise on the default executor
+        typename TaskResult<ReturnType>::ptr Run(RunMode mode = RunMode::RunMode_Async)
         {
-            std::shared_ptr<TaskDetails<ReturnType> > taskDetails = m_details;
-            auto runFunction = [taskDetails]() {
-                taskDetails->BeforeRun();
-                try
-                {
-                    taskDetails->Run();
-                }
-                catch (...)
-                {
-                }
-                taskDetails->AfterRun();
-            };
-
-            auto thread = std::make_shared<std::thread>(runFunction);
             if (mode == RunMode::RunMode_Sync)
-                thread->join();
+            {
+                std::shared_ptr<TaskDetails<ReturnType> > taskDetails = m_details;
+                auto result = TaskResult<ReturnType>::New([taskDetails]() {
+                    taskDetails->Cancel();
+                });
+
+                taskDetails->Begin();
+                RunDetails(taskDetails, *result);
+
+                return result;
+            }
+
+            auto executor = GetCurrentExecutor();
+            if (!executor)
+                executor = GetDefaultExecutor();
+
+            return Run(executor);
+        }
+
+        // like Run(RunMode_Async), at the priority
+        typename TaskResult<ReturnType>::ptr Run(TaskPriority priority)
+        {
+            auto executor = GetCurrentExecutor();
+            if (!executor)
+                executor = GetDefaultExecutor();
 
-            auto cancelFunc = [taskDetails]() {
+            return Run(executor, priority);
+        }
+
+        // at the priority of the running task if called from inside of one, otherwise TaskPriority_Normal
+        typename TaskResult<ReturnType>::ptr Run(iExecutor::ptr executor)
+        {
+            return Run(executor, TaskPriority_Inherit);
+        }
+
+        /**
+        Run the task on the executor.
+
+        @param executor, a PriorityExecutor runs the higher priorities first, other executors
+        run the tasks in their order.
+        @param priority, also the priority of the tasks it runs with TaskPriority_Inherit.
+        @return TaskResult<ReturnType>::ptr, also an iTaskHandle. GetResult() waits for the return
+        of the last stage, or rethrows the exception of the chain.
+        */
+        typename TaskResult<ReturnType>::ptr Run(iExecutor::ptr executor, TaskPriority priority)
+        {
+            std::shared_ptr<TaskDetails<ReturnType> > taskDetails = m_details;
+            auto result = TaskResult<ReturnType>::New([taskDetails]() {
                 taskDetails->Cancel();
-            };
-            auto joinFunc = [thread]() {
-                if (thread && thread->joinable())
-                    thread->join();
-            };
-            auto detachFunc = [thread]() {
-                if (thread && thread->joinable())
-                    thread->detach();
-            };
-
-            auto handle = TaskHandle::New(cancelFunc, joinFunc, detachFunc);
-            taskDetails->Handle = handle; // hold the handle in details, until the thread end
-
-            return handle;
+            });
+
+            taskDetails->Handle = result; // hold the handle in details, until the task end
+            taskDetails->Begin(); // so a Cancel() before the task starts isn't lost
+
+            // run by the executor, or by Wait() on one of its workers if that comes first
+            TaskResult<ReturnType> *pendingResult = result.get();
+            result->SetPending(executor.get(), [taskDetails, pendingResult]() {
+                RunDetails(taskDetails, *pendingResult);
+            });
+
+            executor->PostWithPriority([result]() {
+                result->RunPending();
+            }, priority);
+
+            return result;
+        }
+
+    private:
+        static void RunDetails(const std::shared_ptr<TaskDetails<ReturnType> >& taskDetails, TaskResult<ReturnType>& result)
+        {
+            taskDetails->BeforeRun();
+            try
+            {
+                taskDetails->Run(&result);
+            }
+            catch (...)
+            {
+                // thrown by an exception handler
+                result.SetException(std::current_exception());
+            }
+            taskDetails->AfterRun();
+            result.SetCompleted();
         }
 
     private:
@@ -113,7 +202,19 @@ namespace Async {
     template<typename TaskFunction>
     Task<FUNCTION_RETURN_TYPE(TaskFunction)> Spawn(TaskFunction&& func)
     {
-        auto newDetails = CreateTaskDetails(func);
+        auto newDetails = CreateTaskDetails(std::forward<TaskFunction>(func));
         return Task<FUNCTION_RETURN_TYPE(TaskFunction)>(newDetails);
     }
-}
\ No newline at end of file
+
+    /////////////////////////////////////////////////
+    /// function SpawnFused
+    /////////////////////////////////////////////////
+    // like Spawn, but the Then/Get chain is fused at compile time and erased once at Run()
+    template<typename TaskFunction>
+    FusedChain<FusedDetails::SourceStage<typename std::decay<TaskFunction>::type>, Task> SpawnFused(TaskFunction&& func)
+    {
+        typedef FusedDetails::SourceStage<typename std::decay<TaskFunction>::type> SourceStage;
+
+        return FusedChain<SourceStage, Task>(SourceStage{ std::forward<TaskFunction>(func) });
+    }
+}
@@ -1,38 +1,247 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <type_traits>
 #include <vector>
 
 #include "Cancel.h"
 #include "ExceptionDetails.h"
+#include "ExecutionContext.h"
 #include "Notify.h"
+#include "StageValue.h"
 #include "TaskHandle.h"
+#include "ThreadLocal.h"
+#include "Timer.h"
+#include "UniqueFunction.h"
 
 #define FUNCTION_WITH_ARGUMENT_RETURN_TYPE(Function, Argument) typename std::result_of<Function&&(Argument)>::type
 #define FUNCTION_RETURN_TYPE(Function) typename std::result_of<Function&&()>::type
 
 namespace Async {
 
-    typedef struct
+    /////////////////////////////////////////////////
+    /// class TaskBypassFlag
+    /////////////////////////////////////////////////
+    // set by ReceiveOne/ReceiveSome when nothing is popped, so the rest of the chain is skipped.
+    // A run binds its own flag on its thread, so the workers of a parallel ObserveTask don't
+    // skip each other's objects.
+    class TaskBypassFlag
     {
-        bool Bypass;
-    } TaskBypassFlag;
+    public:
+        struct Binding
+        {
+            const TaskBypassFlag *Owner;
+            bool *Bypass;
+        };
+
+        TaskBypassFlag()
+            : m_bypass(false)
+        {}
+
+        void Set(bool bypass)
+        {
+            *Current() = bypass;
+        }
+
+        bool IsSet() const
+        {
+            return *Current();
+        }
+
+        // bind bypass to this flag on the current thread, return the previous binding to restore
+        Binding Bind(bool *bypass) const
+        {
+            Binding previous = *GetBinding();
+
+            GetBinding()->Owner = this;
+            GetBinding()->Bypass = bypass;
+            return previous;
+        }
+
+        static void Restore(const Binding& previous)
+        {
+            *GetBinding() = previous;
+        }
+
+    private:
+        bool * Current() const
+        {
+            if (GetBinding()->Owner == this)
+                return GetBinding()->Bypass;
+            return &m_bypass;
+        }
+
+        static Binding * GetBinding()
+        {
+            static THREAD_LOCAL Binding binding = { nullptr, nullptr };
+
+            return &binding;
+        }
+
+    private:
+        mutable bool m_bypass; // when not bound on the current thread
+    };
+
+    namespace StageDetails {
+
+        // the stage functions of TaskStage, structs instead of lambdas to move the function in
+
+        template<typename ReturnType>
+        struct RootStage
+        {
+            UniqueFunction<ReturnType()> Func;
+
+            void operator()(StageValue& value)
+            {
+                if (Func)
+                    value.Store<ReturnType>(Func);
+                else
+                    value.Store<ReturnType>([] { return ReturnType(); });
+            }
+        };
+
+        template<typename ReturnType, typename Function>
+        struct ThenStage
+        {
+            Function Func;
+
+            void operator()(StageValue& value)
+            {
+                value.Store<ReturnType>(Func);
+            }
+        };
+
+        template<typename ReturnType, typename ParentReturnType, typename Function>
+        struct GetStage
+        {
+            Function Func;
+
+            void operator()(StageValue& value)
+            {
+                auto parentReturn = std::move(value.Get<ParentReturnType>());
+                value.Store<ReturnType>([this, &parentReturn] {
+                    return Func(std::move(parentReturn));
+                });
+            }
+        };
+    }
 
     /////////////////////////////////////////////////
-    /// class TaskDetails
+    /// class TaskStage
     /////////////////////////////////////////////////
-    template<typename ReturnType>
-    class TaskDetails : public std::enable_shared_from_this<TaskDetails<ReturnType> >
+    // one step of a Then/Get chain. A stage only links to its parent, and the run flattens
+    // the chain into a vector once, so running it takes a loop instead of a recursion.
+    class TaskStage
     {
+    public:
+        typedef UniqueFunction<void(StageValue&)> StageFunction; // takes the parent's return, stores its own
+
+        TaskStage(std::shared_ptr<TaskStage> parent, StageFunction&& stageFunction)
+            : m_parent(std::move(parent)), m_stageFunction(std::move(stageFunction)),
+              m_exceptionHandle(nullptr)
+        {}
+
+        virtual ~TaskStage()
+        {
+            // unlink the parents one by one, a long chain would overflow the stack
+            // by destructing them recursively
+            auto parent = std::move(m_parent);
+            while (parent && parent.use_count() == 1)
+                parent = std::move(parent->m_parent);
+        }
+
+        void OnException(EXCEPTION_HANDLE_FUNCTION exceptionHandle)
+        {
+            m_exceptionHandle = std::move(exceptionHandle);
+        }
+
+    protected:
+        // run the stages from the root to this one, return false if bypassed or thrown on the way.
+        // The exception is caught once, where it is thrown, and handed over as one exception_ptr.
+        bool RunStages(StageValue& value, std::exception_ptr& exception)
+        {
+            std::call_once(m_flattenOnce, [this] {
+                for (TaskStage *stage = this; stage; stage = stage->m_parent.get())
+                    m_stages.push_back(stage);
+                std::reverse(m_stages.begin(), m_stages.end());
+            });
+
+            for (size_t i = 0; i < m_stages.size(); i++)
+            {
+                try
+                {
+                    m_stages[i]->m_stageFunction(value);
+                }
+                catch (...)
+                {
+                    exception = std::current_exception();
+                }
+
+                if (exception)
+                {
+                    // the handlers of this stage and all stages after it, as the exception passes them by
+                    for (size_t j = i; j < m_stages.size(); j++)
+                    {
+                        if (m_stages[j]->m_exceptionHandle)
+                            m_stages[j]->m_exceptionHandle(exception);
+                    }
+                    return false;
+                }
+
+                if (i + 1 < m_stages.size() && IsBypass())
+                    return false;
+            }
+            return true;
+        }
+
+        virtual bool IsBypass() const = 0;
+
     private:
-        typedef std::function<void()> VoidFunction;
+        std::shared_ptr<TaskStage> m_parent;
+        StageFunction m_stageFunction;
+        EXCEPTION_HANDLE_FUNCTION m_exceptionHandle;
+
+        std::once_flag m_flattenOnce;
+        std::vector<TaskStage *> m_stages; // from the root to this, the parents are held by m_parent
+    };
 
+    /////////////////////////////////////////////////
+    /// class TaskDetails
+    /////////////////////////////////////////////////
+    template<typename ReturnType>
+    class TaskDetails : public TaskStage, public std::enable_shared_from_this<TaskDetails<ReturnType> >
+    {
     public:
-        TaskDetails(std::function<ReturnType()>&& func, std::shared_ptr<TaskBypassFlag> bypassFlag = nullptr)
-            : m_function(func), m_bypassFlag(bypassFlag),
-              m_onEndFunction(nullptr), m_onBeginFunction(nullptr),
-              m_exceptionHandle(nullptr)
+        // what a run installs on its thread, restored when it leaves
+        struct ThreadScope
+        {
+            ThreadScope()
+                : PreviousContext(nullptr), Bypass(false)
+            {
+                PreviousBypass.Owner = nullptr;
+                PreviousBypass.Bypass = nullptr;
+            }
+
+            ExecutionContext *PreviousContext; // of the outer task running on the same thread
+            TaskBypassFlag::Binding PreviousBypass;
+            bool Bypass;
+        };
+
+        TaskDetails(UniqueFunction<ReturnType()>&& func, std::shared_ptr<TaskBypassFlag> bypassFlag = nullptr)
+            : TaskDetails(nullptr, StageDetails::RootStage<ReturnType>{ std::move(func) }, bypassFlag)
+        {
+        }
+
+        // a stage after parent, see Then() and Get()
+        TaskDetails(std::shared_ptr<TaskStage> parent, StageFunction&& stageFunction, std::shared_ptr<TaskBypassFlag> bypassFlag)
+            : TaskStage(std::move(parent), std::move(stageFunction)),
+              m_bypassFlag(bypassFlag),
+              m_timeout(std::chrono::steady_clock::duration::zero()),
+              m_onEndFunction(nullptr), m_onBeginFunction(nullptr)
         {
         }
 
@@ -41,66 +250,121 @@ namespace Async {
             //std::cout << typeid(ReturnType).name() << std::endl;
         }
 
+        // after Begin()
         void BeforeRun()
         {
-            if (m_bypassFlag)
-                m_bypassFlag->Bypass = false;
+            Enter(m_scope);
+            RunOnBegin();
+        }
 
-            m_cancelTrigger = new CancelTrigger();
-            *(CancelTrigger::GetCancelTrigger()) = m_cancelTrigger;
+        // the return or the exception of the chain goes to result, if any.
+        // Nothing is thrown, except by an exception handler.
+        void Run(TaskResult<ReturnType> *result = nullptr)
+        {
+            StageValue value;
+            std::exception_ptr exception;
 
-            std::for_each(m_notifierInitializer.begin(), m_notifierInitializer.end(),
-                [](const VoidFunction& initFunc) {
-                initFunc();
-            });
+            const bool completed = RunStages(value, exception);
+            if (!result)
+                return;
+
+            if (exception)
+                result->SetException(exception);
+            else
+                SetReturn(*result, completed ? &value : nullptr, std::is_void<ReturnType>());
+        }
 
+        void AfterRun()
+        {
+            RunOnEnd();
+            Leave(m_scope);
+            End();
+        }
+
+        void RunOnBegin()
+        {
             if (m_onBeginFunction)
                 m_onBeginFunction();
         }
 
-        ReturnType Run()
+        void RunOnEnd()
         {
-            try
+            if (m_onEndFunction)
+                m_onEndFunction();
+        }
+
+        // once per run, before the handle is returned and any thread enters
+        void Begin()
+        {
+            m_context.Cancellation().Reset();
+
+            if (m_timeout > std::chrono::steady_clock::duration::zero())
             {
-                if (m_function)
-                    return m_function();
-                return ReturnType();
+                std::weak_ptr<TaskDetails> weakSelf = this->shared_from_this();
+                m_timeoutTimer = TimerService::Default().Schedule(std::chrono::steady_clock::now() + m_timeout,
+                    std::chrono::steady_clock::duration::zero(), [weakSelf]() {
+                    if (auto self = weakSelf.lock())
+                        self->Cancel();
+                });
             }
-            catch (...)
+        }
+
+        // once per run, after all threads leave
+        void End()
+        {
+            // a late timeout can't cancel the next run
+            if (m_timeoutTimer)
             {
-                if (m_exceptionHandle)
-                    m_exceptionHandle(std::current_exception());
-                throw;
+                TimerService::Default().Cancel(m_timeoutTimer);
+                m_timeoutTimer = nullptr;
             }
+
+            Handle = nullptr; // release the Handle shared_ptr here
         }
 
-        void AfterRun()
+        // install the execution context and the bypass flag on the current thread
+        void Enter(ThreadScope& scope)
         {
-            if (m_onEndFunction)
-                m_onEndFunction();
+            scope.Bypass = false;
+            if (m_bypassFlag)
+                scope.PreviousBypass = m_bypassFlag->Bind(&scope.Bypass);
 
-            std::for_each(m_notifierReleaser.begin(), m_notifierReleaser.end(),
-                [](const VoidFunction& releaseFunc) {
-                releaseFunc();
-            });
+            scope.PreviousContext = ExecutionContext::Exchange(&m_context);
+        }
 
-            *(CancelTrigger::GetCancelTrigger()) = nullptr;
-            delete m_cancelTrigger;
-            m_cancelTrigger = nullptr;
+        // restore what Enter() replaced on the current thread
+        void Leave(ThreadScope& scope)
+        {
+            ExecutionContext::Exchange(scope.PreviousContext);
+            scope.PreviousContext = nullptr;
 
-            Handle = nullptr; // release the Handle shared_ptr here
+            if (m_bypassFlag)
+                TaskBypassFlag::Restore(scope.PreviousBypass);
         }
 
+        // safe from any thread at any time, the context lives as long as the details
         void Cancel()
         {
-            if (m_cancelTrigger)
-                m_cancelTrigger->Set(true);
+            m_context.Cancellation().Cancel();
+        }
+
+        // cancelled together with the token, see CancellationSource
+        void CancelledBy(const CancellationToken& token)
+        {
+            m_context.Cancellation().Link(token);
         }
 
-        bool IsBypass() const
+        // each run is cancelled once the timeout has passed since its Run()
+        void WithTimeout(std::chrono::steady_clock::duration timeout)
+        {
+            m_timeout = timeout;
+        }
+
+        // of the run on the current thread
+        bool IsBypass() const override
         {
             if (m_bypassFlag)
-                return m_bypassFlag->Bypass;
+                return m_bypassFlag->IsSet();
             return false;
         }
 
@@ -110,18 +374,12 @@ namespace Async {
             /*
             std::string ReturnTypeName(typeid(FUNCTION_RETURN_TYPE(NextTaskFunction)).name());
             */
-            auto parent = this->shared_from_this();
-            auto functionWrapper = [parent, func]() {
-                parent->Run();
-
-                if (parent->m_bypassFlag && parent->m_bypassFlag->Bypass)
-                    return FUNCTION_RETURN_TYPE(NextTaskFunction)();
-
-                return func();
-            };
+            typedef StageDetails::ThenStage<FUNCTION_RETURN_TYPE(NextTaskFunction),
+                                            typename std::decay<NextTaskFunction>::type> Stage;
 
             return std::make_shared<TaskDetails<FUNCTION_RETURN_TYPE(NextTaskFunction)> >(
-                std::forward<std::function<FUNCTION_RETURN_TYPE(NextTaskFunction)()> >(functionWrapper),
+                this->shared_from_this(),
+                StageFunction(Stage{ std::forward<NextTaskFunction>(func) }),
                 m_bypassFlag
             );
         }
@@ -133,18 +391,12 @@ namespace Async {
             std::string NextReturnTypeName(typeid(FUNCTION_WITH_ARGUMENT_RETURN_TYPE(NextTaskFunction, U)).name());
             std::string ParentReturnTypeName(typeid(U).name());
             */
-            auto parent = this->shared_from_this();
-            auto functionWrapper = [parent, func]() {
-                auto parentReturn = parent->Run();
-
-                if (parent->m_bypassFlag && parent->m_bypassFlag->Bypass)
-                    return FUNCTION_WITH_ARGUMENT_RETURN_TYPE(NextTaskFunction, U)();
-
-                return func(parentReturn);
-            };
+            typedef StageDetails::GetStage<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(NextTaskFunction, U), U,
+                                           typename std::decay<NextTaskFunction>::type> Stage;
 
             return std::make_shared<TaskDetails<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(NextTaskFunction, U)> >(
-                std::forward<std::function<FUNCTION_WITH_ARGUMENT_RETURN_TYPE(NextTaskFunction, U)()> >(functionWrapper),
+                this->shared_from_this(),
+                StageFunction(Stage{ std::forward<NextTaskFunction>(func) }),
                 m_bypassFlag
             );
         }
@@ -152,45 +404,48 @@ namespace Async {
         template<typename NotifyData>
         void Notified(NOTIFY_FUNCTION(NotifyData) notifyFunction)
         {
-            m_notifierInitializer.push_back([notifyFunction] {
-                SetNotifyFunction<NotifyData>(notifyFunction);
-            });
-
-            m_notifierReleaser.push_back([] {
-                SetNotifyFunction<NotifyData>(nullptr);
-            });
+            // only the task's own Notify calls reach it, not those of a nested task
+            m_context.Handlers().template Set<NotifyData>(std::move(notifyFunction));
         }
 
-        void OnException(EXCEPTION_HANDLE_FUNCTION exceptionHandle)
+        void OnBegin(UniqueFunction<void()> onBeginFunction)
         {
-            m_exceptionHandle = exceptionHandle;
+            m_onBeginFunction = std::move(onBeginFunction);
         }
 
-        void OnBegin(std::function<void()> onBeginFunction)
+        void OnEnd(UniqueFunction<void()> onEndFunction)
         {
-            m_onBeginFunction = onBeginFunction;
+            m_onEndFunction = std::move(onEndFunction);
         }
 
-        void OnEnd(std::function<void()> onEndFunction)
+    public:
+        iTaskHandle::ptr Handle;
+
+    private:
+        // a bypassed chain returns ReturnType()
+        static void SetReturn(TaskResult<ReturnType>& result, StageValue *value, std::false_type)
         {
-            m_onEndFunction = onEndFunction;
+            if (value)
+                result.SetValue(std::move(value->Get<ReturnType>()));
+            else
+                result.SetValue(ReturnType());
         }
 
-    public:
-        iTaskHandle::ptr Handle;
+        static void SetReturn(TaskResult<ReturnType>& result, StageValue *, std::true_type)
+        {
+            result.SetValue();
+        }
 
     private:
-        std::function<ReturnType()> m_function;
-        CancelTrigger *m_cancelTrigger;
+        ExecutionContext m_context;
+        ThreadScope m_scope; // of the single-thread run
         std::shared_ptr<TaskBypassFlag> m_bypassFlag;
 
-        std::vector<std::function<void()> > m_notifierInitializer;
-        std::vector<std::function<void()> > m_notifierReleaser;
+        std::chrono::steady_clock::duration m_timeout; // zero for none
+        TimerService::Timer m_timeoutTimer; // of the current run
 
-        std::function<void()> m_onEndFunction;
-        std::function<void()> m_onBeginFunction;
-
-        EXCEPTION_HANDLE_FUNCTION m_exceptionHandle;
+        UniqueFunction<void()> m_onEndFunction;
+        UniqueFunction<void()> m_onBeginFunction;
     };
 
     /////////////////////////////////////////////////
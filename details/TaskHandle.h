@@ -1,7 +1,17 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Executor.h"
+#include "Optional.h"
+#include "UniqueFunction.h"
 
 namespace Async {
 
@@ -34,14 +44,14 @@ namespace Async {
                 m_detachFunc();
         }
 
-        static iTaskHandle::ptr New(std::function<void()> cancelFunc,
-            std::function<void()> joinFunc,
-            std::function<void()> detachFunc)
+        static iTaskHandle::ptr New(UniqueFunction<void()> cancelFunc,
+            UniqueFunction<void()> joinFunc,
+            UniqueFunction<void()> detachFunc)
         {
             auto newHandle = new TaskHandle();
-            newHandle->m_cancelFunc = cancelFunc;
-            newHandle->m_joinFunc = joinFunc;
-            newHandle->m_detachFunc = detachFunc;
+            newHandle->m_cancelFunc = std::move(cancelFunc);
+            newHandle->m_joinFunc = std::move(joinFunc);
+            newHandle->m_detachFunc = std::move(detachFunc);
 
             return iTaskHandle::ptr((iTaskHandle *)newHandle);
         }
@@ -64,8 +74,290 @@ namespace Async {
         {}
 
     private:
-        std::function<void()> m_cancelFunc;
-        std::function<void()> m_joinFunc;
-        std::function<void()> m_detachFunc;
+        UniqueFunction<void()> m_cancelFunc;
+        UniqueFunction<void()> m_joinFunc;
+        UniqueFunction<void()> m_detachFunc;
+    };
+
+    /////////////////////////////////////////////////
+    /// class TaskCompletion
+    /////////////////////////////////////////////////
+    class TaskCompletion
+    {
+    public:
+        typedef std::shared_ptr<TaskCompletion> ptr;
+
+    public:
+        static TaskCompletion::ptr New()
+        {
+            return TaskCompletion::ptr(new TaskCompletion());
+        }
+
+        void Set()
+        {
+            std::vector<UniqueFunction<void()> > callbacks;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_completed = true;
+                callbacks.swap(m_callbacks);
+            }
+            m_cv.notify_all();
+
+            for (auto& callback : callbacks)
+                callback();
+        }
+
+        // the callback is called once completed, on the thread calling Set().
+        // Return false without keeping the callback if completed already.
+        bool OnCompleted(UniqueFunction<void()> callback)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            if (m_completed)
+                return false;
+
+            m_callbacks.push_back(std::move(callback));
+            return true;
+        }
+
+        void Wait()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this] { return m_completed; });
+        }
+
+        // return false on timeout
+        template<typename Rep, typename Period>
+        bool WaitFor(const std::chrono::duration<Rep, Period>& timeout)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            return m_cv.wait_for(lock, timeout, [this] { return m_completed; });
+        }
+
+        bool IsCompleted()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_completed;
+        }
+
+    private:
+        TaskCompletion()
+            : m_completed(false)
+        {}
+
+    private:
+        bool m_completed;
+        std::vector<UniqueFunction<void()> > m_callbacks; // see OnCompleted
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+    };
+
+    /////////////////////////////////////////////////
+    /// class TaskResultBase
+    /////////////////////////////////////////////////
+    // what TaskResult<ReturnType> shares whatever the ReturnType is
+    class TaskResultBase : public iTaskHandle
+    {
+    public:
+        virtual void Cancel()
+        {
+            if (m_cancelFunc)
+                m_cancelFunc();
+        }
+
+        // same as Wait()
+        virtual void Join()
+        {
+            Wait();
+        }
+
+        // until the task has run. Called from a worker of the executor the task is posted to,
+        // it runs the task inline if no worker has picked it up yet, so a task waiting on
+        // its child doesn't deadlock the pool, e.g. on a 1-thread pool
+        void Wait()
+        {
+            if (m_pendingExecutor && !m_completion->IsCompleted() &&
+                GetCurrentExecutor().get() == m_pendingExecutor)
+                RunPending();
+            m_completion->Wait();
+        }
+
+        // return false on timeout
+        template<typename Rep, typename Period>
+        bool WaitFor(const std::chrono::duration<Rep, Period>& timeout)
+        {
+            return m_completion->WaitFor(timeout);
+        }
+
+        bool IsReady()
+        {
+            return m_completion->IsCompleted();
+        }
+
+        // see TaskCompletion::OnCompleted, e.g. to resume a coroutine awaiting the task
+        bool OnCompleted(UniqueFunction<void()> callback)
+        {
+            return m_completion->OnCompleted(std::move(callback));
+        }
+
+        // wait, and return what the chain has thrown, nullptr if nothing
+        std::exception_ptr GetException()
+        {
+            Wait();
+            return m_exception;
+        }
+
+        // the run of a task posted to the executor, by Task::Run before posting it
+        void SetPending(const iExecutor *executor, UniqueFunction<void()> run)
+        {
+            m_pendingExecutor = executor;
+            m_pendingRun = std::move(run);
+        }
+
+        // by the posted work and by Wait(), only the first call runs the task
+        void RunPending()
+        {
+            if (m_runClaimed.exchange(true, std::memory_order_acq_rel))
+                return;
+
+            auto run = std::move(m_pendingRun);
+            run();
+        }
+
+        // only once, by the thread running the task
+        void SetException(std::exception_ptr exception)
+        {
+            m_exception = exception;
+        }
+
+        // by the thread running the task, after the value or the exception is set
+        void SetCompleted()
+        {
+            m_completion->Set();
+        }
+
+    protected:
+        TaskResultBase(UniqueFunction<void()>&& cancelFunc)
+            : m_cancelFunc(std::move(cancelFunc)), m_completion(TaskCompletion::New()),
+              m_pendingExecutor(nullptr), m_runClaimed(false)
+        {}
+
+        // rethrow what the chain has thrown, the completion lock orders it after SetException()
+        void RethrowIfFailed() const
+        {
+            if (m_exception)
+                std::rethrow_exception(m_exception);
+        }
+
+    private:
+        UniqueFunction<void()> m_cancelFunc;
+        TaskCompletion::ptr m_completion;
+        std::exception_ptr m_exception;
+
+        const iExecutor *m_pendingExecutor; // only compared, see Wait()
+        UniqueFunction<void()> m_pendingRun;
+        std::atomic<bool> m_runClaimed;
+    };
+
+    /////////////////////////////////////////////////
+    /// class TaskResult
+    /////////////////////////////////////////////////
+    // the typed handle Task::Run returns: what the last stage returns, or the exception of the chain
+    template<typename ReturnType>
+    class TaskResult : public TaskResultBase
+    {
+    public:
+        typedef std::shared_ptr<TaskResult> ptr;
+
+    public:
+        static ptr New(UniqueFunction<void()> cancelFunc)
+        {
+            return ptr(new TaskResult(std::move(cancelFunc)));
+        }
+
+        // wait, then return the value, or rethrow the exception of the chain
+        const ReturnType & GetResult()
+        {
+            Wait();
+            RethrowIfFailed();
+            return m_value.Get();
+        }
+
+        // like GetResult(), but the value is moved out, so only for a single consumer,
+        // e.g. a combinator or an awaiter, and it works with a move-only ReturnType
+        ReturnType TakeResult()
+        {
+            Wait();
+            RethrowIfFailed();
+            return std::move(m_value.Get());
+        }
+
+        // return false if the task hasn't run yet, otherwise the same as GetResult()
+        bool TryGet(ReturnType& result)
+        {
+            if (!IsReady())
+                return false;
+
+            RethrowIfFailed();
+            result = m_value.Get();
+            return true;
+        }
+
+        // only once, by the thread running the task
+        void SetValue(ReturnType&& value)
+        {
+            m_value.Emplace(std::move(value));
+        }
+
+    private:
+        TaskResult(UniqueFunction<void()>&& cancelFunc)
+            : TaskResultBase(std::move(cancelFunc))
+        {}
+
+    private:
+        Optional<ReturnType> m_value;
+    };
+
+    template<>
+    class TaskResult<void> : public TaskResultBase
+    {
+    public:
+        typedef std::shared_ptr<TaskResult> ptr;
+
+    public:
+        static ptr New(UniqueFunction<void()> cancelFunc)
+        {
+            return ptr(new TaskResult(std::move(cancelFunc)));
+        }
+
+        // wait, then rethrow the exception of the chain if any
+        void GetResult()
+        {
+            Wait();
+            RethrowIfFailed();
+        }
+
+        void TakeResult()
+        {
+            GetResult();
+        }
+
+        // return false if the task hasn't run yet, otherwise the same as GetResult()
+        bool TryGet()
+        {
+            if (!IsReady())
+                return false;
+
+            RethrowIfFailed();
+            return true;
+        }
+
+        void SetValue()
+        {}
+
+    private:
+        TaskResult(UniqueFunction<void()>&& cancelFunc)
+            : TaskResultBase(std::move(cancelFunc))
+        {}
     };
 }
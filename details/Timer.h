@@ -0,0 +1,666 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Executor.h"
+#include "TaskHandle.h"
+#include "UniqueFunction.h"
+
+namespace Async {
+
+    namespace TimerDetails {
+
+        typedef std::chrono::steady_clock Clock;
+
+        /////////////////////////////////////////////////
+        /// class TimerNode
+        /////////////////////////////////////////////////
+        // a timer, linked in a slot of the wheel while pending
+        struct TimerNode
+        {
+            TimerNode(Clock::time_point due, Clock::duration period, UniqueFunction<void()>&& callback)
+                : Due(due), Period(period), Callback(std::move(callback)),
+                Tick(0), Prev(nullptr), Next(nullptr), Slot(nullptr), Firing(false), Cancelled(false)
+            {}
+
+            Clock::time_point Due;
+            const Clock::duration Period; // zero for a one-shot timer
+            UniqueFunction<void()> Callback;
+
+            // guarded by the mutex of the service
+            uint64_t Tick; // Due rounded up to the tick
+            TimerNode *Prev;
+            TimerNode *Next;
+            TimerNode **Slot; // the head of the list it is linked in, nullptr if not pending
+            std::shared_ptr<TimerNode> Self; // the wheel owns the pending timers
+            bool Firing;
+            bool Cancelled;
+        };
+
+        /////////////////////////////////////////////////
+        /// class TimerWheel
+        /////////////////////////////////////////////////
+        // hierarchical timing wheel: level 0 has a slot per tick for the current 256 ticks, each upper level
+        // has 64 slots of 64 times the span of a lower slot. Insert and remove are O(1), a slot of an upper
+        // level is cascaded down once when the current tick reaches it. Not thread safe.
+        class TimerWheel
+        {
+        public:
+            TimerWheel()
+                : m_current(0), m_count(0)
+            {
+                for (auto& slot : m_level0)
+                    slot = nullptr;
+                for (auto& level : m_levels)
+                {
+                    for (auto& slot : level)
+                        slot = nullptr;
+                }
+                for (auto& bits : m_occupied)
+                    bits = 0;
+            }
+
+            size_t Count() const
+            {
+                return m_count;
+            }
+
+            void Insert(TimerNode *node)
+            {
+                const uint64_t tick = node->Tick > m_current ? node->Tick : m_current;
+
+                TimerNode **slot;
+                if ((tick >> Level0Bits) == (m_current >> Level0Bits))
+                {
+                    const size_t index = tick & Level0Mask;
+                    slot = &m_level0[index];
+                    m_occupied[index / 64] |= uint64_t(1) << (index % 64);
+                }
+                else
+                {
+                    size_t level = 0;
+                    int shift = Level0Bits;
+                    while (level + 1 < UpperLevels && (tick >> shift) - (m_current >> shift) >= LevelSize)
+                    {
+                        level++;
+                        shift += LevelBits;
+                    }
+
+                    // beyond the last level, parked in its farthest slot and cascaded again later
+                    uint64_t index = tick >> shift;
+                    if (index - (m_current >> shift) >= LevelSize)
+                        index = (m_current >> shift) + LevelSize - 1;
+                    slot = &m_levels[level][index & LevelMask];
+                }
+
+                node->Slot = slot;
+                node->Prev = nullptr;
+                node->Next = *slot;
+                if (node->Next)
+                    node->Next->Prev = node;
+                *slot = node;
+                m_count++;
+            }
+
+            void Remove(TimerNode *node)
+            {
+                if (node->Prev)
+                    node->Prev->Next = node->Next;
+                else
+                    *node->Slot = node->Next;
+                if (node->Next)
+                    node->Next->Prev = node->Prev;
+
+                // a level 0 slot left empty
+                if (!*node->Slot && node->Slot >= m_level0 && node->Slot < m_level0 + Level0Size)
+                {
+                    const size_t index = node->Slot - m_level0;
+                    m_occupied[index / 64] &= ~(uint64_t(1) << (index % 64));
+                }
+
+                node->Slot = nullptr;
+                node->Prev = nullptr;
+                node->Next = nullptr;
+                m_count--;
+            }
+
+            // move the expired timers up to the tick (exclusive) to expired, unlinked
+            void Advance(uint64_t tick, std::vector<TimerNode *>& expired)
+            {
+                while (m_current < tick)
+                {
+                    if ((m_current & Level0Mask) == 0)
+                        Cascade();
+
+                    auto& slot = m_level0[m_current & Level0Mask];
+                    while (slot)
+                    {
+                        auto node = slot;
+                        Remove(node);
+                        expired.push_back(node);
+                    }
+
+                    // skip the empty slots up to the end of the block
+                    m_current = std::min(NextOccupied(m_current + 1), tick);
+                }
+            }
+
+            // the next tick to process with something to do, if any timer is pending
+            uint64_t NextTick() const
+            {
+                // the start of a block not cascaded yet
+                if ((m_current & Level0Mask) == 0)
+                    return m_current;
+                return NextOccupied(m_current);
+            }
+
+            // unlink all the pending timers to nodes
+            void RemoveAll(std::vector<TimerNode *>& nodes)
+            {
+                for (auto& slot : m_level0)
+                {
+                    while (slot)
+                    {
+                        nodes.push_back(slot);
+                        Remove(slot);
+                    }
+                }
+                for (auto& level : m_levels)
+                {
+                    for (auto& slot : level)
+                    {
+                        while (slot)
+                        {
+                            nodes.push_back(slot);
+                            Remove(slot);
+                        }
+                    }
+                }
+            }
+
+        private:
+            // the first occupied level 0 tick from tick on, otherwise the start of the next block
+            uint64_t NextOccupied(uint64_t tick) const
+            {
+                const uint64_t blockEnd = ((m_current >> Level0Bits) + 1) << Level0Bits;
+                for (; tick < blockEnd; )
+                {
+                    const size_t index = tick & Level0Mask;
+                    const uint64_t bits = m_occupied[index / 64] >> (index % 64);
+                    if (bits)
+                    {
+                        size_t offset = 0;
+                        while (!((bits >> offset) & 1))
+                            offset++;
+                        return tick + offset;
+                    }
+                    tick += 64 - index % 64;
+                }
+                return blockEnd;
+            }
+
+            // at the start of a level 0 block, move the upper slots reached by the current tick down
+            void Cascade()
+            {
+                int shift = Level0Bits;
+                size_t level = 0;
+                while (level + 1 < UpperLevels && ((m_current >> shift) & LevelMask) == 0)
+                {
+                    level++;
+                    shift += LevelBits;
+                }
+
+                // from the highest level reached, so a timer can fall through several levels
+                for (size_t i = level + 1; i-- > 0; )
+                {
+                    const int levelShift = Level0Bits + int(i) * LevelBits;
+                    auto& slot = m_levels[i][(m_current >> levelShift) & LevelMask];
+                    while (slot)
+                    {
+                        auto node = slot;
+                        Remove(node);
+                        Insert(node);
+                    }
+                }
+            }
+
+        private:
+            static const int Level0Bits = 8;
+            static const size_t Level0Size = size_t(1) << Level0Bits;
+            static const uint64_t Level0Mask = Level0Size - 1;
+            static const int LevelBits = 6;
+            static const size_t LevelSize = size_t(1) << LevelBits;
+            static const uint64_t LevelMask = LevelSize - 1;
+            static const size_t UpperLevels = 3;
+
+            uint64_t m_current;
+            size_t m_count;
+            TimerNode *m_level0[Level0Size];
+            uint64_t m_occupied[Level0Size / 64]; // a bit per non-empty level 0 slot
+            TimerNode *m_levels[UpperLevels][LevelSize];
+        };
+    }
+
+    /////////////////////////////////////////////////
+    /// class TimerService
+    /////////////////////////////////////////////////
+    // one thread firing all the timers of a wheel, instead of a sleeping thread per timer.
+    // A timer fires within a tick (250us) after it is due, the callbacks run on the timer thread,
+    // so they should only post the work elsewhere, as Delay and Every do.
+    class TimerService
+    {
+    public:
+        typedef std::shared_ptr<TimerDetails::TimerNode> Timer;
+        typedef TimerDetails::Clock Clock;
+
+    public:
+        TimerService()
+            : m_epoch(Clock::now()), m_stopped(false), m_wakeTick(NeverTick)
+        {}
+
+        ~TimerService()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stopped = true;
+            }
+            m_cv.notify_all();
+
+            if (m_thread.joinable())
+                m_thread.join();
+
+            // the pending timers own themselves
+            std::vector<TimerDetails::TimerNode *> pending;
+            m_wheel.RemoveAll(pending);
+            for (auto node : pending)
+                node->Self = nullptr;
+        }
+
+        TimerService(const TimerService&) = delete;
+        TimerService & operator=(const TimerService&) = delete;
+
+        // never released, so timers can still fire during static destruction
+        static TimerService & Default()
+        {
+            static TimerService *service = new TimerService();
+            return *service;
+        }
+
+        /**
+        Schedule a callback on the timer thread.
+
+        @param due, when it fires first.
+        @param period, zero to fire once, otherwise the period from due on, without drift.
+        @param callback, run on the timer thread, exceptions are ignored.
+        @return Timer, for Cancel().
+        */
+        Timer Schedule(Clock::time_point due, Clock::duration period, UniqueFunction<void()> callback)
+        {
+            auto timer = std::make_shared<TimerDetails::TimerNode>(due, period, std::move(callback));
+
+            bool wake = false;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+
+                if (!m_thread.joinable())
+                    m_thread = std::thread(&TimerService::Loop, this);
+
+                timer->Tick = ToTick(due);
+                timer->Self = timer;
+                m_wheel.Insert(timer.get());
+
+                // the timer thread sleeps until a later tick
+                wake = timer->Tick < m_wakeTick;
+            }
+
+            if (wake)
+                m_cv.notify_one();
+            return timer;
+        }
+
+        /**
+        Cancel a timer, O(1). Once it returns, the callback won't start anymore,
+        and it has returned if it was running, unless called from the callback itself.
+
+        @param timer.
+        @return bool, true if the timer was pending.
+        */
+        bool Cancel(const Timer& timer)
+        {
+            if (!timer)
+                return false;
+
+            UniqueFunction<void()> callback; // released out of the lock
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            timer->Cancelled = true;
+            if (timer->Slot)
+            {
+                m_wheel.Remove(timer.get());
+                callback = std::move(timer->Callback);
+                timer->Self = nullptr; // the caller still holds it
+                return true;
+            }
+
+            if (std::this_thread::get_id() != m_thread.get_id())
+                m_firedCV.wait(lock, [&timer] { return !timer->Firing; });
+            return false;
+        }
+
+        size_t PendingCount()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_wheel.Count();
+        }
+
+    private:
+        static const int64_t TickMicroseconds = 250;
+        static const uint64_t NeverTick = ~uint64_t(0);
+
+        // a due time is rounded up, so a timer never fires early
+        uint64_t ToTick(Clock::time_point time) const
+        {
+            if (time <= m_epoch)
+                return 0;
+
+            auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(time - m_epoch).count();
+            if (m_epoch + std::chrono::microseconds(microseconds) < time)
+                microseconds++;
+            return uint64_t((microseconds + TickMicroseconds - 1) / TickMicroseconds);
+        }
+
+        // the last tick started by now
+        uint64_t NowTick() const
+        {
+            auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - m_epoch).count();
+            return uint64_t(microseconds / TickMicroseconds);
+        }
+
+        Clock::time_point ToTime(uint64_t tick) const
+        {
+            return m_epoch + std::chrono::microseconds(int64_t(tick) * TickMicroseconds);
+        }
+
+        void Loop()
+        {
+            std::vector<TimerDetails::TimerNode *> expired;
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            while (!m_stopped)
+            {
+                m_wheel.Advance(NowTick() + 1, expired);
+
+                if (!expired.empty())
+                {
+                    Fire(lock, expired);
+                    expired.clear();
+                    continue;
+                }
+
+                if (m_wheel.Count() == 0)
+                {
+                    m_wakeTick = NeverTick;
+                    m_cv.wait(lock);
+                }
+                else
+                {
+                    m_wakeTick = m_wheel.NextTick();
+                    m_cv.wait_until(lock, ToTime(m_wakeTick));
+                }
+                m_wakeTick = NeverTick;
+            }
+        }
+
+        // run the callbacks out of the lock, then reschedule the periodic timers
+        void Fire(std::unique_lock<std::mutex>& lock, std::vector<TimerDetails::TimerNode *>& expired)
+        {
+            std::vector<std::shared_ptr<TimerDetails::TimerNode> > timers;
+            timers.reserve(expired.size());
+            for (auto node : expired)
+            {
+                node->Firing = true;
+                timers.push_back(std::move(node->Self));
+            }
+
+            lock.unlock();
+            for (auto& timer : timers)
+            {
+                try
+                {
+                    timer->Callback();
+                }
+                catch (...)
+                {
+                }
+            }
+            lock.lock();
+
+            // the callback of a timer not rescheduled may hold the timer, as the state of Every does
+            std::vector<UniqueFunction<void()> > released;
+            for (auto& timer : timers)
+            {
+                if (timer->Period != Clock::duration::zero() && !timer->Cancelled)
+                {
+                    timer->Due += timer->Period;
+                    timer->Tick = ToTick(timer->Due);
+                    timer->Self = timer;
+                    m_wheel.Insert(timer.get());
+                }
+                else
+                {
+                    released.push_back(std::move(timer->Callback));
+                }
+            }
+
+            // released out of the lock, before the timers are done firing
+            if (!released.empty())
+            {
+                lock.unlock();
+                released.clear();
+                lock.lock();
+            }
+
+            for (auto& timer : timers)
+                timer->Firing = false;
+            m_firedCV.notify_all();
+        }
+
+    private:
+        const Clock::time_point m_epoch; // of tick 0
+
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        std::condition_variable m_firedCV; // for Cancel() waiting on a firing timer
+        bool m_stopped;
+        uint64_t m_wakeTick; // the timer thread sleeps until it, NeverTick if awake or without timer
+        TimerDetails::TimerWheel m_wheel;
+        std::thread m_thread;
+    };
+
+    namespace TimerDetails {
+
+        inline iExecutor::ptr ExecutorOrDefault(iExecutor::ptr executor)
+        {
+            if (!executor)
+                executor = GetCurrentExecutor();
+            if (!executor)
+                executor = GetDefaultExecutor();
+            return executor;
+        }
+
+        /////////////////////////////////////////////////
+        /// class TimerState
+        /////////////////////////////////////////////////
+        // what the TaskResult of Delay / Every shares with its timer callback
+        class TimerState
+        {
+        public:
+            TimerState(UniqueFunction<void()>&& function, iExecutor::ptr executor)
+                : Function(std::move(function)), Executor(executor), m_running(false), m_completed(false)
+            {}
+
+            // the timer may fire before Schedule returns it
+            void SetTimer(const TimerService::Timer& timer)
+            {
+                std::atomic_store(&m_timer, timer);
+            }
+
+            TimerService::Timer GetTimer() const
+            {
+                return std::atomic_load(&m_timer);
+            }
+
+            // only once, for the end of the run or the cancellation, whichever first
+            void Complete(std::exception_ptr exception = nullptr)
+            {
+                if (m_completed.exchange(true))
+                    return;
+
+                if (auto result = Result.lock())
+                {
+                    if (exception)
+                        result->SetException(exception);
+                    result->SetCompleted();
+                }
+            }
+
+            bool IsCompleted() const
+            {
+                return m_completed.load();
+            }
+
+            // return false if the previous run hasn't returned
+            bool BeginRun()
+            {
+                return !m_running.exchange(true);
+            }
+
+            void EndRun()
+            {
+                m_running = false;
+            }
+
+            UniqueFunction<void()> Function;
+            const iExecutor::ptr Executor;
+            std::weak_ptr<TaskResult<void> > Result; // only completed if someone still holds it
+
+        private:
+            TimerService::Timer m_timer;
+            std::atomic<bool> m_running;
+            std::atomic<bool> m_completed;
+        };
+    }
+
+    /////////////////////////////////////////////////
+    /// function Delay
+    /////////////////////////////////////////////////
+    /**
+    Run func on the executor once the delay has passed, without a thread sleeping until then.
+
+    @param delay.
+    @param func, void().
+    @param executor, nullptr for the current executor, otherwise the default one.
+    @return TaskResult<void>::ptr, completed once func has returned, GetResult() rethrows what it has thrown.
+    Cancel() before the delay has passed completes it without running func.
+    */
+    template<typename Rep, typename Period, typename Function>
+    TaskResult<void>::ptr Delay(const std::chrono::duration<Rep, Period>& delay, Function&& func, iExecutor::ptr executor = nullptr)
+    {
+        auto state = std::make_shared<TimerDetails::TimerState>(
+            UniqueFunction<void()>(std::forward<Function>(func)), TimerDetails::ExecutorOrDefault(executor));
+
+        auto result = TaskResult<void>::New([state]() {
+            if (TimerService::Default().Cancel(state->GetTimer()))
+                state->Complete();
+        });
+        state->Result = result;
+
+        state->SetTimer(TimerService::Default().Schedule(
+            TimerService::Clock::now() + std::chrono::duration_cast<TimerService::Clock::duration>(delay),
+            TimerService::Clock::duration::zero(),
+            [state]() {
+                state->Executor->Post([state]() {
+                    std::exception_ptr exception;
+                    try
+                    {
+                        state->Function();
+                    }
+                    catch (...)
+                    {
+                        exception = std::current_exception();
+                    }
+                    state->Complete(exception);
+                });
+            }));
+
+        return result;
+    }
+
+    // a TaskResult completed once the delay has passed, e.g. to co_await
+    template<typename Rep, typename Period>
+    TaskResult<void>::ptr Delay(const std::chrono::duration<Rep, Period>& delay)
+    {
+        return Delay(delay, [] {});
+    }
+
+    /////////////////////////////////////////////////
+    /// function Every
+    /////////////////////////////////////////////////
+    /**
+    Run func on the executor every period, from now + period on, without drift, until cancelled.
+    A period is skipped while the previous call hasn't returned.
+
+    @param period.
+    @param func, void().
+    @param executor, nullptr for the current executor, otherwise the default one.
+    @return TaskResult<void>::ptr, completed by Cancel(), or by the first exception func throws,
+    which GetResult() rethrows. Without Cancel(), it runs as long as the process does.
+    */
+    template<typename Rep, typename Period, typename Function>
+    TaskResult<void>::ptr Every(const std::chrono::duration<Rep, Period>& period, Function&& func, iExecutor::ptr executor = nullptr)
+    {
+        auto state = std::make_shared<TimerDetails::TimerState>(
+            UniqueFunction<void()>(std::forward<Function>(func)), TimerDetails::ExecutorOrDefault(executor));
+
+        auto result = TaskResult<void>::New([state]() {
+            TimerService::Default().Cancel(state->GetTimer());
+            state->Complete();
+        });
+        state->Result = result;
+
+        const auto interval = std::chrono::duration_cast<TimerService::Clock::duration>(period);
+        state->SetTimer(TimerService::Default().Schedule(TimerService::Clock::now() + interval, interval, [state]() {
+            // stopped by an exception, the timer cancels itself
+            if (state->IsCompleted())
+            {
+                TimerService::Default().Cancel(state->GetTimer());
+                return;
+            }
+            if (!state->BeginRun())
+                return;
+
+            state->Executor->Post([state]() {
+                try
+                {
+                    state->Function();
+                }
+                catch (...)
+                {
+                    state->Complete(std::current_exception());
+                }
+                state->EndRun();
+            });
+        }));
+
+        return result;
+    }
+}
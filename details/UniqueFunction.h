@@ -0,0 +1,212 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace Async {
+
+    template<typename Signature, size_t InlineSize = 64>
+    class UniqueFunction;
+
+    /////////////////////////////////////////////////
+    /// class UniqueFunction
+    /////////////////////////////////////////////////
+    // a move-only std::function. The callable is kept in an inline buffer of InlineSize bytes
+    // if it fits and is nothrow-movable, otherwise on the heap. Move-only captures are allowed.
+    template<typename ReturnType, typename... Args, size_t InlineSize>
+    class UniqueFunction<ReturnType(Args...), InlineSize>
+    {
+    private:
+        typedef typename std::aligned_storage<InlineSize>::type Buffer;
+
+        struct Operations
+        {
+            ReturnType (*Invoke)(void *callable, Args&&... args);
+            void (*Move)(Buffer& from, Buffer& to); // move the callable and destroy the source
+            void (*Destroy)(Buffer& buffer);
+        };
+
+        template<typename Callable>
+        struct IsInline : std::integral_constant<bool,
+            sizeof(Callable) <= InlineSize &&
+            std::alignment_of<Callable>::value <= std::alignment_of<Buffer>::value &&
+            std::is_nothrow_move_constructible<Callable>::value>
+        {};
+
+    public:
+        UniqueFunction()
+            : m_operations(nullptr)
+        {}
+
+        UniqueFunction(std::nullptr_t)
+            : m_operations(nullptr)
+        {}
+
+        template<typename Callable,
+                 typename = typename std::enable_if<!std::is_same<typename std::decay<Callable>::type, UniqueFunction>::value>::type>
+        UniqueFunction(Callable&& callable)
+            : m_operations(nullptr)
+        {
+            Assign(std::forward<Callable>(callable));
+        }
+
+        UniqueFunction(UniqueFunction&& other) noexcept
+            : m_operations(other.m_operations)
+        {
+            if (m_operations)
+            {
+                m_operations->Move(other.m_buffer, m_buffer);
+                other.m_operations = nullptr;
+            }
+        }
+
+        ~UniqueFunction()
+        {
+            Reset();
+        }
+
+        UniqueFunction(const UniqueFunction&) = delete;
+        UniqueFunction & operator=(const UniqueFunction&) = delete;
+
+        UniqueFunction & operator=(UniqueFunction&& other) noexcept
+        {
+            if (this != &other)
+            {
+                Reset();
+                if (other.m_operations)
+                {
+                    other.m_operations->Move(other.m_buffer, m_buffer);
+                    m_operations = other.m_operations;
+                    other.m_operations = nullptr;
+                }
+            }
+            return *this;
+        }
+
+        UniqueFunction & operator=(std::nullptr_t)
+        {
+            Reset();
+            return *this;
+        }
+
+        ReturnType operator()(Args... args) const
+        {
+            if (!m_operations)
+                throw std::bad_function_call();
+
+            return m_operations->Invoke(const_cast<Buffer *>(&m_buffer), std::forward<Args>(args)...);
+        }
+
+        explicit operator bool() const
+        {
+            return m_operations != nullptr;
+        }
+
+        bool operator==(std::nullptr_t) const
+        {
+            return m_operations == nullptr;
+        }
+
+        bool operator!=(std::nullptr_t) const
+        {
+            return m_operations != nullptr;
+        }
+
+    private:
+        void Reset()
+        {
+            if (m_operations)
+            {
+                m_operations->Destroy(m_buffer);
+                m_operations = nullptr;
+            }
+        }
+
+        template<typename Callable>
+        void Assign(Callable&& callable)
+        {
+            typedef typename std::decay<Callable>::type CallableType;
+
+            if (IsNull(callable))
+                return;
+
+            Construct<CallableType>(std::forward<Callable>(callable), IsInline<CallableType>());
+        }
+
+        template<typename CallableType, typename Callable>
+        void Construct(Callable&& callable, std::true_type)
+        {
+            new (&m_buffer) CallableType(std::forward<Callable>(callable));
+            m_operations = InlineOperations<CallableType>();
+        }
+
+        template<typename CallableType, typename Callable>
+        void Construct(Callable&& callable, std::false_type)
+        {
+            *reinterpret_cast<CallableType **>(&m_buffer) = new CallableType(std::forward<Callable>(callable));
+            m_operations = HeapOperations<CallableType>();
+        }
+
+        // an empty std::function or a null function pointer makes an empty UniqueFunction
+        template<typename Callable>
+        static bool IsNull(const Callable&)
+        {
+            return false;
+        }
+
+        template<typename Signature>
+        static bool IsNull(const std::function<Signature>& callable)
+        {
+            return !callable;
+        }
+
+        template<typename Result, typename... Params>
+        static bool IsNull(Result (*callable)(Params...))
+        {
+            return callable == nullptr;
+        }
+
+        template<typename CallableType>
+        static const Operations * InlineOperations()
+        {
+            static const Operations operations = {
+                [](void *callable, Args&&... args) -> ReturnType {
+                    return (*static_cast<CallableType *>(callable))(std::forward<Args>(args)...);
+                },
+                [](Buffer& from, Buffer& to) {
+                    auto callable = reinterpret_cast<CallableType *>(&from);
+                    new (&to) CallableType(std::move(*callable));
+                    callable->~CallableType();
+                },
+                [](Buffer& buffer) {
+                    reinterpret_cast<CallableType *>(&buffer)->~CallableType();
+                }
+            };
+            return &operations;
+        }
+
+        template<typename CallableType>
+        static const Operations * HeapOperations()
+        {
+            static const Operations operations = {
+                [](void *buffer, Args&&... args) -> ReturnType {
+                    return (**static_cast<CallableType **>(buffer))(std::forward<Args>(args)...);
+                },
+                [](Buffer& from, Buffer& to) {
+                    *reinterpret_cast<CallableType **>(&to) = *reinterpret_cast<CallableType **>(&from);
+                },
+                [](Buffer& buffer) {
+                    delete *reinterpret_cast<CallableType **>(&buffer);
+                }
+            };
+            return &operations;
+        }
+
+    private:
+        Buffer m_buffer;
+        const Operations *m_operations;
+    };
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+
+namespace Async {
+
+    /////////////////////////////////////////////////
+    /// class AdaptiveSpin
+    /////////////////////////////////////////////////
+    // spin a while before parking, the spin limit adapts
+    // to how many spins the waited condition actually took recently
+    class AdaptiveSpin
+    {
+    public:
+        AdaptiveSpin(size_t maxSpins)
+            : m_maxSpins(maxSpins), m_adaptiveSpins(0)
+        {}
+
+        // return true if ready() became true while spinning
+        template<typename ReadyFunction>
+        bool Spin(ReadyFunction&& ready)
+        {
+            if (m_maxSpins == 0)
+                return false;
+
+            const size_t adaptiveSpins = m_adaptiveSpins.load(std::memory_order_relaxed);
+            const size_t spinLimit = std::min(m_maxSpins, adaptiveSpins * 2 + 10);
+
+            bool isReady = false;
+            size_t spins = 0;
+            for (; spins < spinLimit; spins++)
+            {
+                if (ready())
+                {
+                    isReady = true;
+                    break;
+                }
+                std::this_thread::yield();
+            }
+
+            m_adaptiveSpins.store(size_t(ptrdiff_t(adaptiveSpins) + (ptrdiff_t(spins) - ptrdiff_t(adaptiveSpins)) / 8),
+                std::memory_order_relaxed);
+            return isReady;
+        }
+
+    private:
+        const size_t m_maxSpins;
+        std::atomic<size_t> m_adaptiveSpins;
+    };
+
+    /////////////////////////////////////////////////
+    /// class ParkingLot
+    /////////////////////////////////////////////////
+    // park threads on a condition changed without the lock, e.g. the indices of a lock-free ring.
+    // Notify() only takes the lock when there are threads parked.
+    class ParkingLot
+    {
+    public:
+        ParkingLot()
+            : m_waiters(0)
+        {}
+
+        // call after the waited condition is changed
+        void Notify()
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_waiters.load(std::memory_order_relaxed) == 0)
+                return;
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_cv.notify_all();
+        }
+
+        template<typename ReadyFunction>
+        void Wait(ReadyFunction&& ready)
+        {
+            m_waiters.fetch_add(1, std::memory_order_seq_cst);
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, ready);
+            }
+            m_waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        // return ready() at the end, false on timeout
+        template<typename ReadyFunction>
+        bool WaitUntil(ReadyFunction&& ready, std::chrono::steady_clock::time_point deadline)
+        {
+            bool isReady = false;
+
+            m_waiters.fetch_add(1, std::memory_order_seq_cst);
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                isReady = m_cv.wait_until(lock, deadline, ready);
+            }
+            m_waiters.fetch_sub(1, std::memory_order_relaxed);
+
+            return isReady;
+        }
+
+    private:
+        std::atomic<int> m_waiters;
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+    };
+}
@@ -0,0 +1,472 @@
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "Executor.h"
+#include "Optional.h"
+#include "Task.h"
+#include "TaskHandle.h"
+
+namespace Async {
+
+    namespace WhenDetails {
+
+        template<size_t... Indices>
+        struct IndexSequence
+        {};
+
+        template<size_t Count, size_t... Indices>
+        struct MakeIndexSequence : MakeIndexSequence<Count - 1, Count - 1, Indices...>
+        {};
+
+        template<size_t... Indices>
+        struct MakeIndexSequence<0, Indices...>
+        {
+            typedef IndexSequence<Indices...> type;
+        };
+
+        inline iExecutor::ptr ExecutorOrDefault(iExecutor::ptr executor)
+        {
+            if (!executor)
+                executor = GetCurrentExecutor();
+            if (!executor)
+                executor = GetDefaultExecutor();
+            return executor;
+        }
+
+        // the callback runs on the thread completing the child, or inline if it has completed already
+        template<typename ChildType, typename Callback>
+        void WhenCompleted(const std::shared_ptr<ChildType>& child, const Callback& callback)
+        {
+            if (!child->OnCompleted(callback))
+                callback();
+        }
+
+        /////////////////////////////////////////////////
+        /// class Countdown
+        /////////////////////////////////////////////////
+        // the join of WhenAll: every child counts down once, the last one finishes the combined result
+        class Countdown
+        {
+        public:
+            explicit Countdown(size_t count)
+                : m_remaining(count), m_failed(false)
+            {}
+
+            // the first exception cancels the other children. Return true for the last child.
+            bool Complete(std::exception_ptr exception)
+            {
+                if (exception && !m_failed.exchange(true))
+                {
+                    m_exception = exception;
+                    CancelChildren();
+                }
+                return m_remaining.fetch_sub(1, std::memory_order_acq_rel) == 1;
+            }
+
+            void CancelChildren()
+            {
+                for (auto& child : Children)
+                    child->Cancel();
+            }
+
+            // filled before any child is watched, then only read
+            std::vector<iTaskHandle::ptr> Children;
+
+        protected:
+            // written by the first failing child, read by the last one after the countdown
+            std::exception_ptr m_exception;
+
+        private:
+            std::atomic<size_t> m_remaining;
+            std::atomic<bool> m_failed;
+        };
+
+        template<typename ReturnType>
+        struct AllResult
+        {
+            typedef std::vector<ReturnType> type;
+        };
+
+        template<>
+        struct AllResult<void>
+        {
+            typedef void type;
+        };
+
+        /////////////////////////////////////////////////
+        /// class AllState
+        /////////////////////////////////////////////////
+        template<typename ReturnType>
+        class AllState : public Countdown
+        {
+        public:
+            explicit AllState(size_t count)
+                : Countdown(count), m_values(count)
+            {}
+
+            // by the child of the index only
+            void Store(size_t index, TaskResult<ReturnType>& child)
+            {
+                m_values[index].Emplace(child.TakeResult());
+            }
+
+            void Finish()
+            {
+                if (m_exception)
+                {
+                    Result->SetException(m_exception);
+                }
+                else
+                {
+                    std::vector<ReturnType> values;
+                    values.reserve(m_values.size());
+                    for (auto& value : m_values)
+                        values.push_back(std::move(value.Get()));
+                    Result->SetValue(std::move(values));
+                }
+                Result->SetCompleted();
+            }
+
+            typename TaskResult<std::vector<ReturnType> >::ptr Result;
+
+        private:
+            std::vector<Optional<ReturnType> > m_values; // sized once, an Optional never moves
+        };
+
+        template<>
+        class AllState<void> : public Countdown
+        {
+        public:
+            explicit AllState(size_t count)
+                : Countdown(count)
+            {}
+
+            void Store(size_t, TaskResult<void>&)
+            {}
+
+            void Finish()
+            {
+                if (m_exception)
+                    Result->SetException(m_exception);
+                Result->SetCompleted();
+            }
+
+            TaskResult<void>::ptr Result;
+        };
+
+        /////////////////////////////////////////////////
+        /// class TupleState
+        /////////////////////////////////////////////////
+        template<typename... ReturnTypes>
+        class TupleState : public Countdown
+        {
+        public:
+            TupleState()
+                : Countdown(sizeof...(ReturnTypes))
+            {}
+
+            template<size_t Index, typename ReturnType>
+            void Store(TaskResult<ReturnType>& child)
+            {
+                std::get<Index>(m_values).Emplace(child.TakeResult());
+            }
+
+            void Finish()
+            {
+                if (m_exception)
+                    Result->SetException(m_exception);
+                else
+                    SetValue(typename MakeIndexSequence<sizeof...(ReturnTypes)>::type());
+                Result->SetCompleted();
+            }
+
+            typename TaskResult<std::tuple<ReturnTypes...> >::ptr Result;
+
+        private:
+            template<size_t... Indices>
+            void SetValue(IndexSequence<Indices...>)
+            {
+                Result->SetValue(std::tuple<ReturnTypes...>(std::move(std::get<Indices>(m_values).Get())...));
+            }
+
+        private:
+            std::tuple<Optional<ReturnTypes>...> m_values;
+        };
+
+        template<size_t Index, typename StateType, typename ChildType>
+        int WatchChild(const std::shared_ptr<StateType>& state, const std::shared_ptr<ChildType>& child)
+        {
+            WhenCompleted(child, [state, child] {
+                auto exception = child->GetException();
+                if (!exception)
+                    state->template Store<Index>(*child);
+                if (state->Complete(exception))
+                    state->Finish();
+            });
+            return 0;
+        }
+
+        template<typename StateType, typename ChildrenType, size_t... Indices>
+        void WatchChildren(const std::shared_ptr<StateType>& state, const ChildrenType& children, IndexSequence<Indices...>)
+        {
+            state->Children = std::vector<iTaskHandle::ptr>{ std::get<Indices>(children)... };
+
+            // the children are watched in order, once all of them are running
+            int expand[] = { 0, WatchChild<Indices>(state, std::get<Indices>(children))... };
+            (void)expand;
+        }
+
+        template<typename ReturnType>
+        struct AnyResult
+        {
+            typedef std::pair<size_t, ReturnType> type; // the index of the first task to return, and its return
+        };
+
+        template<>
+        struct AnyResult<void>
+        {
+            typedef size_t type; // the index of the first task to return
+        };
+
+        /////////////////////////////////////////////////
+        /// class AnyState
+        /////////////////////////////////////////////////
+        // the first child returning without exception wins and cancels the others.
+        // If all of them fail, the combined result rethrows the first exception.
+        template<typename ReturnType>
+        class AnyState
+        {
+        public:
+            typedef typename AnyResult<ReturnType>::type ResultType;
+
+        public:
+            explicit AnyState(size_t count)
+                : m_count(count), m_failures(0), m_failed(false), m_decided(false)
+            {}
+
+            void Complete(size_t index, TaskResult<ReturnType>& child)
+            {
+                auto exception = child.GetException();
+                if (!exception)
+                {
+                    if (m_decided.exchange(true))
+                        return;
+
+                    SetValue(index, child, std::is_void<ReturnType>());
+                    Result->SetCompleted();
+
+                    for (size_t i = 0; i < Children.size(); i++)
+                    {
+                        if (i != index)
+                            Children[i]->Cancel();
+                    }
+                    return;
+                }
+
+                if (!m_failed.exchange(true))
+                    m_exception = exception;
+
+                if (m_failures.fetch_add(1, std::memory_order_acq_rel) + 1 == m_count && !m_decided.exchange(true))
+                {
+                    Result->SetException(m_exception);
+                    Result->SetCompleted();
+                }
+            }
+
+            void CancelChildren()
+            {
+                for (auto& child : Children)
+                    child->Cancel();
+            }
+
+            // filled before any child is watched, then only read
+            std::vector<iTaskHandle::ptr> Children;
+            typename TaskResult<ResultType>::ptr Result;
+
+        private:
+            void SetValue(size_t index, TaskResult<ReturnType>& child, std::false_type)
+            {
+                Result->SetValue(ResultType(index, child.TakeResult()));
+            }
+
+            void SetValue(size_t index, TaskResult<ReturnType>&, std::true_type)
+            {
+                Result->SetValue(ResultType(index));
+            }
+
+        private:
+            const size_t m_count;
+            std::atomic<size_t> m_failures;
+            std::atomic<bool> m_failed;
+            std::atomic<bool> m_decided;
+            std::exception_ptr m_exception; // the first one, read by the last failing child
+        };
+
+        // the cancel function of the combined result. It doesn't keep the state alive,
+        // the state holds the result until the children have completed.
+        template<typename StateType>
+        UniqueFunction<void()> CancelFunction(const std::shared_ptr<StateType>& state)
+        {
+            std::weak_ptr<StateType> weakState = state;
+            return [weakState] {
+                if (auto state = weakState.lock())
+                    state->CancelChildren();
+            };
+        }
+    }
+
+    /////////////////////////////////////////////////
+    /// function WhenAll
+    /////////////////////////////////////////////////
+    /**
+    Run the tasks concurrently on the executor, and join them with a single atomic countdown:
+    the last task to complete fills the combined result, no thread blocks on the others.
+
+    @param tasks.
+    @param executor, nullptr for the current executor, otherwise the default one.
+    @return TaskResult<std::vector<ReturnType> >::ptr, the returns in the order of the tasks, or
+    TaskResult<void>::ptr for void tasks. The first exception thrown cancels the other tasks and is
+    rethrown by GetResult() once all of them have completed. Cancel() cancels all the tasks.
+    */
+    template<typename ReturnType>
+    typename TaskResult<typename WhenDetails::AllResult<ReturnType>::type>::ptr
+        WhenAll(std::vector<Task<ReturnType> > tasks, iExecutor::ptr executor = nullptr)
+    {
+        typedef WhenDetails::AllState<ReturnType> StateType;
+        typedef typename WhenDetails::AllResult<ReturnType>::type ResultType;
+
+        auto state = std::make_shared<StateType>(tasks.size());
+        state->Result = TaskResult<ResultType>::New(WhenDetails::CancelFunction(state));
+        auto result = state->Result;
+
+        if (tasks.empty())
+        {
+            state->Finish();
+            return result;
+        }
+
+        executor = WhenDetails::ExecutorOrDefault(executor);
+
+        std::vector<typename TaskResult<ReturnType>::ptr> children;
+        children.reserve(tasks.size());
+        state->Children.reserve(tasks.size());
+        for (auto& task : tasks)
+        {
+            children.push_back(task.Run(executor));
+            state->Children.push_back(children.back());
+        }
+
+        for (size_t i = 0; i < children.size(); i++)
+        {
+            auto child = children[i];
+            WhenDetails::WhenCompleted(child, [state, child, i] {
+                auto exception = child->GetException();
+                if (!exception)
+                    state->Store(i, *child);
+                if (state->Complete(exception))
+                    state->Finish();
+            });
+        }
+
+        return result;
+    }
+
+    // the returns of tasks of different types, as a tuple. The tasks can't return void.
+    template<typename... ReturnTypes>
+    typename TaskResult<std::tuple<ReturnTypes...> >::ptr
+        WhenAll(iExecutor::ptr executor, Task<ReturnTypes>... tasks)
+    {
+        static_assert(sizeof...(ReturnTypes) > 0, "WhenAll needs at least one task");
+
+        typedef WhenDetails::TupleState<ReturnTypes...> StateType;
+
+        auto state = std::make_shared<StateType>();
+        state->Result = TaskResult<std::tuple<ReturnTypes...> >::New(WhenDetails::CancelFunction(state));
+        auto result = state->Result;
+
+        executor = WhenDetails::ExecutorOrDefault(executor);
+
+        std::tuple<typename TaskResult<ReturnTypes>::ptr...> children(tasks.Run(executor)...);
+        WhenDetails::WatchChildren(state, children, typename WhenDetails::MakeIndexSequence<sizeof...(ReturnTypes)>::type());
+
+        return result;
+    }
+
+    template<typename ReturnType, typename... ReturnTypes>
+    typename TaskResult<std::tuple<ReturnType, ReturnTypes...> >::ptr
+        WhenAll(Task<ReturnType> task, Task<ReturnTypes>... tasks)
+    {
+        return WhenAll(iExecutor::ptr(), task, tasks...);
+    }
+
+    /////////////////////////////////////////////////
+    /// function WhenAny
+    /////////////////////////////////////////////////
+    /**
+    Run the tasks concurrently on the executor, and complete with the first one returning.
+    The other tasks are cancelled through their cancellation state, so they stop at their next check.
+
+    @param tasks, at least one.
+    @param executor, nullptr for the current executor, otherwise the default one.
+    @return TaskResult<std::pair<size_t, ReturnType> >::ptr, the index of the first task to return
+    and its return, or TaskResult<size_t>::ptr, the index, for void tasks. If all the tasks fail,
+    GetResult() rethrows the first exception. Cancel() cancels all the tasks.
+    */
+    template<typename ReturnType>
+    typename TaskResult<typename WhenDetails::AnyResult<ReturnType>::type>::ptr
+        WhenAny(std::vector<Task<ReturnType> > tasks, iExecutor::ptr executor = nullptr)
+    {
+        typedef WhenDetails::AnyState<ReturnType> StateType;
+        typedef typename StateType::ResultType ResultType;
+
+        if (tasks.empty())
+            throw std::invalid_argument("WhenAny needs at least one task");
+
+        auto state = std::make_shared<StateType>(tasks.size());
+        state->Result = TaskResult<ResultType>::New(WhenDetails::CancelFunction(state));
+        auto result = state->Result;
+
+        executor = WhenDetails::ExecutorOrDefault(executor);
+
+        std::vector<typename TaskResult<ReturnType>::ptr> children;
+        children.reserve(tasks.size());
+        state->Children.reserve(tasks.size());
+        for (auto& task : tasks)
+        {
+            children.push_back(task.Run(executor));
+            state->Children.push_back(children.back());
+        }
+
+        for (size_t i = 0; i < children.size(); i++)
+        {
+            auto child = children[i];
+            WhenDetails::WhenCompleted(child, [state, child, i] {
+                state->Complete(i, *child);
+            });
+        }
+
+        return result;
+    }
+
+    template<typename ReturnType, typename... Tasks>
+    typename TaskResult<typename WhenDetails::AnyResult<ReturnType>::type>::ptr
+        WhenAny(iExecutor::ptr executor, Task<ReturnType> task, Tasks... tasks)
+    {
+        return WhenAny(std::vector<Task<ReturnType> >{ task, tasks... }, executor);
+    }
+
+    template<typename ReturnType, typename... Tasks>
+    typename TaskResult<typename WhenDetails::AnyResult<ReturnType>::type>::ptr
+        WhenAny(Task<ReturnType> task, Tasks... tasks)
+    {
+        return WhenAny(iExecutor::ptr(), task, tasks...);
+    }
+}
@@ -0,0 +1,379 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "Executor.h"
+#include "ThreadLocal.h"
+#include "UniqueFunction.h"
+
+namespace Async {
+
+    /////////////////////////////////////////////////
+    /// class WorkStealingDeque
+    /////////////////////////////////////////////////
+    // Chase-Lev deque, the owner thread pushes and pops at the bottom (LIFO),
+    // other threads steal from the top (FIFO).
+    template<typename ItemType>
+    class WorkStealingDeque
+    {
+    private:
+        struct Array
+        {
+            Array(int64_t capacity)
+                : Capacity(capacity), Items(new std::atomic<ItemType *>[capacity])
+            {}
+
+            ~Array()
+            {
+                delete[] Items;
+            }
+
+            ItemType * Get(int64_t index) const
+            {
+                return Items[index & (Capacity - 1)].load(std::memory_order_relaxed);
+            }
+
+            void Put(int64_t index, ItemType *item)
+            {
+                Items[index & (Capacity - 1)].store(item, std::memory_order_relaxed);
+            }
+
+            Array * Grow(int64_t bottom, int64_t top) const
+            {
+                auto newArray = new Array(Capacity * 2);
+                for (int64_t i = top; i < bottom; i++)
+                    newArray->Put(i, Get(i));
+                return newArray;
+            }
+
+            const int64_t Capacity; // always power of 2
+            std::atomic<ItemType *> *Items;
+        };
+
+    public:
+        WorkStealingDeque(int64_t capacity = 256)
+            : m_top(0), m_bottom(0), m_array(new Array(capacity))
+        {}
+
+        ~WorkStealingDeque()
+        {
+            delete m_array.load(std::memory_order_relaxed);
+            for (auto array : m_retiredArrays)
+                delete array;
+        }
+
+        WorkStealingDeque(const WorkStealingDeque&) = delete;
+        WorkStealingDeque & operator=(const WorkStealingDeque&) = delete;
+
+        // owner thread only
+        void Push(ItemType *item)
+        {
+            auto bottom = m_bottom.load(std::memory_order_relaxed);
+            auto top = m_top.load(std::memory_order_acquire);
+            auto array = m_array.load(std::memory_order_relaxed);
+
+            if (bottom - top > array->Capacity - 1)
+            {
+                // thieves may still read the old array, so it is retired instead of deleted
+                m_retiredArrays.push_back(array);
+                array = array->Grow(bottom, top);
+                m_array.store(array, std::memory_order_release);
+            }
+
+            array->Put(bottom, item);
+            std::atomic_thread_fence(std::memory_order_release);
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+        }
+
+        // owner thread only, return nullptr if empty
+        ItemType * Pop()
+        {
+            auto bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+            auto array = m_array.load(std::memory_order_relaxed);
+            m_bottom.store(bottom, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            auto top = m_top.load(std::memory_order_relaxed);
+
+            if (top > bottom) // empty
+            {
+                m_bottom.store(bottom + 1, std::memory_order_relaxed);
+                return nullptr;
+            }
+
+            auto item = array->Get(bottom);
+            if (top == bottom) // the last one, race with thieves
+            {
+                if (!m_top.compare_exchange_strong(top, top + 1,
+                    std::memory_order_seq_cst, std::memory_order_relaxed))
+                    item = nullptr;
+                m_bottom.store(bottom + 1, std::memory_order_relaxed);
+            }
+            return item;
+        }
+
+        // any thread, return nullptr if empty or lost the race
+        ItemType * Steal()
+        {
+            auto top = m_top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            auto bottom = m_bottom.load(std::memory_order_acquire);
+
+            if (top >= bottom)
+                return nullptr;
+
+            auto array = m_array.load(std::memory_order_acquire);
+            auto item = array->Get(top);
+            if (!m_top.compare_exchange_strong(top, top + 1,
+                std::memory_order_seq_cst, std::memory_order_relaxed))
+                return nullptr;
+            return item;
+        }
+
+        bool IsEmpty() const
+        {
+            return m_top.load(std::memory_order_acquire) >= m_bottom.load(std::memory_order_acquire);
+        }
+
+    private:
+        std::atomic<int64_t> m_top;
+        std::atomic<int64_t> m_bottom;
+        std::atomic<Array *> m_array;
+        std::vector<Array *> m_retiredArrays;
+    };
+
+    /////////////////////////////////////////////////
+    /// class WorkStealingExecutor
+    /////////////////////////////////////////////////
+    class WorkStealingExecutor : public iExecutor
+    {
+    private:
+        typedef UniqueFunction<void()> Work;
+
+        struct State;
+
+        struct Worker
+        {
+            Worker(State *state, size_t index)
+                : Owner(state), Index(index), Seed(uint32_t(index) * 2654435761u + 1)
+            {}
+
+            State *Owner;
+            size_t Index;
+            uint32_t Seed; // for picking a random victim
+            WorkStealingDeque<Work> Deque;
+        };
+
+        // shared with worker threads, so the pool can still be
+        // released from inside one of its own workers
+        struct State
+        {
+            State() : Stopped(false), Epoch(0), Sleepers(0)
+            {}
+
+            ~State()
+            {
+                for (auto worker : Workers)
+                {
+                    while (auto work = worker->Deque.Pop())
+                        delete work;
+                    delete worker;
+                }
+                for (auto work : Injected)
+                    delete work;
+            }
+
+            std::weak_ptr<iExecutor> Executor;
+            std::vector<Worker *> Workers;
+
+            // works posted from outside of the workers
+            std::deque<Work *> Injected;
+            std::mutex InjectedMutex;
+
+            // idle workers park here
+            bool Stopped;
+            std::atomic<uint64_t> Epoch;
+            std::atomic<int> Sleepers;
+            std::mutex SleepMutex;
+            std::condition_variable SleepCV;
+        };
+
+    public:
+        virtual ~WorkStealingExecutor()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_state->SleepMutex);
+                m_state->Stopped = true;
+            }
+            m_state->SleepCV.notify_all();
+
+            // the rest of queued works are still run before the workers exit
+            for (auto& thread : m_threads)
+            {
+                if (thread.get_id() == std::this_thread::get_id())
+                    thread.detach();
+                else if (thread.joinable())
+                    thread.join();
+            }
+        }
+
+        /**
+        New a work-stealing thread pool.
+
+        @param threadCount, 0 means std::thread::hardware_concurrency().
+        @return iExecutor::ptr.
+        */
+        static iExecutor::ptr New(size_t threadCount = 0)
+        {
+            if (threadCount == 0)
+                threadCount = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+
+            auto executor = new WorkStealingExecutor();
+            auto executorPtr = iExecutor::ptr(executor);
+            executor->Start(threadCount, executorPtr);
+
+            return executorPtr;
+        }
+
+        // works posted from one of the workers go to its own deque
+        virtual void Post(UniqueFunction<void()> work)
+        {
+            auto newWork = new Work(std::move(work));
+
+            auto worker = *CurrentWorker();
+            if (worker && worker->Owner == m_state.get())
+            {
+                worker->Deque.Push(newWork);
+            }
+            else
+            {
+                std::lock_guard<std::mutex> lock(m_state->InjectedMutex);
+                m_state->Injected.push_back(newWork);
+            }
+
+            m_state->Epoch.fetch_add(1);
+            if (m_state->Sleepers.load() > 0)
+            {
+                std::lock_guard<std::mutex> lock(m_state->SleepMutex);
+                m_state->SleepCV.notify_one();
+            }
+        }
+
+    private:
+        // force to always init using New()
+        WorkStealingExecutor()
+            : m_state(std::make_shared<State>())
+        {}
+
+        void Start(size_t threadCount, iExecutor::ptr self)
+        {
+            m_state->Executor = self;
+
+            for (size_t i = 0; i < threadCount; i++)
+                m_state->Workers.push_back(new Worker(m_state.get(), i));
+
+            m_threads.reserve(threadCount);
+            for (size_t i = 0; i < threadCount; i++)
+                m_threads.emplace_back(&WorkStealingExecutor::WorkerLoop, m_state, i);
+        }
+
+        static Worker ** CurrentWorker()
+        {
+            static THREAD_LOCAL Worker *worker = nullptr;
+
+            return &worker;
+        }
+
+        static Work * FindWork(State& state, Worker& worker)
+        {
+            if (auto work = worker.Deque.Pop())
+                return work;
+
+            {
+                std::lock_guard<std::mutex> lock(state.InjectedMutex);
+                if (!state.Injected.empty())
+                {
+                    auto work = state.Injected.front();
+                    state.Injected.pop_front();
+                    return work;
+                }
+            }
+
+            const size_t count = state.Workers.size();
+            worker.Seed ^= worker.Seed << 13;
+            worker.Seed ^= worker.Seed >> 17;
+            worker.Seed ^= worker.Seed << 5;
+            const size_t start = worker.Seed % count;
+            for (size_t i = 0; i < count; i++)
+            {
+                auto victim = state.Workers[(start + i) % count];
+                if (victim == &worker)
+                    continue;
+
+                if (auto work = victim->Deque.Steal())
+                    return work;
+            }
+            return nullptr;
+        }
+
+        static bool HasWork(State& state)
+        {
+            {
+                std::lock_guard<std::mutex> lock(state.InjectedMutex);
+                if (!state.Injected.empty())
+                    return true;
+            }
+            for (auto worker : state.Workers)
+            {
+                if (!worker->Deque.IsEmpty())
+                    return true;
+            }
+            return false;
+        }
+
+        static void WorkerLoop(std::shared_ptr<State> state, size_t index)
+        {
+            auto& worker = *state->Workers[index];
+            *CurrentWorker() = &worker;
+            *ExecutorDetails::CurrentExecutor() = &state->Executor;
+
+            while (true)
+            {
+                auto epoch = state->Epoch.load();
+
+                if (auto work = FindWork(*state, worker))
+                {
+                    (*work)();
+                    delete work;
+                    continue;
+                }
+
+                // lost a steal race, try again
+                if (HasWork(*state))
+                    continue;
+
+                bool stopped = false;
+                state->Sleepers.fetch_add(1);
+                {
+                    std::unique_lock<std::mutex> lock(state->SleepMutex);
+                    state->SleepCV.wait(lock, [&state, epoch] {
+                        return state->Stopped || state->Epoch.load() != epoch;
+                    });
+                    stopped = state->Stopped;
+                }
+                state->Sleepers.fetch_sub(1);
+
+                if (stopped && !HasWork(*state))
+                    break;
+            }
+
+            *ExecutorDetails::CurrentExecutor() = nullptr;
+            *CurrentWorker() = nullptr;
+        }
+
+    private:
+        std::shared_ptr<State> m_state;
+        std::vector<std::thread> m_threads;
+    };
+}
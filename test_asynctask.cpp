@@ -1,12 +1,89 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <set>
 #include <string>
 #include <iostream>
+#include <mutex>
 #include <sstream>
+#include <stdexcept>
 
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/test/unit_test.hpp>
 
 #include "Async.h"
 
+// an inlined new or delete exposes the malloc/free pair to gcc, which then
+// reports the library's new/delete pairs as mismatched
+#if defined(__GNUC__)
+#define ASYNC_TEST_NOINLINE __attribute__((noinline))
+#else
+#define ASYNC_TEST_NOINLINE
+#endif
+
+// counts every heap allocation of the test program. The array and nothrow forms are replaced
+// together with the plain ones, so every new is paired with the delete freeing its memory.
+// The aligned forms are left to the library, they allocate and free on their own.
+static std::atomic<size_t> g_allocationCount(0);
+
+ASYNC_TEST_NOINLINE void * operator new(std::size_t size)
+{
+    g_allocationCount++;
+    if (void *memory = std::malloc(size ? size : 1))
+        return memory;
+    throw std::bad_alloc();
+}
+
+ASYNC_TEST_NOINLINE void * operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    g_allocationCount++;
+    return std::malloc(size ? size : 1);
+}
+
+ASYNC_TEST_NOINLINE void * operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+ASYNC_TEST_NOINLINE void * operator new[](std::size_t size, const std::nothrow_t& nothrow) noexcept
+{
+    return operator new(size, nothrow);
+}
+
+ASYNC_TEST_NOINLINE void operator delete(void *memory) noexcept
+{
+    std::free(memory);
+}
+
+ASYNC_TEST_NOINLINE void operator delete(void *memory, const std::nothrow_t&) noexcept
+{
+    std::free(memory);
+}
+
+ASYNC_TEST_NOINLINE void operator delete[](void *memory) noexcept
+{
+    std::free(memory);
+}
+
+ASYNC_TEST_NOINLINE void operator delete[](void *memory, const std::nothrow_t&) noexcept
+{
+    std::free(memory);
+}
+
+#if defined(__cpp_sized_deallocation)
+ASYNC_TEST_NOINLINE void operator delete(void *memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
+ASYNC_TEST_NOINLINE void operator delete[](void *memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+#endif
+
 struct TestAsyncLibraryFixture {
     ~TestAsyncLibraryFixture() {
     }
@@ -85,6 +162,114 @@ BOOST_AUTO_TEST_CASE(TestAsyncTask_WithoutThenGet) {
     BOOST_REQUIRE(expectResults == testResults);
 }
 
+BOOST_AUTO_TEST_CASE(TestAsyncTask_NestedSync) {
+    // test Async::Task running inline in sync mode, nested in another sync task
+    std::vector<std::string> expectResults{
+        "Outer: before",
+        "Inner: inner",
+        "Inner: cancelled",
+        "Outer: after",
+        "Outer: not cancelled"
+    };
+    std::vector<std::string> testResults;
+
+    const auto callerThread = std::this_thread::get_id();
+
+    Async::Spawn([&testResults, callerThread] {
+        BOOST_REQUIRE(std::this_thread::get_id() == callerThread);
+        Async::Notify(std::string("before"));
+
+        Async::Spawn([] {
+            Async::Notify(std::string("inner"));
+            Async::Cancel::CancelCurrentTask();
+            if (Async::Cancel::IsCancelled())
+                Async::Notify(std::string("cancelled"));
+        }).Notified<std::string>([&testResults](const std::string& a) {
+            testResults.push_back("Inner: " + a);
+        }).Run(Async::RunMode::RunMode_Sync);
+
+        Async::Notify(std::string("after"));
+        if (!Async::Cancel::IsCancelled())
+            Async::Notify(std::string("not cancelled"));
+    }).Notified<std::string>([&testResults](const std::string& a) {
+        testResults.push_back("Outer: " + a);
+    }).Run(Async::RunMode::RunMode_Sync);
+
+    BOOST_REQUIRE(expectResults == testResults);
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncTask_Executor) {
+    // test Async::Task running on a shared thread pool
+    auto executor = Async::ThreadPoolExecutor::New(2);
+
+    std::atomic<int> counter(0);
+    std::vector<Async::iTaskHandle::ptr> taskHandles;
+    for (int i = 0; i < 100; i++)
+    {
+        taskHandles.push_back(Async::Spawn([] {
+            return 1;
+        }).Get([&counter](int i) {
+            counter += i;
+        }).Run(executor));
+    }
+
+    for (auto& taskHandle : taskHandles)
+        taskHandle->Join();
+
+    BOOST_REQUIRE_EQUAL(counter.load(), 100);
+
+    // test the process-wide default executor
+    Async::SetDefaultExecutor(executor);
+    Async::Spawn([&counter] {
+        counter++;
+    }).Run(Async::RunMode::RunMode_Sync);
+    Async::SetDefaultExecutor(nullptr);
+
+    BOOST_REQUIRE_EQUAL(counter.load(), 101);
+
+    // a task waiting on its child doesn't deadlock a 1-thread pool, the wait runs the child
+    auto singleThread = Async::ThreadPoolExecutor::New(1);
+    auto nested = Async::Spawn([] {
+        auto child = Async::Spawn([] {
+            return 1;
+        }).Run();
+        child->Join();
+
+        auto grandChild = Async::Spawn([] {
+            return Async::Spawn([] {
+                return 2;
+            }).Run()->GetResult();
+        }).Run();
+        return child->GetResult() + grandChild->GetResult();
+    }).Run(singleThread);
+    BOOST_REQUIRE(nested->WaitFor(std::chrono::seconds(5)));
+    BOOST_REQUIRE_EQUAL(nested->GetResult(), 3);
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncTask_WorkStealingExecutor) {
+    // test Async::Task spawned from inside of a running task
+    auto executor = Async::WorkStealingExecutor::New(4);
+
+    const int taskCount = 1000;
+    std::atomic<int> counter(0);
+    std::promise<void> allDone;
+
+    Async::Spawn([&counter, &allDone, taskCount] {
+        for (int i = 0; i < taskCount; i++)
+        {
+            // goes to the local deque of the current worker
+            Async::Spawn([&counter, &allDone, taskCount] {
+                if (++counter == taskCount)
+                    allDone.set_value();
+            }).Run();
+        }
+    }).Run(executor);
+
+    allDone.get_future().wait();
+
+    BOOST_REQUIRE_EQUAL(counter.load(), taskCount);
+}
+
 BOOST_AUTO_TEST_CASE(TestAsyncObserveTaskReceiveOne) {
     // test Async::ObserveTask::ReceiveOne
     std::vector<std::string> expectResults{
@@ -349,4 +534,1681 @@ BOOST_AUTO_TEST_CASE(TestAsyncObserveQueueClose) {
     BOOST_REQUIRE(expectResults == testResults);
 }
 
+BOOST_AUTO_TEST_CASE(TestAsyncObserveQueueLimitation) {
+    // test Async::ObservableQueue with limitation, producers wait for the free capacity
+    std::vector<int> expectResults;
+    for (int i = 0; i < 20; i++)
+        expectResults.push_back(i);
+    std::vector<int> testResults;
+
+    auto queue = Async::ObservableQueue<int>::New(nullptr, 2);
+    auto taskHandle = Async::Observe(
+        queue
+    ).ReceiveOne([&testResults](int k) {
+        testResults.push_back(k);
+    }).Run();
+
+    // the batch is bigger than the limitation
+    queue->PushSome(std::vector<int>(expectResults.begin(), expectResults.begin() + 15));
+    for (int i = 15; i < 20; i++)
+        queue->PushOne(i);
+
+    queue->Close();
+    taskHandle->Join();
+
+    BOOST_REQUIRE(expectResults == testResults);
+
+    // many producers waiting on the same full queue
+    std::atomic<int> received(0);
+    auto sharedQueue = Async::ObservableQueue<int>::New(nullptr, 2);
+    taskHandle = Async::Observe(
+        sharedQueue
+    ).ReceiveOne([&received](int) {
+        received++;
+    }).Run();
+
+    std::vector<std::thread> producers;
+    for (int i = 0; i < 4; i++)
+    {
+        producers.emplace_back([sharedQueue] {
+            for (int k = 0; k < 1000; k++)
+                sharedQueue->PushOne(k);
+        });
+    }
+    for (auto& producer : producers)
+        producer.join();
+
+    sharedQueue->Close();
+    taskHandle->Join();
+
+    BOOST_REQUIRE_EQUAL(received.load(), 4000);
+
+    // a full queue without consumer, Close() and Cancel() wake the waiting producers up
+    auto fullQueue = Async::ObservableQueue<int>::New(nullptr, 1);
+    fullQueue->PushOne(0);
+
+    auto producer = Async::Spawn([fullQueue] {
+        fullQueue->PushOne(1);
+    }).Run(Async::DedicatedThreadExecutor::New());
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    producer->Cancel();
+    producer->Join();
+
+    std::thread closeProducer([fullQueue] {
+        fullQueue->PushSome(std::vector<int>({ 1, 2 }));
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    fullQueue->Close();
+    closeProducer.join();
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncObserveQueueWakeup) {
+    // test an idle ObserveTask is woken up by Cancel() and Close(), without polling
+    std::vector<std::string> testResults;
+
+    auto queue = Async::ObservableQueue<std::string>::New();
+    auto taskHandle = Async::Observe(
+        queue
+    ).ReceiveOne([&testResults](const std::string& k) {
+        testResults.push_back(k);
+    }).Then([&testResults] {
+        testResults.push_back("Then");
+    }).Run();
+
+    taskHandle->Cancel();
+    taskHandle->Join();
+
+    BOOST_REQUIRE(testResults.empty());
+
+    // spin before parking
+    auto spinQueue = Async::ObservableQueue<std::string>::New(nullptr, SIZE_MAX, 1000);
+    taskHandle = Async::Observe(
+        spinQueue
+    ).ReceiveSome([&testResults](const std::vector<std::string>& k) {
+        testResults.insert(testResults.end(), k.begin(), k.end());
+    }).Run();
+
+    spinQueue->PushOne("abcd");
+    spinQueue->PushSome(std::vector<std::string>({ "efgh", "ijkl" }));
+    spinQueue->Close();
+    taskHandle->Join();
+
+    BOOST_REQUIRE(testResults == std::vector<std::string>({ "abcd", "efgh", "ijkl" }));
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncObserveSpscQueue) {
+    // test Async::ObservableQueue with SpscPolicy, smaller than the pushed objects
+    const int objectCount = 10000;
+    std::vector<int> testResults;
+
+    auto queue = Async::ObservableQueue<int, Async::SpscPolicy>::New(nullptr, 64);
+    auto taskHandle = Async::Observe(
+        queue
+    ).ReceiveOne([&testResults](int k) {
+        testResults.push_back(k);
+    }).Run();
+
+    // pushed in order, alternately one by one and in batches of 100
+    std::vector<int> objects;
+    for (int i = 0; i < objectCount; i++)
+    {
+        if ((i / 100) % 2 == 0)
+            queue->PushOne(i);
+        else
+            objects.push_back(i);
+
+        if (objects.size() == 100)
+        {
+            queue->PushSome(objects);
+            objects.clear();
+        }
+    }
+    queue->Close();
+    taskHandle->Join();
+
+    // one producer and one consumer keep the FIFO order
+    BOOST_REQUIRE_EQUAL(testResults.size(), size_t(objectCount));
+    for (int i = 0; i < objectCount; i++)
+        BOOST_REQUIRE_EQUAL(testResults[i], i);
+
+    // ReceiveSome, woken up by Cancel()
+    auto someQueue = Async::ObservableQueue<std::string, Async::SpscPolicy>::New();
+    std::vector<std::string> someResults;
+    taskHandle = Async::Observe(
+        someQueue
+    ).ReceiveSome([&someResults](const std::vector<std::string>& k) {
+        someResults.insert(someResults.end(), k.begin(), k.end());
+    }).Run();
+
+    someQueue->PushSome(std::vector<std::string>({ "abcd", "efgh" }));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    taskHandle->Cancel();
+    taskHandle->Join();
+
+    BOOST_REQUIRE(someResults == std::vector<std::string>({ "abcd", "efgh" }));
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncObserveMpmcQueue) {
+    // test Async::ObservableQueue with MpmcPolicy, many producers and many consumers
+    const int producerCount = 4;
+    const int consumerCount = 3;
+    const int objectCount = 5000; // per producer
+
+    auto queue = Async::ObservableQueue<int, Async::MpmcPolicy>::New(nullptr, 16);
+
+    std::atomic<long long> sum(0);
+    std::atomic<int> received(0);
+    std::vector<std::thread> consumers;
+    for (int i = 0; i < consumerCount; i++)
+    {
+        consumers.emplace_back([queue, &sum, &received] {
+            int obj = 0;
+            while (queue->PopOne(obj).IsSuccess())
+            {
+                sum += obj;
+                received++;
+            }
+        });
+    }
+
+    std::vector<std::thread> producers;
+    for (int i = 0; i < producerCount; i++)
+    {
+        producers.emplace_back([queue, objectCount] {
+            for (int k = 1; k <= objectCount; k++)
+            {
+                if (k % 10 == 0)
+                    queue->PushSome(std::vector<int>({ k }));
+                else
+                    queue->PushOne(k);
+            }
+        });
+    }
+
+    for (auto& producer : producers)
+        producer.join();
+    queue->Close();
+    for (auto& consumer : consumers)
+        consumer.join();
+
+    BOOST_REQUIRE_EQUAL(received.load(), producerCount * objectCount);
+    BOOST_REQUIRE_EQUAL(sum.load(), (long long)producerCount * objectCount * (objectCount + 1) / 2);
+
+    // ObserveTask on it
+    auto observedQueue = Async::ObservableQueue<std::string, Async::MpmcPolicy>::New();
+    std::vector<std::string> testResults;
+    auto taskHandle = Async::Observe(
+        observedQueue
+    ).ReceiveOne([&testResults](const std::string& k) {
+        testResults.push_back(k);
+    }).Run();
+
+    observedQueue->PushSome(std::vector<std::string>({ "abcd", "efgh" }));
+    observedQueue->PushOne("ijkl");
+    observedQueue->Close();
+    taskHandle->Join();
+
+    BOOST_REQUIRE(testResults == std::vector<std::string>({ "abcd", "efgh", "ijkl" }));
+
+    // a throwing constructor or consume doesn't wedge the ring, over several laps
+    struct Checked
+    {
+        explicit Checked(int value) : Value(value)
+        {
+            if (value < 0)
+                throw std::runtime_error("constructor");
+        }
+        int Value;
+    };
+    auto checkedQueue = Async::ObservableQueue<Checked, Async::MpmcPolicy>::New(nullptr, 2);
+    for (int lap = 0; lap < 8; lap++)
+    {
+        BOOST_REQUIRE_THROW(checkedQueue->Emplace(-1), std::runtime_error);
+        checkedQueue->Emplace(lap);
+        BOOST_REQUIRE_THROW(checkedQueue->ConsumeOne([](Checked&&) {
+            throw std::runtime_error("consume");
+        }), std::runtime_error);
+
+        checkedQueue->Emplace(lap);
+        int value = -1;
+        BOOST_REQUIRE(checkedQueue->ConsumeOne([&value](Checked&& checked) {
+            value = checked.Value;
+        }).IsSuccess());
+        BOOST_REQUIRE_EQUAL(value, lap);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncObserveMoveOnly) {
+    // test move-only objects through Async::ObservableQueue and ReceiveOne/ReceiveSome
+    typedef std::unique_ptr<std::string> Message;
+
+    std::vector<std::string> testResults;
+
+    auto queue = Async::ObservableQueue<Message>::New();
+    auto taskHandle = Async::Observe(
+        queue
+    ).ReceiveOne([](Message message) {
+        return message;
+    }).Get([&testResults](Message message) {
+        testResults.push_back(*message);
+    }).Run();
+
+    queue->PushOne(Message(new std::string("abcd")));
+    queue->Emplace(new std::string("efgh"));
+
+    std::vector<Message> messages;
+    messages.emplace_back(new std::string("ijkl"));
+    messages.emplace_back(new std::string("mnop"));
+    queue->PushSome(std::move(messages));
+
+    queue->Close();
+    taskHandle->Join();
+
+    BOOST_REQUIRE(testResults == std::vector<std::string>({ "abcd", "efgh", "ijkl", "mnop" }));
+
+    // not default-constructible, on a ring
+    struct Point
+    {
+        Point(int x, int y) : X(x), Y(y) {}
+        Point(Point&&) = default;
+        int X, Y;
+    };
+
+    int sum = 0;
+    auto ringQueue = Async::ObservableQueue<Point, Async::MpmcPolicy>::New();
+    taskHandle = Async::Observe(
+        ringQueue
+    ).ReceiveSome([&sum](std::vector<Point> points) {
+        for (auto& point : points)
+            sum += point.X * point.Y;
+    }).Run();
+
+    ringQueue->Emplace(2, 3);
+    ringQueue->PushOne(Point(4, 5));
+    ringQueue->Close();
+    taskHandle->Join();
+
+    BOOST_REQUIRE_EQUAL(sum, 26);
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncObserveRecycledBatch)
+{
+    // PopOne and PopSome mixed on one double buffer
+    auto queue = Async::ObservableQueue<int, Async::DoubleBufferPolicy>::New();
+    queue->PushSome(std::vector<int>({ 1, 2, 3 }));
+
+    int first = 0;
+    BOOST_REQUIRE(queue->PopOne(first).IsSuccess());
+    BOOST_REQUIRE_EQUAL(first, 1);
+
+    queue->PushOne(4);
+    std::vector<int> batch;
+    BOOST_REQUIRE(queue->PopSome(batch).IsSuccess());
+    BOOST_REQUIRE(batch == std::vector<int>({ 2, 3, 4 }));
+
+    // the batches handed to ReceiveSome are swapped back and forth, no new buffer once warmed up
+    queue = Async::ObservableQueue<int, Async::DoubleBufferPolicy>::New();
+
+    std::atomic<int> handled(0);
+    std::set<const int *> buffers;
+    int sum = 0;
+    auto taskHandle = Async::Observe(
+        queue
+    ).ReceiveSome([&](const std::vector<int>& objects) {
+        if (handled.load() >= 4)
+            buffers.insert(objects.data());
+        for (auto object : objects)
+            sum += object;
+        handled++;
+    }).Run();
+
+    for (int round = 0; round < 20; round++)
+    {
+        queue->PushSome(std::vector<int>(8, 1));
+        while (handled.load() <= round)
+            std::this_thread::yield();
+    }
+
+    queue->Close();
+    taskHandle->Join();
+
+    BOOST_REQUIRE_EQUAL(sum, 160);
+    BOOST_REQUIRE(buffers.size() <= 2);
+
+    // a steady PopOne load which never drains the buffer keeps it bounded
+    Async::DoubleBufferStorage<int> storage;
+    for (int i = 0; i < 3; i++)
+        storage.Emplace(i);
+    int popped = 0;
+    for (int i = 3; i < 100000; i++)
+    {
+        storage.Emplace(i);
+        storage.ConsumeFront([&popped](int&& object) {
+            BOOST_REQUIRE_EQUAL(object, popped);
+            popped++;
+        });
+    }
+    BOOST_REQUIRE_EQUAL(storage.Size(), 3u);
+    BOOST_REQUIRE(storage.Capacity() <= 16);
+
+    // so does a size-bounded PopSome load
+    std::vector<int> partial;
+    for (int i = 0; i < 100000; i++)
+    {
+        storage.Emplace(popped + 3);
+        storage.Emplace(popped + 4);
+        partial.clear();
+        storage.MoveSomeTo(partial, 2);
+        BOOST_REQUIRE(partial == std::vector<int>({ popped, popped + 1 }));
+        popped += 2;
+    }
+    BOOST_REQUIRE_EQUAL(storage.Size(), 3u);
+    BOOST_REQUIRE(storage.Capacity() <= 16);
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncObserveLingerBatch)
+{
+    // bounded by maxBatch, the last one is handed over when the queue is closed
+    std::vector<size_t> lockedBatches;
+    auto queue = Async::ObservableQueue<int>::New();
+    queue->PushSome(std::vector<int>(7, 1));
+
+    auto taskHandle = Async::Observe(
+        queue
+    ).ReceiveSome([&lockedBatches](const std::vector<int>& objects) {
+        lockedBatches.push_back(objects.size());
+    }, 3, std::chrono::seconds(10)).Run();
+
+    queue->Close();
+    taskHandle->Join();
+
+    BOOST_REQUIRE(lockedBatches == std::vector<size_t>({ 3, 3, 1 }));
+
+    std::vector<size_t> ringBatches;
+    auto ringQueue = Async::ObservableQueue<int, Async::MpmcPolicy>::New();
+    ringQueue->PushSome(std::vector<int>(7, 1));
+
+    taskHandle = Async::Observe(
+        ringQueue
+    ).ReceiveSome([&ringBatches](const std::vector<int>& objects) {
+        ringBatches.push_back(objects.size());
+    }, 3, std::chrono::seconds(10)).Run();
+
+    ringQueue->Close();
+    taskHandle->Join();
+
+    BOOST_REQUIRE(ringBatches == std::vector<size_t>({ 3, 3, 1 }));
+
+    // bounded by maxLinger, the objects pushed meanwhile join the batch
+    std::promise<size_t> batchSize;
+    queue = Async::ObservableQueue<int>::New();
+
+    taskHandle = Async::Observe(
+        queue
+    ).ReceiveSome([&batchSize](const std::vector<int>& objects) {
+        batchSize.set_value(objects.size());
+    }, 100, std::chrono::milliseconds(100)).Run();
+
+    auto start = std::chrono::steady_clock::now();
+    queue->PushOne(1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    queue->PushOne(2);
+
+    BOOST_REQUIRE_EQUAL(batchSize.get_future().get(), 2u);
+    BOOST_REQUIRE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(100));
+
+    queue->Close();
+    taskHandle->Join();
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncObserveParallel)
+{
+    std::atomic<int> beginCount(0), endCount(0), sum(0);
+    std::mutex threadIdsMutex;
+    std::set<std::thread::id> threadIds;
+
+    auto queue = Async::ObservableQueue<int>::New();
+    auto taskHandle = Async::Observe(
+        queue
+    ).ReceiveOne([&](int object) {
+        {
+            std::lock_guard<std::mutex> lock(threadIdsMutex);
+            threadIds.insert(std::this_thread::get_id());
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return object;
+    }).Get([&sum](int object) {
+        sum += object;
+    }).OnBegin([&beginCount] {
+        beginCount++;
+    }).OnEnd([&beginCount, &endCount] {
+        BOOST_REQUIRE_EQUAL(beginCount.load(), 1);
+        endCount++;
+    }).Run(4);
+
+    for (int i = 1; i <= 100; i++)
+        queue->PushOne(i);
+
+    // every object is handled once before the workers exit
+    queue->Close();
+    taskHandle->Join();
+
+    BOOST_REQUIRE_EQUAL(sum.load(), 5050);
+    BOOST_REQUIRE_EQUAL(beginCount.load(), 1);
+    BOOST_REQUIRE_EQUAL(endCount.load(), 1);
+    BOOST_REQUIRE(threadIds.size() > 1);
+
+    // Cancel() stops all workers on a pool
+    endCount = 0;
+    auto executor = Async::ThreadPoolExecutor::New(3);
+    queue = Async::ObservableQueue<int>::New();
+    taskHandle = Async::Observe(
+        queue
+    ).ReceiveSome([](std::vector<int>) {
+    }).OnEnd([&endCount] {
+        endCount++;
+    }).Run(executor, 3);
+
+    taskHandle->Cancel();
+    taskHandle->Join();
+
+    BOOST_REQUIRE_EQUAL(endCount.load(), 1);
+
+    // Run() doesn't wait for a worker, from a task on the same pool, or with every thread busy
+    auto singleThread = Async::ThreadPoolExecutor::New(1);
+    sum = 0;
+    queue = Async::ObservableQueue<int>::New();
+    auto observeQueue = queue;
+    auto started = Async::Spawn([observeQueue, &sum, singleThread] {
+        return Async::Observe(
+            observeQueue
+        ).ReceiveOne([&sum](int object) {
+            sum += object;
+        }).Run(singleThread);
+    }).Run(singleThread);
+    BOOST_REQUIRE(started->WaitFor(std::chrono::seconds(10)));
+
+    auto busyQueue = Async::ObservableQueue<int>::New();
+    auto busyHandle = Async::Observe(
+        busyQueue
+    ).ReceiveOne([&sum](int object) {
+        sum += object;
+    }).Run(singleThread, 2);
+
+    queue->PushOne(1);
+    queue->Close();
+    started->GetResult()->Join();
+    busyQueue->PushOne(2);
+    busyQueue->Close();
+    busyHandle->Join();
+    BOOST_REQUIRE_EQUAL(sum.load(), 3);
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncObservePartitionBy)
+{
+    typedef std::pair<int, int> Event; // key, sequence
+    const int keyCount = 8, eventsPerKey = 50;
+
+    std::mutex resultsMutex;
+    std::vector<std::vector<int> > results(keyCount);
+
+    auto queue = Async::ObservableQueue<Event>::New();
+    auto taskHandle = Async::Observe(
+        queue
+    ).PartitionBy([](const Event& event) {
+        return event.first;
+    }, 4).ReceiveOne([&](Event event) {
+        std::lock_guard<std::mutex> lock(resultsMutex);
+        results[event.first].push_back(event.second);
+    }).Run();
+
+    for (int sequence = 0; sequence < eventsPerKey; sequence++)
+        for (int key = 0; key < keyCount; key++)
+            queue->PushOne(Event(key, sequence));
+
+    queue->Close();
+    taskHandle->Join();
+
+    // FIFO within every key
+    for (auto& sequences : results)
+    {
+        BOOST_REQUIRE_EQUAL(sequences.size(), size_t(eventsPerKey));
+        for (int i = 0; i < eventsPerKey; i++)
+            BOOST_REQUIRE_EQUAL(sequences[i], i);
+    }
+
+    // a stuck key doesn't stall the keys of other partitions
+    const int hotKey = 0;
+    auto partitionOf = [](int key) {
+        return std::hash<int>()(key) % 4;
+    };
+
+    std::promise<void> othersDone;
+    auto othersDoneFuture = othersDone.get_future().share();
+    std::atomic<int> otherCount(0), otherExpected(0);
+    std::atomic<bool> hotWaited(false);
+
+    queue = Async::ObservableQueue<Event>::New();
+    taskHandle = Async::Observe(
+        queue
+    ).PartitionBy([](const Event& event) {
+        return event.first;
+    }, 4).ReceiveOne([&](Event event) {
+        if (event.first == hotKey)
+        {
+            hotWaited = othersDoneFuture.wait_for(std::chrono::seconds(5)) == std::future_status::ready;
+            return;
+        }
+        if (++otherCount == otherExpected.load())
+            othersDone.set_value();
+    }).Run();
+
+    for (int key = 1; key < keyCount; key++)
+        if (partitionOf(key) != partitionOf(hotKey))
+            otherExpected += eventsPerKey;
+
+    queue->PushOne(Event(hotKey, 0));
+    for (int sequence = 0; sequence < eventsPerKey; sequence++)
+        for (int key = 1; key < keyCount; key++)
+            if (partitionOf(key) != partitionOf(hotKey))
+                queue->PushOne(Event(key, sequence));
+
+    queue->Close();
+    taskHandle->Join();
+
+    BOOST_REQUIRE(hotWaited.load());
+
+    // on a pool with fewer threads than partitions, the dispatcher runs first
+    auto smallPool = Async::ThreadPoolExecutor::New(2);
+    std::atomic<int> delivered(0);
+    queue = Async::ObservableQueue<Event>::New();
+    auto partitioned = Async::Observe(
+        queue
+    ).PartitionBy([](const Event& event) {
+        return event.first;
+    }, 4).ReceiveOne([&delivered](Event) {
+        delivered++;
+    });
+
+    taskHandle = partitioned.Run(smallPool);
+    for (int key = 0; key < keyCount; key++)
+        queue->PushOne(Event(key, 0));
+    queue->Close();
+    taskHandle->Join();
+    BOOST_REQUIRE_EQUAL(delivered.load(), keyCount);
+
+    // every run gets its own partition queues
+    delivered = 0;
+    queue = Async::ObservableQueue<Event>::New();
+    auto rerun = Async::Observe(
+        queue
+    ).PartitionBy([](const Event& event) {
+        return event.first;
+    }, 4).ReceiveOne([&delivered](Event) {
+        delivered++;
+    });
+
+    taskHandle = rerun.Run();
+    for (int key = 0; key < keyCount; key++)
+        queue->PushOne(Event(key, 0));
+    while (delivered.load() < keyCount)
+        std::this_thread::yield();
+    taskHandle->Cancel();
+    taskHandle->Join();
+
+    taskHandle = rerun.Run();
+    for (int key = 0; key < keyCount; key++)
+        queue->PushOne(Event(key, 1));
+    queue->Close();
+    taskHandle->Join();
+    BOOST_REQUIRE_EQUAL(delivered.load(), 2 * keyCount);
+
+    // a full partition stalls the dispatcher, so the producer of a bounded source is throttled
+    std::promise<void> release;
+    auto releaseFuture = release.get_future().share();
+    std::atomic<int> pushed(0);
+    delivered = 0;
+    queue = Async::ObservableQueue<Event>::New(nullptr, 4);
+    taskHandle = Async::Observe(
+        queue
+    ).PartitionBy([](const Event& event) {
+        return event.first;
+    }, 4).ReceiveOne([&delivered, releaseFuture](Event) {
+        releaseFuture.wait();
+        delivered++;
+    }).Run();
+
+    std::thread producer([&queue, &pushed, hotKey] {
+        for (int sequence = 0; sequence < eventsPerKey; sequence++)
+        {
+            queue->PushOne(Event(hotKey, sequence));
+            pushed++;
+        }
+        queue->Close();
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    BOOST_REQUIRE(pushed.load() <= 4 + 4 + 2); // the source, the partition, the dispatcher and the worker
+
+    release.set_value();
+    producer.join();
+    taskHandle->Join();
+    BOOST_REQUIRE_EQUAL(delivered.load(), eventsPerKey);
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncTask_Fused)
+{
+    std::string result;
+    Async::iTaskHandle::ptr taskHandle = Async::SpawnFused([] {
+        return 1;
+    }).Get([](int value) {
+        return value + 1;
+    }).Then([] {
+        return std::string("three");
+    }).Get([&result](std::string value) {
+        result = value;
+    }).Run(Async::RunMode_Sync);
+
+    BOOST_REQUIRE_EQUAL(result, "three");
+
+    // the erased task takes the handlers of a Task
+    bool exceptionHandled = false;
+    Async::SpawnFused([] {
+        return 1;
+    }).Get([](int) {
+        throw std::runtime_error("fused");
+    }).ToTask().OnException([&exceptionHandled](std::exception_ptr) {
+        exceptionHandled = true;
+    }).Run(Async::RunMode_Sync);
+
+    BOOST_REQUIRE(exceptionHandled);
+
+    // the stages after ReceiveOne are skipped once the queue is closed
+    std::vector<int> results;
+    auto queue = Async::ObservableQueue<int>::New();
+    taskHandle = Async::Observe(
+        queue
+    ).ReceiveOneFused([](int object) {
+        return object * 2;
+    }).Get([](int object) {
+        return object + 1;
+    }).Get([&results](int object) {
+        results.push_back(object);
+    }).Run();
+
+    queue->PushSome(std::vector<int>({ 1, 2, 3 }));
+    queue->Close();
+    taskHandle->Join();
+
+    BOOST_REQUIRE(results == std::vector<int>({ 3, 5, 7 }));
+
+    // the stages are moved along the chain, so a move-only function can be fused
+    struct AddOwned
+    {
+        std::unique_ptr<int> Owned;
+
+        int operator()(int value)
+        {
+            return value + *Owned;
+        }
+    };
+    auto owned = Async::SpawnFused([] {
+        return 40;
+    }).Get(AddOwned{ std::unique_ptr<int>(new int(1)) }).Get(AddOwned{ std::unique_ptr<int>(new int(1)) }).Run(Async::RunMode_Sync);
+
+    BOOST_REQUIRE_EQUAL(owned->GetResult(), 42);
+
+    // a named chain is copied, and can be erased again
+    auto reused = Async::SpawnFused([] {
+        return 1;
+    }).Get([](int value) {
+        return value + 1;
+    });
+    BOOST_REQUIRE_EQUAL(reused.Run(Async::RunMode_Sync)->GetResult(), 2);
+    BOOST_REQUIRE_EQUAL(reused.Get([](int value) {
+        return value * 2;
+    }).Run(Async::RunMode_Sync)->GetResult(), 4);
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncTask_LongChain)
+{
+    // runs in a loop, not a recursion as deep as the chain
+    const int stageCount = 100000;
+
+    auto task = Async::Spawn([] {
+        return 0;
+    });
+    for (int i = 0; i < stageCount; i++)
+    {
+        task = task.Get([](int value) {
+            return value + 1;
+        });
+    }
+
+    int result = 0;
+    task.Get([&result](int value) {
+        result = value;
+    }).Run()->Join();
+
+    BOOST_REQUIRE_EQUAL(result, stageCount);
+
+    // an exception passes the handlers of the following stages
+    std::vector<int> handled;
+    auto throwing = Async::Spawn([] {
+        return 1;
+    }).OnException([&handled](std::exception_ptr) {
+        handled.push_back(0);
+    }).Get([](int) -> int {
+        throw std::runtime_error("stage 1");
+    }).OnException([&handled](std::exception_ptr) {
+        handled.push_back(1);
+    }).Get([](int value) {
+        return value;
+    }).OnException([&handled](std::exception_ptr) {
+        handled.push_back(2);
+    });
+    throwing.Run(Async::RunMode_Sync);
+
+    BOOST_REQUIRE(handled == std::vector<int>({ 1, 2 }));
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncUniqueFunction)
+{
+    struct Capture
+    {
+        int64_t Values[6];
+    };
+    Capture capture = { { 1, 2, 3, 4, 5, 6 } };
+    int64_t sum = 0;
+
+    // a 56 bytes capture stays in the inline buffer
+    size_t before = g_allocationCount.load();
+    {
+        Async::UniqueFunction<void()> function([capture, &sum] {
+            for (auto value : capture.Values)
+                sum += value;
+        });
+        Async::UniqueFunction<void()> moved(std::move(function));
+        moved();
+    }
+    BOOST_REQUIRE_EQUAL(g_allocationCount.load() - before, 0u);
+    BOOST_REQUIRE_EQUAL(sum, 21);
+
+    // while std::function allocates for it
+    before = g_allocationCount.load();
+    {
+        std::function<void()> function([capture, &sum] {
+            for (auto value : capture.Values)
+                sum += value;
+        });
+        function();
+    }
+    BOOST_REQUIRE(g_allocationCount.load() - before > 0);
+
+    // the allocations of a task chain, a std::function would take one more for each function
+    before = g_allocationCount.load();
+    Async::Spawn([capture] {
+        return capture.Values[0];
+    }).Get([capture](int64_t value) {
+        return value + capture.Values[1];
+    }).Get([&sum](int64_t value) {
+        sum = value;
+    }).Run(Async::RunMode_Sync);
+    const size_t chainAllocations = g_allocationCount.load() - before;
+    BOOST_REQUIRE_EQUAL(sum, 3);
+
+    before = g_allocationCount.load();
+    Async::Spawn([] {
+        return int64_t(1);
+    }).Get([](int64_t value) {
+        return value + 2;
+    }).Get([&sum](int64_t value) {
+        sum = value;
+    }).Run(Async::RunMode_Sync);
+    BOOST_REQUIRE_EQUAL(g_allocationCount.load() - before, chainAllocations);
+
+    // move-only captures
+    struct MoveOnly
+    {
+        std::unique_ptr<int> Value;
+
+        int operator()()
+        {
+            return *Value;
+        }
+    };
+
+    int result = 0;
+    Async::Spawn(MoveOnly{ std::unique_ptr<int>(new int(42)) }).Get([&result](int value) {
+        result = value;
+    }).Run(Async::RunMode_Sync);
+    BOOST_REQUIRE_EQUAL(result, 42);
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncCancellationToken)
+{
+    // a Cancel() of the root source reaches the linked sources, tasks and callbacks
+    Async::CancellationSource root;
+    Async::CancellationSource request(root.Token());
+    std::atomic<int> callbackCount(0);
+
+    auto callbackId = request.Token().Register([&callbackCount] {
+        callbackCount++;
+    });
+
+    std::atomic<bool> started(false);
+    auto spinning = Async::Spawn([&started] {
+        started = true;
+        while (!Async::Cancel::IsCancelled())
+            std::this_thread::yield();
+    }).CancelledBy(request.Token()).Run(Async::DedicatedThreadExecutor::New());
+
+    std::vector<int> received;
+    auto queue = Async::ObservableQueue<int>::New();
+    auto observing = Async::Observe(
+        queue
+    ).ReceiveOne([&received](int i) {
+        received.push_back(i);
+    }).CancelledBy(request.Token()).Run();
+
+    while (!started)
+        std::this_thread::yield();
+    queue->PushOne(1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    BOOST_REQUIRE(!request.IsCancelled());
+    root.Cancel();
+    BOOST_REQUIRE(request.IsCancelled());
+    BOOST_REQUIRE(request.Token().IsCancelled());
+    BOOST_REQUIRE_EQUAL(callbackCount.load(), 1);
+
+    // the spinning task sees the flag, the idle observer is woken up
+    spinning->Join();
+    observing->Join();
+    BOOST_REQUIRE_EQUAL(received.size(), 1u);
+
+    root.Cancel();
+    request.Token().Unregister(callbackId);
+    BOOST_REQUIRE_EQUAL(callbackCount.load(), 1);
+
+    // linked to an already cancelled token, cancelled from the start
+    bool cancelledAtStart = false;
+    Async::Spawn([&cancelledAtStart] {
+        cancelledAtStart = Async::Cancel::IsCancelled();
+    }).CancelledBy(Async::CancellationSource(root.Token()).Token()).Run(Async::RunMode_Sync);
+    BOOST_REQUIRE(cancelledAtStart);
+
+    // a default token is never cancelled
+    BOOST_REQUIRE(!Async::CancellationToken().IsCancelled());
+    bool cancelled = true;
+    Async::Spawn([&cancelled] {
+        cancelled = Async::Cancel::IsCancelled();
+    }).CancelledBy(Async::CancellationToken()).Run(Async::RunMode_Sync);
+    BOOST_REQUIRE(!cancelled);
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncNotifyNoCopy)
+{
+    // the notified data is handed to the handler by reference, never copied or moved
+    struct Payload
+    {
+        Payload(int value, int *copies)
+            : Value(value), Copies(copies)
+        {}
+
+        Payload(const Payload& other)
+            : Value(other.Value), Copies(other.Copies)
+        {
+            (*Copies)++;
+        }
+
+        Payload(Payload&& other)
+            : Value(other.Value), Copies(other.Copies)
+        {
+            (*Copies)++;
+        }
+
+        int Value;
+        int *Copies;
+    };
+
+    int copies = 0;
+    int sum = 0;
+
+    // no handler installed
+    Payload payload(1, &copies);
+    Async::Notify(payload);
+
+    Async::Spawn([&copies, &payload] {
+        Async::Notify(payload);
+        Async::Notify(static_cast<const Payload&>(payload));
+        Async::Notify(Payload(2, &copies));
+    }).Notified<Payload>([&sum](const Payload& data) {
+        sum += data.Value;
+    }).Run(Async::RunMode_Sync);
+
+    BOOST_REQUIRE_EQUAL(sum, 4);
+    BOOST_REQUIRE_EQUAL(copies, 0);
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncExecutionContext)
+{
+    // every task notifies its own handlers, a nested task doesn't see the outer ones
+    std::vector<std::string> testResults;
+    Async::Spawn([] {
+        Async::Notify(std::string("outer"));
+        Async::Spawn([] {
+            Async::Notify(std::string("inner"));
+        }).Run(Async::RunMode_Sync);
+        Async::Notify(std::string("outer again"));
+    }).Notified<std::string>([&testResults](const std::string& data) {
+        testResults.push_back(data);
+    }).Run(Async::RunMode_Sync);
+    BOOST_REQUIRE(testResults == std::vector<std::string>({ "outer", "outer again" }));
+
+    // the last handler of the same type wins
+    int received = 0;
+    Async::Spawn([] {
+        Async::Notify(1);
+    }).Notified<int>([&received](int) {
+        received = 1;
+    }).Notified<int>([&received](int) {
+        received = 2;
+    }).Run(Async::RunMode_Sync);
+    BOOST_REQUIRE_EQUAL(received, 2);
+
+    // outside of a task nobody is notified
+    BOOST_REQUIRE(Async::ExecutionContext::Current() == nullptr);
+    Async::Notify(3);
+
+    // the handlers don't cost an allocation per run
+    int sum = 0;
+    auto task = Async::Spawn([] {
+        Async::Notify(1);
+        Async::Notify(2.0);
+    }).Notified<int>([&sum](int i) {
+        sum += i;
+    }).Notified<double>([&sum](double d) {
+        sum += static_cast<int>(d);
+    });
+    auto plainTask = Async::Spawn([] {});
+
+    task.Run(Async::RunMode_Sync);
+    plainTask.Run(Async::RunMode_Sync);
+
+    size_t before = g_allocationCount.load();
+    task.Run(Async::RunMode_Sync);
+    const size_t notifiedAllocations = g_allocationCount.load() - before;
+
+    before = g_allocationCount.load();
+    plainTask.Run(Async::RunMode_Sync);
+    BOOST_REQUIRE_EQUAL(notifiedAllocations, g_allocationCount.load() - before);
+    BOOST_REQUIRE_EQUAL(sum, 6);
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncNotifiedOn)
+{
+    auto executor = Async::ThreadPoolExecutor::New(2);
+    const auto workerThread = std::make_shared<std::thread::id>();
+
+    // NotifyMode_All, every notification in order, on the executor
+    std::mutex mutex;
+    std::vector<int> received;
+    bool onOtherThread = true;
+    Async::Spawn([workerThread] {
+        *workerThread = std::this_thread::get_id();
+        for (int i = 0; i < 1000; i++)
+            Async::Notify(i);
+    }).NotifiedOn<int>(executor, [&mutex, &received, &onOtherThread, workerThread](int i) {
+        std::lock_guard<std::mutex> lock(mutex);
+        received.push_back(i);
+        onOtherThread = onOtherThread && std::this_thread::get_id() != *workerThread;
+    }).Run(Async::RunMode_Sync);
+
+    for (int retry = 0; retry < 500; retry++)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (received.size() == 1000)
+                break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        BOOST_REQUIRE_EQUAL(received.size(), 1000u);
+        for (int i = 0; i < 1000; i++)
+            BOOST_REQUIRE_EQUAL(received[i], i);
+        BOOST_REQUIRE(onOtherThread);
+        received.clear();
+    }
+
+    // NotifyMode_Latest, a slow handler only gets some of them, always the newer ones
+    // and the last one at the end
+    Async::Spawn([] {
+        for (int i = 1; i <= 10000; i++)
+            Async::Notify(i);
+    }).NotifiedOn<int>(executor, [&mutex, &received](int i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        std::lock_guard<std::mutex> lock(mutex);
+        received.push_back(i);
+    }, Async::NotifyPolicy::Latest()).Run(Async::RunMode_Sync);
+
+    for (int retry = 0; retry < 500; retry++)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!received.empty() && received.back() == 10000)
+                break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        BOOST_REQUIRE_EQUAL(received.back(), 10000);
+        BOOST_REQUIRE(received.size() < 10000u);
+        BOOST_REQUIRE(std::is_sorted(received.begin(), received.end()));
+        received.clear();
+    }
+
+    // at most 20 per second, notifying for 200ms
+    std::atomic<int> deliveries(0);
+    std::atomic<int> lastDelivered(0);
+    Async::Spawn([] {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+        int i = 0;
+        while (std::chrono::steady_clock::now() < deadline)
+            Async::Notify(++i);
+        Async::Notify(-1);
+    }).NotifiedOn<int>(executor, [&deliveries, &lastDelivered](int i) {
+        deliveries++;
+        lastDelivered = i;
+    }, Async::NotifyPolicy::AtMostPerSecond(20)).Run(Async::RunMode_Sync);
+
+    for (int retry = 0; retry < 500 && lastDelivered != -1; retry++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    BOOST_REQUIRE_EQUAL(lastDelivered.load(), -1);
+    BOOST_REQUIRE(deliveries.load() <= 6);
+
+    // the throttled delivery doesn't hold the executor thread while it waits
+    auto singleThread = Async::ThreadPoolExecutor::New(1);
+    std::atomic<int> throttled(0);
+    Async::Spawn([&throttled] {
+        Async::Notify(1);
+        while (throttled.load() != 1)
+            std::this_thread::yield();
+        Async::Notify(2);
+    }).NotifiedOn<int>(singleThread, [&throttled](int i) {
+        throttled = i;
+    }, Async::NotifyPolicy::AtMostPerSecond(1)).Run(Async::RunMode_Sync);
+
+    auto start = std::chrono::steady_clock::now();
+    Async::Spawn([] {}).Run(singleThread)->GetResult();
+    BOOST_REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(500));
+    BOOST_REQUIRE_EQUAL(throttled.load(), 1);
+
+    for (int retry = 0; retry < 300 && throttled.load() != 2; retry++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    BOOST_REQUIRE_EQUAL(throttled.load(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncTaskResult)
+{
+    auto executor = Async::ThreadPoolExecutor::New(2);
+
+    // the return of the last stage
+    std::atomic<bool> release(false);
+    auto result = Async::Spawn([&release] {
+        while (!release)
+            std::this_thread::yield();
+        return 21;
+    }).Get([](int i) {
+        return std::to_string(i * 2);
+    }).Run(executor);
+
+    std::string value;
+    BOOST_REQUIRE(!result->TryGet(value));
+    BOOST_REQUIRE(!result->WaitFor(std::chrono::milliseconds(10)));
+    release = true;
+    BOOST_REQUIRE(result->WaitFor(std::chrono::seconds(10)));
+    BOOST_REQUIRE(result->TryGet(value));
+    BOOST_REQUIRE_EQUAL(value, "42");
+    BOOST_REQUIRE_EQUAL(result->GetResult(), "42");
+    BOOST_REQUIRE(result->GetException() == nullptr);
+
+    // the exception travels as one exception_ptr, to the handlers and the result
+    std::vector<std::exception_ptr> handled;
+    bool skipped = true;
+    auto failed = Async::Spawn([] {
+        throw std::runtime_error("failed");
+        return 1;
+    }).Get([&skipped](int i) {
+        skipped = false;
+        return i;
+    }).OnException([&handled](std::exception_ptr exception) {
+        handled.push_back(exception);
+    }).Run(executor);
+
+    BOOST_REQUIRE_THROW(failed->GetResult(), std::runtime_error);
+    int ignored = 0;
+    BOOST_REQUIRE_THROW(failed->TryGet(ignored), std::runtime_error);
+    BOOST_REQUIRE(skipped);
+    BOOST_REQUIRE_EQUAL(handled.size(), 1u);
+    BOOST_REQUIRE(handled[0] == failed->GetException());
+
+    // a sync run is ready when Run returns, and still an iTaskHandle
+    auto voidResult = Async::Spawn([] {}).Run(Async::RunMode_Sync);
+    BOOST_REQUIRE(voidResult->IsReady());
+    BOOST_REQUIRE(voidResult->TryGet());
+    voidResult->GetResult();
+
+    Async::iTaskHandle::ptr handle = Async::SpawnFused([] {
+        return 1;
+    }).Get([](int i) {
+        return i + 1;
+    }).Run(Async::RunMode_Sync);
+    handle->Join();
+
+    // a single consumer takes the value, which may be move-only
+    auto owned = Async::Spawn([] {
+        return std::unique_ptr<int>(new int(7));
+    }).Run(executor);
+    auto ownedValue = owned->TakeResult();
+    BOOST_REQUIRE(ownedValue && *ownedValue == 7);
+}
+
+#if ASYNC_HAS_COROUTINES
+BOOST_AUTO_TEST_CASE(TestAsyncCoroutine)
+{
+    // thousands of coroutines waiting on queues, without a thread each
+    auto executor = Async::ThreadPoolExecutor::New(2);
+    typedef Async::ObservableQueue<int> Queue;
+
+    auto consume = [](std::shared_ptr<Queue> queue) -> Async::CoTask<int> {
+        int sum = 0;
+        while (auto object = co_await queue->Pop())
+            sum += *object;
+        co_return sum;
+    };
+
+    std::vector<std::shared_ptr<Queue> > queues;
+    std::vector<Async::CoTask<int> > consumers;
+    for (int i = 0; i < 2000; i++)
+    {
+        queues.push_back(Queue::New());
+        consumers.push_back(consume(queues.back()));
+    }
+
+    for (int i = 0; i < 2000; i++)
+    {
+        executor->Post([queue = queues[i], i] {
+            queue->PushOne(i);
+            queue->PushSome(std::vector<int>({ 1, 2 }));
+            queue->Close();
+        });
+    }
+
+    for (int i = 0; i < 2000; i++)
+        BOOST_REQUIRE_EQUAL(consumers[i].Get(), i + 3);
+
+    // co_await PopSome
+    auto batches = [](std::shared_ptr<Queue> queue) -> Async::CoTask<size_t> {
+        size_t count = 0;
+        while (true)
+        {
+            auto objects = co_await queue->PopSome();
+            if (objects.empty())
+                co_return count;
+            count += objects.size();
+        }
+    };
+    auto queue = Queue::New();
+    auto batchConsumer = batches(queue);
+    queue->PushSome(std::vector<int>({ 1, 2, 3 }));
+    queue->PushOne(4);
+    queue->Close();
+    BOOST_REQUIRE_EQUAL(batchConsumer.Get(), 4u);
+
+    // Cancel() resumes a coroutine suspended on an empty queue, with an empty result
+    auto waitQueue = Queue::New();
+    auto waiting = consume(waitQueue);
+    waitQueue->PushOne(5);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    BOOST_REQUIRE(!waiting.IsReady());
+    waiting.Cancel();
+    BOOST_REQUIRE_EQUAL(waiting.Get(), 5);
+    BOOST_REQUIRE(waiting.IsCancelled());
+
+    // the push waking a cancelled waiter wakes the next one instead
+    auto popOne = [](std::shared_ptr<Queue> queue) -> Async::CoTask<int> {
+        auto object = co_await queue->Pop();
+        co_return object ? *object : -1;
+    };
+    auto sharedQueue = Queue::New();
+    auto cancelledWaiter = popOne(sharedQueue);
+    auto nextWaiter = popOne(sharedQueue);
+    cancelledWaiter.Cancel();
+    BOOST_REQUIRE_EQUAL(cancelledWaiter.Get(), -1);
+
+    sharedQueue->PushOne(7);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!nextWaiter.IsReady() && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::yield();
+    BOOST_REQUIRE(nextWaiter.IsReady());
+    BOOST_REQUIRE_EQUAL(nextWaiter.Get(), 7);
+
+    // co_await a Task, or the result of Run, and another coroutine
+    auto chain = [](Async::iExecutor::ptr executor) -> Async::CoTask<std::string> {
+        int first = co_await Async::Spawn([] {
+            return 20;
+        });
+        std::string second = co_await Async::Spawn([first] {
+            return first + 1;
+        }).Get([](int i) {
+            return std::to_string(i * 2);
+        }).Run(executor);
+
+        try
+        {
+            co_await Async::Spawn([] {
+                throw std::runtime_error("failed");
+            });
+        }
+        catch (const std::runtime_error&)
+        {
+            second += " caught";
+        }
+        co_return second;
+    };
+
+    auto outer = [](Async::CoTask<std::string> inner) -> Async::CoTask<std::string> {
+        co_return (co_await inner) + "!";
+    };
+    BOOST_REQUIRE_EQUAL(outer(chain(executor)).Get(), "42 caught!");
+
+    // a move-only return is moved to the coroutine
+    auto owning = []() -> Async::CoTask<int> {
+        std::unique_ptr<int> owned = co_await Async::Spawn([] {
+            return std::unique_ptr<int>(new int(7));
+        });
+        co_return *owned;
+    };
+    BOOST_REQUIRE_EQUAL(owning().Get(), 7);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(TestAsyncWhenAll)
+{
+    auto executor = Async::ThreadPoolExecutor::New(4);
+
+    // the returns in the order of the tasks, whichever completes first
+    std::vector<Async::Task<int> > tasks;
+    for (int i = 0; i < 100; i++)
+    {
+        tasks.push_back(Async::Spawn([i] {
+            if (i % 10 == 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            return i * 2;
+        }));
+    }
+    auto all = Async::WhenAll(tasks, executor);
+    auto& values = all->GetResult();
+    BOOST_REQUIRE_EQUAL(values.size(), 100u);
+    for (int i = 0; i < 100; i++)
+        BOOST_REQUIRE_EQUAL(values[i], i * 2);
+
+    std::atomic<int> count(0);
+    std::vector<Async::Task<void> > voidTasks;
+    for (int i = 0; i < 10; i++)
+    {
+        voidTasks.push_back(Async::Spawn([&count] {
+            count++;
+        }));
+    }
+    Async::WhenAll(voidTasks, executor)->GetResult();
+    BOOST_REQUIRE_EQUAL(count.load(), 10);
+    BOOST_REQUIRE(Async::WhenAll(std::vector<Async::Task<int> >())->GetResult().empty());
+
+    // tasks of different types
+    auto tuple = Async::WhenAll(executor, Async::Spawn([] {
+        return 1;
+    }), Async::Spawn([] {
+        return std::string("two");
+    }))->GetResult();
+    BOOST_REQUIRE_EQUAL(std::get<0>(tuple), 1);
+    BOOST_REQUIRE_EQUAL(std::get<1>(tuple), "two");
+
+    // the first exception cancels the other tasks
+    auto cancelled = std::make_shared<std::atomic<bool> >(false);
+    auto failed = Async::WhenAll(executor, Async::Spawn([cancelled] {
+        while (!Async::Cancel::IsCancelled())
+            std::this_thread::yield();
+        *cancelled = true;
+        return 1;
+    }), Async::Spawn([] {
+        throw std::runtime_error("failed");
+        return 2;
+    }));
+    BOOST_REQUIRE_THROW(failed->GetResult(), std::runtime_error);
+    BOOST_REQUIRE(cancelled->load());
+
+    // the first task to return wins, the others are cancelled
+    auto slowCancelled = std::make_shared<std::atomic<bool> >(false);
+    auto any = Async::WhenAny(executor, Async::Spawn([slowCancelled] {
+        while (!Async::Cancel::IsCancelled())
+            std::this_thread::yield();
+        *slowCancelled = true;
+        return 1;
+    }), Async::Spawn([] {
+        throw std::runtime_error("failed");
+        return 2;
+    }), Async::Spawn([] {
+        return 3;
+    }));
+    auto first = any->GetResult();
+    BOOST_REQUIRE_EQUAL(first.first, 2u);
+    BOOST_REQUIRE_EQUAL(first.second, 3);
+    while (!slowCancelled->load())
+        std::this_thread::yield();
+
+    // it fails only if all tasks fail
+    std::vector<Async::Task<void> > failing;
+    for (int i = 0; i < 3; i++)
+    {
+        failing.push_back(Async::Spawn([] {
+            throw std::runtime_error("failed");
+        }));
+    }
+    BOOST_REQUIRE_THROW(Async::WhenAny(failing, executor)->GetResult(), std::runtime_error);
+    BOOST_REQUIRE_THROW(Async::WhenAny(std::vector<Async::Task<int> >()), std::invalid_argument);
+
+    // Cancel() on the combined result cancels every task
+    std::vector<Async::Task<void> > waiting;
+    for (int i = 0; i < 3; i++)
+    {
+        waiting.push_back(Async::Spawn([] {
+            while (!Async::Cancel::IsCancelled())
+                std::this_thread::yield();
+        }));
+    }
+    auto combined = Async::WhenAll(waiting, executor);
+    BOOST_REQUIRE(!combined->WaitFor(std::chrono::milliseconds(10)));
+    combined->Cancel();
+    combined->GetResult();
+
+    // the returns are moved through, so they may be move-only
+    typedef std::unique_ptr<int> Owned;
+    std::vector<Async::Task<Owned> > owning;
+    for (int i = 0; i < 3; i++)
+    {
+        owning.push_back(Async::Spawn([i] {
+            return Owned(new int(i));
+        }));
+    }
+    auto ownedAll = Async::WhenAll(owning, executor)->TakeResult();
+    BOOST_REQUIRE_EQUAL(ownedAll.size(), 3u);
+    BOOST_REQUIRE_EQUAL(*ownedAll[2], 2);
+
+    auto ownedTuple = Async::WhenAll(executor, Async::Spawn([] {
+        return Owned(new int(1));
+    }), Async::Spawn([] {
+        return std::string("two");
+    }))->TakeResult();
+    BOOST_REQUIRE_EQUAL(*std::get<0>(ownedTuple), 1);
+
+    auto ownedAny = Async::WhenAny(executor, Async::Spawn([] {
+        return Owned(new int(5));
+    }))->TakeResult();
+    BOOST_REQUIRE_EQUAL(*ownedAny.second, 5);
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncParallel)
+{
+    auto executor = Async::WorkStealingExecutor::New(4);
+
+    // every index once
+    std::vector<std::atomic<int> > hits(10000);
+    for (auto& hit : hits)
+        hit = 0;
+    Async::ParallelFor(size_t(0), hits.size(), [&hits](size_t i) {
+        hits[i]++;
+    }, executor);
+    for (auto& hit : hits)
+        BOOST_REQUIRE_EQUAL(hit.load(), 1);
+
+    std::vector<int> input(10000);
+    for (size_t i = 0; i < input.size(); i++)
+        input[i] = int(i);
+    std::vector<long long> output(input.size());
+    auto outputEnd = Async::ParallelTransform(input.begin(), input.end(), output.begin(), [](int i) {
+        return (long long)i * i;
+    }, executor);
+    BOOST_REQUIRE(outputEnd == output.end());
+    for (size_t i = 0; i < output.size(); i++)
+        BOOST_REQUIRE_EQUAL(output[i], (long long)i * i);
+
+    BOOST_REQUIRE_EQUAL(Async::ParallelReduce(output.begin(), output.end(), 0LL, [](long long a, long long b) {
+        return a + b;
+    }, executor), 333283335000LL);
+
+    // the chunks are combined in order
+    std::vector<std::string> letters;
+    for (int i = 0; i < 1000; i++)
+        letters.push_back(std::string(1, char('a' + i % 26)));
+    std::string expected = "^";
+    for (auto& letter : letters)
+        expected += letter;
+    BOOST_REQUIRE_EQUAL(Async::ParallelReduce(letters.begin(), letters.end(), std::string("^"), [](const std::string& a, const std::string& b) {
+        return a + b;
+    }, executor), expected);
+
+    // the first exception is rethrown, the rest of chunks are skipped
+    std::atomic<int> called(0);
+    BOOST_REQUIRE_THROW(Async::ParallelFor(0, 100000, [&called](int i) {
+        called++;
+        if (i == 10)
+            throw std::runtime_error("failed");
+    }, executor, 100), std::runtime_error);
+    BOOST_REQUIRE_LT(called.load(), 100000);
+
+    // from a task on a single thread executor: the caller runs the chunks, sees the cancellation,
+    // and Notify reaches the handler of the task
+    auto singleThread = Async::ThreadPoolExecutor::New(1);
+    std::atomic<int> progress(0);
+    std::atomic<int> processed(0);
+    Async::Spawn([&processed] {
+        Async::ParallelFor(0, 100000, [&processed](int i) {
+            processed++;
+            Async::Notify(i);
+            if (i == 5000)
+                Async::Cancel::CancelCurrentTask();
+        }, nullptr, 100);
+        BOOST_REQUIRE(Async::Cancel::IsCancelled());
+    }).Notified<int>([&progress](const int&) {
+        progress++;
+    }).Run(singleThread)->GetResult();
+    BOOST_REQUIRE_LT(processed.load(), 100000);
+    BOOST_REQUIRE_EQUAL(progress.load(), processed.load());
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncTimer)
+{
+    auto executor = Async::ThreadPoolExecutor::New(2);
+    typedef std::chrono::steady_clock Clock;
+
+    // never early
+    auto start = Clock::now();
+    std::atomic<bool> fired(false);
+    auto delayed = Async::Delay(std::chrono::milliseconds(20), [&fired] {
+        fired = true;
+    }, executor);
+    delayed->GetResult();
+    BOOST_REQUIRE(fired.load());
+    BOOST_REQUIRE(Clock::now() - start >= std::chrono::milliseconds(20));
+
+    auto failed = Async::Delay(std::chrono::milliseconds(1), [] {
+        throw std::runtime_error("failed");
+    }, executor);
+    BOOST_REQUIRE_THROW(failed->GetResult(), std::runtime_error);
+
+    // cancelled before it is due, it completes without running
+    std::atomic<bool> cancelledFired(false);
+    auto cancelled = Async::Delay(std::chrono::seconds(10), [&cancelledFired] {
+        cancelledFired = true;
+    }, executor);
+    cancelled->Cancel();
+    BOOST_REQUIRE(cancelled->WaitFor(std::chrono::seconds(1)));
+    BOOST_REQUIRE(!cancelledFired.load());
+
+    // periodic until cancelled
+    std::atomic<int> ticks(0);
+    auto periodic = Async::Every(std::chrono::milliseconds(2), [&ticks] {
+        ticks++;
+    }, executor);
+    while (ticks.load() < 5)
+        std::this_thread::yield();
+    periodic->Cancel();
+    periodic->GetResult();
+    const int stopped = ticks.load();
+    Async::Delay(std::chrono::milliseconds(10))->GetResult();
+    BOOST_REQUIRE_LE(ticks.load(), stopped + 1);
+
+    // stopped by an exception, the timer releases func and what it holds
+    auto captured = std::make_shared<int>(0);
+    std::weak_ptr<int> capturedWeak = captured;
+    auto throwing = Async::Every(std::chrono::milliseconds(1), [captured] {
+        throw std::runtime_error("failed");
+    }, executor);
+    captured = nullptr;
+    BOOST_REQUIRE_THROW(throwing->GetResult(), std::runtime_error);
+    throwing = nullptr;
+    for (int i = 0; i < 1000 && !capturedWeak.expired(); i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    BOOST_REQUIRE(capturedWeak.expired());
+
+    // the timeout fires the cancel trigger of the run
+    auto timedOut = Async::Spawn([] {
+        while (!Async::Cancel::IsCancelled())
+            std::this_thread::yield();
+        return 1;
+    }).WithTimeout(std::chrono::milliseconds(20)).Run(executor);
+    BOOST_REQUIRE(timedOut->WaitFor(std::chrono::seconds(10)));
+
+    auto inTime = Async::Spawn([] {
+        return Async::Cancel::IsCancelled();
+    }).WithTimeout(std::chrono::seconds(10)).Run(executor);
+    BOOST_REQUIRE(!inTime->GetResult());
+
+    // many pending timers, inserted and cancelled in O(1)
+    Async::TimerService service;
+    std::vector<Async::TimerService::Timer> timers;
+    for (int i = 0; i < 100000; i++)
+        timers.push_back(service.Schedule(Clock::now() + std::chrono::hours(1) + std::chrono::seconds(i), Clock::duration::zero(), [] {}));
+    BOOST_REQUIRE_EQUAL(service.PendingCount(), 100000u);
+    for (auto& timer : timers)
+        BOOST_REQUIRE(service.Cancel(timer));
+    BOOST_REQUIRE_EQUAL(service.PendingCount(), 0u);
+
+    // fired in order of their due time, through the levels of the wheel
+    std::mutex mutex;
+    std::vector<int> order;
+    std::atomic<int> remaining(200);
+    auto now = Clock::now();
+    for (int i = 199; i >= 0; i--)
+    {
+        service.Schedule(now + std::chrono::microseconds(i * 500), Clock::duration::zero(), [&mutex, &order, &remaining, i] {
+            std::lock_guard<std::mutex> lock(mutex);
+            order.push_back(i);
+            remaining--;
+        });
+    }
+    while (remaining.load() > 0)
+        std::this_thread::yield();
+    BOOST_REQUIRE(std::is_sorted(order.begin(), order.end()));
+}
+
+BOOST_AUTO_TEST_CASE(TestAsyncPriority)
+{
+    // one worker, held by the first task while the others queue up
+    auto executor = Async::PriorityExecutor::New(1, std::chrono::milliseconds(50));
+
+    std::atomic<bool> release(false);
+    auto blocker = Async::Spawn([&release] {
+        while (!release.load())
+            std::this_thread::yield();
+    }).Run(executor);
+
+    std::mutex mutex;
+    std::vector<int> order;
+    auto record = [&mutex, &order](int value) {
+        std::lock_guard<std::mutex> lock(mutex);
+        order.push_back(value);
+    };
+
+    auto low = Async::Spawn([&record] { record(2); }).Run(executor, Async::TaskPriority_Low);
+    auto normal = Async::Spawn([&record] { record(1); }).Run(executor);
+    auto high = Async::Spawn([&record] { record(0); }).Run(executor, Async::TaskPriority_High);
+
+    release = true;
+    low->GetResult();
+    normal->GetResult();
+    high->GetResult();
+    blocker->GetResult();
+    BOOST_REQUIRE(order == std::vector<int>({ 0, 1, 2 }));
+
+    // a task run from inside of a task inherits its priority
+    auto nested = Async::Spawn([executor] {
+        return Async::Spawn([] {
+            return *Async::ExecutorDetails::CurrentPriority();
+        }).Run(executor);
+    }).Run(executor, Async::TaskPriority_Low);
+    BOOST_REQUIRE_EQUAL(nested->GetResult()->GetResult(), Async::TaskPriority_Low);
+    BOOST_REQUIRE_EQUAL(Async::Spawn([] {
+        return *Async::ExecutorDetails::CurrentPriority();
+    }).Run(executor)->GetResult(), Async::TaskPriority_Normal);
+
+    // other executors run by their order, and only pass the priority on
+    auto pool = Async::ThreadPoolExecutor::New(1);
+    BOOST_REQUIRE_EQUAL(Async::Spawn([] {
+        return *Async::ExecutorDetails::CurrentPriority();
+    }).Run(pool, Async::TaskPriority_High)->GetResult(), Async::TaskPriority_High);
+
+    // aging: a low task still runs while high tasks keep coming
+    std::atomic<bool> stop(false);
+    std::atomic<int> highRuns(0);
+    std::function<void()> highLoad = [&] {
+        if (stop.load())
+            return;
+        highRuns++;
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+        Async::Spawn(highLoad).Run(executor);
+    };
+    Async::Spawn(highLoad).Run(executor, Async::TaskPriority_High);
+    Async::Spawn(highLoad).Run(executor, Async::TaskPriority_High);
+
+    auto starved = Async::Spawn([&highRuns] {
+        return highRuns.load();
+    }).Run(executor, Async::TaskPriority_Low);
+    BOOST_REQUIRE(starved->WaitFor(std::chrono::seconds(5)));
+    BOOST_REQUIRE_GT(starved->GetResult(), 0);
+    stop = true;
+
+    // the workers of an ObserveTask, and what they run, at its priority
+    auto queue = Async::ObservableQueue<int>::New();
+    std::atomic<int> observed(0);
+    std::atomic<int> observedPriority(-1);
+    auto observeHandle = Async::Observe(
+        queue
+    ).ReceiveOne([&observed, &observedPriority](int) {
+        observedPriority = *Async::ExecutorDetails::CurrentPriority();
+        observed++;
+    }).Run(executor, Async::TaskPriority_High);
+
+    for (int i = 0; i < 10; i++)
+        queue->PushOne(i);
+    queue->Close();
+    observeHandle->Join();
+    BOOST_REQUIRE_EQUAL(observed.load(), 10);
+    BOOST_REQUIRE_EQUAL(observedPriority.load(), Async::TaskPriority_High);
+}
+
 BOOST_AUTO_TEST_SUITE_END()